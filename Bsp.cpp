@@ -15,23 +15,1425 @@
 */
 
 #include "Bsp.hpp"
+#include "PlaneMaths.hpp"
+#include "ThreadPool.hpp"
 
+#include <cstdarg>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <type_traits>
 
 namespace Bsp {
 
-void GetCollisionBsp(
+// /////////////////////
+// Helpers
+// /////////////////////
+bool HeaderIsValid(const Header& header)
+{
+    return
+        (header.version == cQuake3BspVersion) &&
+        (header.magicString[0] == 'I') &&
+        (header.magicString[1] == 'B') &&
+        (header.magicString[2] == 'S') &&
+        (header.magicString[3] == 'P');
+}
+
+bool LumpsFitInFile(const Header& header, std::size_t fileByteCount)
+{
+    for (const auto& lump : header.lumps)
+    {
+        if  (
+                (lump.offsetInBytesFromStartOfFile < 0) ||
+                (lump.byteCount < 0) ||
+                (lump.offsetInBytesFromStartOfFile % 4) ||
+                (
+                    static_cast<std::size_t>(lump.offsetInBytesFromStartOfFile) +
+                    static_cast<std::size_t>(lump.byteCount) > fileByteCount
+                )
+            )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool ValidateLumps(const CollisionBsp& bsp)
+{
+    std::string error;
+
+    if (!ValidateCollisionBsp(bsp, error))
+    {
+        fprintf(stderr, "Invalid bsp: %s\n", error.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Checks the nodes are a tree no deeper than cMaxTraceDepth. That also
+// catches nodes that loop back on themselves, which would hang Trace().
+template<typename T>
+static bool TreeFitsTraceStack(Span<const T> nodes)
+{
+    struct Visit
+    {
+        int32_t     nodeIndex;
+        unsigned    depth;
+    };
+
+    std::vector<Visit> toVisit;
+    std::size_t visitCount = 0;
+
+    toVisit.push_back({0, 1});
+
+    while (!toVisit.empty())
+    {
+        const auto visit = toVisit.back();
+        toVisit.pop_back();
+
+        // A tree only gets to each node once.
+        if  (
+                (++visitCount > nodes.size()) ||
+                (visit.depth > cMaxTraceDepth)
+            )
+        {
+            return false;
+        }
+
+        for (auto child : nodes[visit.nodeIndex].childIndex)
+        {
+            if (child >= 0)
+            {
+                toVisit.push_back({child, visit.depth + 1});
+            }
+        }
+    }
+
+    return true;
+}
+
+// Elements per ParallelFor() chunk for the derived data passes.
+static const std::size_t cChunkSize = 1024;
+
+// How far a corner can be outside a plane and still count, in units.
+static const double cCornerTolerance = 0.01;
+
+// Brush AABBs are padded by as much as Trace() pads its own, to cover
+// rounding the corners to float.
+static const float cBrushAabbPadding = 0.125f;
+
+// For BrushCorners(), kept by its callers so they don't allocate per brush.
+struct BrushCornerScratch
+{
+    // Each side's normal then distance, in double precision.
+    std::vector<std::array<double, 4>>  sides;
+
+    // The three sides that meet at each corner, and where.
+    std::vector<std::array<int, 3>>     corners;
+    std::vector<std::array<double, 3>>  positions;
+};
+
+// Cross products of each pair of the three sides' normals, for solving by
+// Cramer's rule. Returns the determinant.
+static double SideCrosses(
+        const std::vector<std::array<double, 4>>& sides,
+        const std::array<int, 3>& corner,
+        double result[3][3])
+{
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        const auto& a = sides[corner[(i + 1) % 3]];
+        const auto& b = sides[corner[(i + 2) % 3]];
+
+        for (unsigned axis = 0; axis < 3; ++axis)
+        {
+            const auto next = (axis + 1) % 3;
+            const auto last = (axis + 2) % 3;
+
+            result[i][axis] = a[next] * b[last] - a[last] * b[next];
+        }
+    }
+
+    const auto& first = sides[corner[0]];
+
+    return
+        first[0] * result[0][0] +
+        first[1] * result[0][1] +
+        first[2] * result[0][2];
+}
+
+// Every point where three of the brush's sides meet inside all of the
+// others, and which sides they are. Solved in double precision, so nearly
+// parallel sides, like the long sides of a sliver, still give corners.
+static void BrushCorners(
+        const CollisionBsp& bsp,
+        int32_t brushIndex,
+        BrushCornerScratch& scratch)
+{
+    const auto& brush = bsp.brushes[brushIndex];
+
+    auto& sides = scratch.sides;
+
+    sides.clear();
+    scratch.corners.clear();
+    scratch.positions.clear();
+
+    for (int i = 0; i < brush.sideCount; ++i)
+    {
+        const auto& plane =
+            bsp.planes[bsp.brushSides[brush.firstBrushSideIndex + i].planeIndex];
+
+        sides.push_back(
+        {{
+            static_cast<double>(plane.normal.data[0]),
+            static_cast<double>(plane.normal.data[1]),
+            static_cast<double>(plane.normal.data[2]),
+            static_cast<double>(plane.distance)
+        }});
+    }
+
+    const int sideCount = brush.sideCount;
+
+    for (int i = 0; i < sideCount; ++i)
+    {
+        for (int j = i + 1; j < sideCount; ++j)
+        {
+            for (int k = j + 1; k < sideCount; ++k)
+            {
+                const std::array<int, 3> corner = {{i, j, k}};
+                double cross[3][3];
+
+                const auto determinant = SideCrosses(sides, corner, cross);
+
+                if (std::abs(determinant) < 1e-6)
+                {
+                    continue;
+                }
+
+                std::array<double, 3> position;
+
+                for (unsigned axis = 0; axis < 3; ++axis)
+                {
+                    position[axis] =
+                        (sides[i][3] * cross[0][axis] +
+                         sides[j][3] * cross[1][axis] +
+                         sides[k][3] * cross[2][axis]) / determinant;
+                }
+
+                bool inside = true;
+
+                for (int side = 0; side < sideCount && inside; ++side)
+                {
+                    inside =
+                        sides[side][0] * position[0] +
+                        sides[side][1] * position[1] +
+                        sides[side][2] * position[2] -
+                        sides[side][3] <= cCornerTolerance;
+                }
+
+                if (inside)
+                {
+                    scratch.corners.push_back(corner);
+                    scratch.positions.push_back(position);
+                }
+            }
+        }
+    }
+}
+
+void CalculateBrushAabbs(CollisionBsp& bsp, ThreadPool* pool)
+{
+    auto& brushAabbs = bsp.storage.brushAabbs;
+
+    brushAabbs.assign(bsp.brushes.size(), BrushAabb{});
+
+    // Calculate Brush AABB from the corners of the brush, rather than
+    // trusting the first 6 sides to be the axial ones.
+    ParallelFor(pool, bsp.brushes.size(), cChunkSize, [&] (auto first, auto last)
+    {
+        BrushCornerScratch scratch;
+
+        for (auto i = first; i < last; ++i)
+        {
+            auto& brushAabb = brushAabbs[i];
+
+            // Empty, so it never intersects anything.
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                brushAabb.aabbMin.data[axis] =  std::numeric_limits<float>::max();
+                brushAabb.aabbMax.data[axis] = -std::numeric_limits<float>::max();
+            }
+
+            BrushCorners(bsp, static_cast<int32_t>(i), scratch);
+
+            // Anything less doesn't enclose a volume.
+            if (scratch.corners.size() < 4)
+            {
+                continue;
+            }
+
+            double boundsMin[3];
+            double boundsMax[3];
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                boundsMin[axis] =  std::numeric_limits<double>::max();
+                boundsMax[axis] = -std::numeric_limits<double>::max();
+            }
+
+            for (const auto& position : scratch.positions)
+            {
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    boundsMin[axis] = std::min(boundsMin[axis], position[axis]);
+                    boundsMax[axis] = std::max(boundsMax[axis], position[axis]);
+                }
+            }
+
+            // Flat brushes don't enclose a volume either.
+            if  (
+                    (boundsMin[0] >= boundsMax[0]) ||
+                    (boundsMin[1] >= boundsMax[1]) ||
+                    (boundsMin[2] >= boundsMax[2])
+                )
+            {
+                continue;
+            }
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                brushAabb.aabbMin.data[axis] =
+                    static_cast<float>(boundsMin[axis]) - cBrushAabbPadding;
+                brushAabb.aabbMax.data[axis] =
+                    static_cast<float>(boundsMax[axis]) + cBrushAabbPadding;
+            }
+        }
+    });
+
+    bsp.brushAabbs = brushAabbs;
+}
+
+void ClassifyPlanes(CollisionBsp& bsp, ThreadPool* pool)
+{
+    auto& planeTypes = bsp.storage.planeTypes;
+
+    planeTypes.assign(bsp.planes.size(), PlaneType{});
+
+    ParallelFor(pool, bsp.planes.size(), cChunkSize, [&] (auto first, auto last)
+    {
+        for (auto i = first; i < last; ++i)
+        {
+            const auto& normal = bsp.planes[i].normal.data;
+            auto& type = planeTypes[i];
+
+            type.axis = NonAxial;
+
+            for (uint8_t axis = 0; axis < 3; ++axis)
+            {
+                if (normal[axis] < 0)
+                {
+                    type.signBits |= 1 << axis;
+                }
+
+                if ((normal[axis] == 1.0f) || (normal[axis] == -1.0f))
+                {
+                    type.axis = static_cast<PlaneAxis>(axis);
+                }
+            }
+        }
+    });
+
+    bsp.planeTypes = planeTypes;
+}
+
+void CopyBrushPlanes(CollisionBsp& bsp, ThreadPool* pool)
+{
+    auto& ranges    = bsp.storage.brushPlaneRanges;
+    auto& data      = bsp.storage.brushPlaneData;
+    auto& types     = bsp.storage.brushPlaneTypes;
+
+    ranges.resize(bsp.brushes.size());
+
+    // Can't be split up, each brush starts where the last one ended.
+    std::size_t total = 0;
+
+    for (unsigned i = 0; i < bsp.brushes.size(); ++i)
+    {
+        const auto sideCount = std::max(bsp.brushes[i].sideCount, 0);
+        const auto stride =
+            (sideCount + cBrushPlaneWidth - 1) & ~(cBrushPlaneWidth - 1);
+
+        ranges[i] =
+        {
+            static_cast<int32_t>(total),
+            stride,
+        };
+
+        total += 4 * static_cast<std::size_t>(stride);
+    }
+
+    data.resize(total);
+    types.resize(total / 4);
+
+    ParallelFor(pool, bsp.brushes.size(), cChunkSize, [&] (auto first, auto last)
+    {
+        for (auto i = first; i < last; ++i)
+        {
+            const auto& brush = bsp.brushes[i];
+            const auto& range = ranges[i];
+
+            auto* x = &data[range.first];
+            auto* y = x + range.stride;
+            auto* z = y + range.stride;
+            auto* d = z + range.stride;
+            auto* type = &types[range.first / 4];
+
+            for (int j = 0; j < range.stride; ++j)
+            {
+                if (j < brush.sideCount)
+                {
+                    const auto planeIndex =
+                        bsp.brushSides[brush.firstBrushSideIndex + j].planeIndex;
+
+                    const auto& plane = bsp.planes[planeIndex];
+
+                    x[j] = plane.normal.data[0];
+                    y[j] = plane.normal.data[1];
+                    z[j] = plane.normal.data[2];
+                    d[j] = plane.distance;
+                    type[j] = bsp.planeTypes[planeIndex];
+                }
+                else
+                {
+                    x[j] = 0.0f;
+                    y[j] = 0.0f;
+                    z[j] = 0.0f;
+                    d[j] = std::numeric_limits<float>::max();
+                    type[j] = {NonAxial, 0, {0, 0}};
+                }
+            }
+        }
+    });
+
+    bsp.brushPlaneRanges    = ranges;
+    bsp.brushPlaneData      = data;
+    bsp.brushPlaneTypes     = types;
+}
+
+// Levels laid out breadth first from the root. 63 nodes, which nearly
+// every trace goes through, so they stay in cache anyway.
+static const unsigned cTopNodeLevels = 6;
+
+// Levels per cluster below that. 7 nodes, a few cache lines.
+static const unsigned cClusterNodeLevels = 3;
+
+// Trace node order, as nodes indices.
+static std::vector<int32_t> ClusteredNodeOrder(const CollisionBsp& bsp)
+{
+    const auto nodeCount = bsp.nodes.size();
+
+    std::vector<int32_t> order;
+    std::vector<bool> placed(nodeCount, false);
+    std::deque<int32_t> clusterRoots;
+    std::vector<int32_t> level;
+    std::vector<int32_t> nextLevel;
+
+    order.reserve(nodeCount);
+
+    if (nodeCount)
+    {
+        clusterRoots.push_back(0);
+    }
+
+    auto levelCount = cTopNodeLevels;
+
+    while (!clusterRoots.empty())
+    {
+        level.assign(1, clusterRoots.front());
+        clusterRoots.pop_front();
+
+        for (unsigned depth = 0; depth < levelCount; ++depth)
+        {
+            nextLevel.clear();
+
+            for (auto nodeIndex : level)
+            {
+                // Bsps are trees, but the file doesn't promise that.
+                if (placed[nodeIndex])
+                {
+                    continue;
+                }
+
+                placed[nodeIndex] = true;
+                order.push_back(nodeIndex);
+
+                for (auto child : bsp.nodes[nodeIndex].childIndex)
+                {
+                    if (child >= 0)
+                    {
+                        if (depth + 1 < levelCount)
+                        {
+                            nextLevel.push_back(child);
+                        }
+                        else
+                        {
+                            clusterRoots.push_back(child);
+                        }
+                    }
+                }
+            }
+
+            std::swap(level, nextLevel);
+        }
+
+        levelCount = cClusterNodeLevels;
+    }
+
+    // Anything the root can't get to goes on the end, in file order.
+    for (unsigned i = 0; i < nodeCount; ++i)
+    {
+        if (!placed[i])
+        {
+            order.push_back(static_cast<int32_t>(i));
+        }
+    }
+
+    return order;
+}
+
+void BuildTraceNodes(CollisionBsp& bsp, ThreadPool* pool, NodeLayout layout)
+{
+    auto& traceNodes    = bsp.storage.traceNodes;
+    auto& sources       = bsp.storage.traceNodeSources;
+
+    const auto nodeCount = bsp.nodes.size();
+
+    if (layout == NodeLayout::Clustered)
+    {
+        sources = ClusteredNodeOrder(bsp);
+    }
+    else
+    {
+        sources.resize(nodeCount);
+
+        for (unsigned i = 0; i < nodeCount; ++i)
+        {
+            sources[i] = static_cast<int32_t>(i);
+        }
+    }
+
+    std::vector<int32_t> newIndices(nodeCount);
+
+    for (unsigned i = 0; i < nodeCount; ++i)
+    {
+        newIndices[sources[i]] = static_cast<int32_t>(i);
+    }
+
+    traceNodes.resize(nodeCount);
+
+    ParallelFor(pool, nodeCount, cChunkSize, [&] (auto first, auto last)
+    {
+        for (auto i = first; i < last; ++i)
+        {
+            const auto& node = bsp.nodes[sources[i]];
+
+            // Leaves don't move.
+            auto child = [&] (int32_t childIndex)
+            {
+                return childIndex < 0 ? childIndex : newIndices[childIndex];
+            };
+
+            traceNodes[i] =
+            {
+                bsp.planes[node.planeIndex],
+                bsp.planeTypes[node.planeIndex],
+                {
+                    child(node.childIndex[0]),
+                    child(node.childIndex[1]),
+                },
+            };
+        }
+    });
+
+    bsp.traceNodes          = traceNodes;
+    bsp.traceNodeSources    = sources;
+}
+
+void BuildLeafBrushLists(
+        CollisionBsp& bsp,
+        const std::vector<int32_t>& contentsMasks,
+        ThreadPool* pool)
+{
+    auto& masks     = bsp.storage.leafBrushMasks;
+    auto& ranges    = bsp.storage.leafBrushRanges;
+    auto& entries   = bsp.storage.leafBrushEntries;
+
+    masks.assign(1, cContentsSolid);
+
+    for (auto mask : contentsMasks)
+    {
+        if (std::find(masks.begin(), masks.end(), mask) == masks.end())
+        {
+            masks.push_back(mask);
+        }
+    }
+
+    const auto leafCount = bsp.leaves.size();
+
+    auto isHittable = [&] (const LeafBrush& leafBrush, int32_t mask)
+    {
+        const auto& brush = bsp.brushes[leafBrush.brushIndex];
+
+        // Don't even bother if there are no brush sides.
+        return
+            (brush.sideCount > 0) &&
+            (bsp.textures[brush.textureIndex].contentFlags & mask) &&
+            (!BrushIsDegenerate(bsp.brushAabbs[leafBrush.brushIndex]));
+    };
+
+    // Count per leaf, prefix sum, then fill. Same result
+    // no matter how the leaves are split between threads.
+    ranges.assign(masks.size() * leafCount, LeafBrushRange{});
+
+    ParallelFor(pool, leafCount, cChunkSize, [&] (auto first, auto last)
+    {
+        for (std::size_t m = 0; m < masks.size(); ++m)
+        {
+            for (auto i = first; i < last; ++i)
+            {
+                const auto& leaf = bsp.leaves[i];
+
+                for (int j = 0; j < leaf.leafBrushCount; ++j)
+                {
+                    if (isHittable(bsp.leafBrushes[leaf.firstLeafBrushIndex + j], masks[m]))
+                    {
+                        ++ranges[m * leafCount + i].count;
+                    }
+                }
+            }
+        }
+    });
+
+    int32_t total = 0;
+
+    for (auto& range : ranges)
+    {
+        range.first = total;
+        total += range.count;
+    }
+
+    entries.resize(total);
+
+    ParallelFor(pool, leafCount, cChunkSize, [&] (auto first, auto last)
+    {
+        for (std::size_t m = 0; m < masks.size(); ++m)
+        {
+            for (auto i = first; i < last; ++i)
+            {
+                const auto& leaf = bsp.leaves[i];
+                auto output = ranges[m * leafCount + i].first;
+
+                for (int j = 0; j < leaf.leafBrushCount; ++j)
+                {
+                    const auto leafBrush =
+                        bsp.leafBrushes[leaf.firstLeafBrushIndex + j];
+
+                    if (isHittable(leafBrush, masks[m]))
+                    {
+                        const auto& brush = bsp.brushes[leafBrush.brushIndex];
+
+                        entries[output++] =
+                        {
+                            bsp.brushAabbs[leafBrush.brushIndex],
+                            leafBrush.brushIndex,
+                            bsp.textures[brush.textureIndex].contentFlags,
+                        };
+                    }
+                }
+            }
+        }
+    });
+
+    bsp.leafBrushMasks      = masks;
+    bsp.leafBrushRanges     = ranges;
+    bsp.leafBrushEntries    = entries;
+}
+
+int FindLeafBrushMask(const CollisionBsp& bsp, int32_t contentsMask)
+{
+    for (unsigned i = 0; i < bsp.leafBrushMasks.size(); ++i)
+    {
+        if (bsp.leafBrushMasks[i] == contentsMask)
+        {
+            return static_cast<int>(i);
+        }
+    }
+
+    return -1;
+}
+
+// /////////////////////
+// Brush BVH
+// /////////////////////
+
+// Cost of visiting a node for the surface area heuristic, where testing a
+// brush costs 1. Most brushes are rejected by their AABB, which costs about
+// the same as a node. Timings weren't very sensitive to it either way.
+static const float cBvhNodeCost = 1.0f;
+
+// Buckets per axis the brushes are sorted into when looking for a split.
+static const unsigned cBvhBinCount = 16;
+
+// Leaves get split past this, even if the heuristic says not to bother.
+static const int32_t cMaxBvhLeafBrushes = 8;
+
+// Past this depth nodes are split down the middle instead, which at most
+// adds another 32 levels, so the tree always fits Trace()'s stack.
+static const unsigned cMaxBvhHeuristicDepth = 64;
+
+// Brushes that can be hit further past their AABB than this, per unit
+// their planes are pushed out, are cBvhSpreadUnknown.
+static const double cMaxBvhSpread = 64.0;
+
+// How far past its AABB a brush can be hit, per unit its planes are pushed
+// out (see BvhNode::spread), or more than cMaxBvhSpread if it can't tell.
+//
+// Pushing the planes out by at most offset moves the brush's extreme along
+// u by at most offset * sum(y), for any y >= 0 with the y weighted sum of
+// the planes' normals equal to u, using only planes that meet at the
+// extreme (LP duality). So for each way along each axis, it's the smallest
+// sum over any three planes meeting at a corner at that extreme. An axial
+// plane facing that way on its own is 1, which is as small as it gets.
+static double BrushSpread(
+        const CollisionBsp& bsp,
+        int32_t brushIndex,
+        BrushCornerScratch& scratch)
+{
+    BrushCorners(bsp, brushIndex, scratch);
+
+    const auto& corners     = scratch.corners;
+    const auto& positions   = scratch.positions;
+
+    double extremes[3][2];
+
+    for (auto& extreme : extremes)
+    {
+        extreme[0] =  std::numeric_limits<double>::max();
+        extreme[1] = -std::numeric_limits<double>::max();
+    }
+
+    for (const auto& position : positions)
+    {
+        for (unsigned axis = 0; axis < 3; ++axis)
+        {
+            extremes[axis][0] = std::min(extremes[axis][0], position[axis]);
+            extremes[axis][1] = std::max(extremes[axis][1], position[axis]);
+        }
+    }
+
+    double spread = corners.empty() ? std::numeric_limits<double>::max() : 1.0;
+
+    for (unsigned axis = 0; axis < 3; ++axis)
+    {
+        for (unsigned positive = 0; positive < 2; ++positive)
+        {
+            const double sign = positive ? 1.0 : -1.0;
+            auto best = std::numeric_limits<double>::max();
+
+            for (std::size_t c = 0; c < corners.size(); ++c)
+            {
+                if (sign * (extremes[axis][positive] - positions[c][axis]) > cCornerTolerance)
+                {
+                    continue;
+                }
+
+                double cross[3][3];
+
+                const auto determinant = SideCrosses(scratch.sides, corners[c], cross);
+
+                // The weights are the axis components of the crosses.
+                double sum = 0.0;
+                bool valid = true;
+
+                for (const auto& row : cross)
+                {
+                    const auto weight = sign * row[axis] / determinant;
+
+                    valid = valid && (weight > -1e-6);
+                    sum += std::max(weight, 0.0);
+                }
+
+                if (valid)
+                {
+                    best = std::min(best, sum);
+                }
+            }
+
+            spread = std::max(spread, best);
+        }
+    }
+
+    return spread;
+}
+
+static BrushAabb EmptyAabb()
+{
+    return
+    {
+        {
+             std::numeric_limits<float>::max(),
+             std::numeric_limits<float>::max(),
+             std::numeric_limits<float>::max(),
+        },
+        {
+            -std::numeric_limits<float>::max(),
+            -std::numeric_limits<float>::max(),
+            -std::numeric_limits<float>::max(),
+        },
+    };
+}
+
+static void Grow(BrushAabb& aabb, const BrushAabb& other)
+{
+    aabb.aabbMin = Min(aabb.aabbMin, other.aabbMin);
+    aabb.aabbMax = Max(aabb.aabbMax, other.aabbMax);
+}
+
+// Half the surface area, which is all the heuristic needs.
+static float HalfArea(const BrushAabb& aabb)
+{
+    const auto size = aabb.aabbMax - aabb.aabbMin;
+
+    return
+        size.data[0] * size.data[1] +
+        size.data[1] * size.data[2] +
+        size.data[2] * size.data[0];
+}
+
+// Twice the centre, as only the order matters.
+static float Centre(const LeafBrushEntry& entry, unsigned axis)
+{
+    return entry.aabb.aabbMin.data[axis] + entry.aabb.aabbMax.data[axis];
+}
+
+// Adds the node for brushes [first, first + count), then its children
+// depth first.
+static void BuildBvhNode(
+        std::vector<BvhNode>& nodes,
+        std::vector<LeafBrushEntry>& brushes,
+        const std::vector<uint16_t>& spreads,
+        int32_t first,
+        int32_t count,
+        unsigned depth)
+{
+    const auto nodeIndex = nodes.size();
+    auto aabb = EmptyAabb();
+    auto centres = EmptyAabb();
+    uint16_t spread = cBvhSpreadOne;
+
+    for (auto i = first; i < first + count; ++i)
+    {
+        Grow(aabb, brushes[i].aabb);
+
+        spread = std::max(spread, spreads[brushes[i].brushIndex]);
+
+        for (unsigned axis = 0; axis < 3; ++axis)
+        {
+            const auto centre = Centre(brushes[i], axis);
+
+            centres.aabbMin.data[axis] = std::min(centres.aabbMin.data[axis], centre);
+            centres.aabbMax.data[axis] = std::max(centres.aabbMax.data[axis], centre);
+        }
+    }
+
+    nodes.push_back({aabb, first, 0, 0, spread});
+
+    auto bin = [&] (const LeafBrushEntry& entry, unsigned axis)
+    {
+        const auto low = centres.aabbMin.data[axis];
+        const auto scale = cBvhBinCount / (centres.aabbMax.data[axis] - low);
+        const auto index = static_cast<unsigned>((Centre(entry, axis) - low) * scale);
+
+        return std::min(index, cBvhBinCount - 1);
+    };
+
+    // Cheapest split between bins, as cost per brush test. Not splitting
+    // at all costs a test per brush.
+    const auto area = HalfArea(aabb);
+    auto bestCost = std::numeric_limits<float>::max();
+    unsigned bestAxis = 0;
+    unsigned bestBin = 0;
+
+    for (unsigned axis = 0; axis < 3; ++axis)
+    {
+        if  (
+                (depth >= cMaxBvhHeuristicDepth) ||
+                (area <= 0.0f) ||
+                (!(centres.aabbMax.data[axis] > centres.aabbMin.data[axis]))
+            )
+        {
+            continue;
+        }
+
+        BrushAabb binAabbs[cBvhBinCount];
+        int32_t binCounts[cBvhBinCount] = {};
+
+        for (auto& binAabb : binAabbs)
+        {
+            binAabb = EmptyAabb();
+        }
+
+        for (auto i = first; i < first + count; ++i)
+        {
+            const auto index = bin(brushes[i], axis);
+
+            Grow(binAabbs[index], brushes[i].aabb);
+            ++binCounts[index];
+        }
+
+        // Everything above each split, then sweep up from the bottom.
+        float aboveAreas[cBvhBinCount];
+        int32_t aboveCounts[cBvhBinCount];
+        auto above = EmptyAabb();
+        int32_t aboveCount = 0;
+
+        for (auto i = cBvhBinCount - 1; i > 0; --i)
+        {
+            Grow(above, binAabbs[i]);
+            aboveCount += binCounts[i];
+
+            aboveAreas[i]   = aboveCount ? HalfArea(above) : 0.0f;
+            aboveCounts[i]  = aboveCount;
+        }
+
+        auto below = EmptyAabb();
+        int32_t belowCount = 0;
+
+        for (unsigned i = 0; i + 1 < cBvhBinCount; ++i)
+        {
+            Grow(below, binAabbs[i]);
+            belowCount += binCounts[i];
+
+            if (!belowCount || !aboveCounts[i + 1])
+            {
+                continue;
+            }
+
+            const auto cost =
+                cBvhNodeCost +
+                (HalfArea(below) * belowCount +
+                 aboveAreas[i + 1] * aboveCounts[i + 1]) / area;
+
+            if (cost < bestCost)
+            {
+                bestCost    = cost;
+                bestAxis    = axis;
+                bestBin     = i;
+            }
+        }
+    }
+
+    if (bestCost >= count && count <= cMaxBvhLeafBrushes)
+    {
+        nodes[nodeIndex].brushCount = static_cast<uint8_t>(count);
+        return;
+    }
+
+    auto* begin = brushes.data() + first;
+    auto* end = begin + count;
+    LeafBrushEntry* middle;
+
+    if (bestCost < std::numeric_limits<float>::max())
+    {
+        middle = std::partition(begin, end, [&] (const LeafBrushEntry& entry)
+        {
+            return bin(entry, bestAxis) <= bestBin;
+        });
+    }
+    else
+    {
+        // Too deep, or every centre's the same. Halve it along the
+        // longest axis instead.
+        const auto size = centres.aabbMax - centres.aabbMin;
+
+        bestAxis =
+            size.data[0] >= size.data[1] && size.data[0] >= size.data[2] ? 0 :
+            size.data[1] >= size.data[2] ? 1 : 2;
+
+        middle = begin + count / 2;
+
+        std::nth_element(begin, middle, end, [&] (const auto& a, const auto& b)
+        {
+            const auto centreA = Centre(a, bestAxis);
+            const auto centreB = Centre(b, bestAxis);
+
+            return
+                centreA < centreB ||
+                (centreA == centreB && a.brushIndex < b.brushIndex);
+        });
+    }
+
+    const auto firstCount = static_cast<int32_t>(middle - begin);
+
+    nodes[nodeIndex].axis = static_cast<uint8_t>(bestAxis);
+
+    BuildBvhNode(nodes, brushes, spreads, first, firstCount, depth + 1);
+
+    nodes[nodeIndex].index = static_cast<int32_t>(nodes.size());
+
+    BuildBvhNode(nodes, brushes, spreads, first + firstCount, count - firstCount, depth + 1);
+}
+
+void BuildBrushBvh(CollisionBsp& bsp, ThreadPool* pool)
+{
+    auto& nodes     = bsp.storage.bvhNodes;
+    auto& brushes   = bsp.storage.bvhBrushes;
+
+    nodes.clear();
+    brushes.clear();
+
+    // Every brush in any leaf brush list, once each, in brush order. Brush
+    // models' brushes aren't in any leaf, so they're left out the same.
+    std::vector<bool> added(bsp.brushes.size(), false);
+
+    for (const auto& entry : bsp.leafBrushEntries)
+    {
+        if (!added[entry.brushIndex])
+        {
+            added[entry.brushIndex] = true;
+            brushes.push_back(entry);
+        }
+    }
+
+    std::sort(brushes.begin(), brushes.end(), [] (const auto& a, const auto& b)
+    {
+        return a.brushIndex < b.brushIndex;
+    });
+
+    // In 256ths, rounded up, see BvhNode::spread.
+    std::vector<uint16_t> spreads(bsp.brushes.size(), cBvhSpreadOne);
+
+    ParallelFor(pool, brushes.size(), cChunkSize, [&] (auto first, auto last)
+    {
+        BrushCornerScratch scratch;
+
+        for (auto i = first; i < last; ++i)
+        {
+            const auto brushIndex = brushes[i].brushIndex;
+            const auto spread = BrushSpread(bsp, brushIndex, scratch);
+
+            if (spread > cMaxBvhSpread)
+            {
+                spreads[brushIndex] = cBvhSpreadUnknown;
+            }
+            else if (spread > 1.0 + 1e-6)
+            {
+                spreads[brushIndex] = static_cast<uint16_t>(std::ceil(spread * cBvhSpreadOne));
+            }
+        }
+    });
+
+    if (!brushes.empty())
+    {
+        nodes.reserve(2 * brushes.size());
+
+        BuildBvhNode(nodes, brushes, spreads, 0, static_cast<int32_t>(brushes.size()), 0);
+    }
+
+    bsp.bvhNodes    = nodes;
+    bsp.bvhBrushes  = brushes;
+}
+
+void ClearBrushBvh(CollisionBsp& bsp)
+{
+    bsp.storage.bvhNodes.clear();
+    bsp.storage.bvhBrushes.clear();
+
+    bsp.bvhNodes    = {};
+    bsp.bvhBrushes  = {};
+}
+
+// /////////////////////
+// Derived Data
+// /////////////////////
+void BuildTraceData(
+        CollisionBsp& bsp,
+        const LoadOptions& options,
+        bool planesClassified)
+{
+    StageTimer timer(options.timings);
+
+    auto* threadPool = options.threadPool;
+
+    CalculateBrushAabbs(bsp, threadPool);
+    timer.Stage("Brush AABBs");
+
+    if (!planesClassified)
+    {
+        ClassifyPlanes(bsp, threadPool);
+        timer.Stage("Plane types");
+    }
+
+    CopyBrushPlanes(bsp, threadPool);
+    timer.Stage("Brush planes");
+
+    BuildTraceNodes(bsp, threadPool, options.nodeLayout);
+    timer.Stage("Trace nodes");
+
+    BuildLeafBrushLists(bsp, options.contentsMasks, threadPool);
+    timer.Stage("Leaf brush lists");
+
+    if (options.traceBackend == TraceBackend::BrushBvh)
+    {
+        BuildBrushBvh(bsp, threadPool);
+        timer.Stage("Brush BVH");
+    }
+}
+
+std::size_t CollisionBspByteCount(const CollisionBsp& bsp)
+{
+    auto bytes = [] (const auto& span)
+    {
+        return span.size() * sizeof(span[0]);
+    };
+
+    return
+        bytes(bsp.textures) +
+        bytes(bsp.planes) +
+        bytes(bsp.nodes) +
+        bytes(bsp.leaves) +
+        bytes(bsp.leafBrushes) +
+        bytes(bsp.brushes) +
+        bytes(bsp.brushSides) +
+        bytes(bsp.brushAabbs) +
+        bytes(bsp.planeTypes) +
+        bytes(bsp.brushPlaneRanges) +
+        bytes(bsp.brushPlaneData) +
+        bytes(bsp.brushPlaneTypes) +
+        bytes(bsp.traceNodes) +
+        bytes(bsp.traceNodeSources) +
+        bytes(bsp.leafBrushMasks) +
+        bytes(bsp.leafBrushRanges) +
+        bytes(bsp.leafBrushEntries) +
+        bytes(bsp.bvhNodes) +
+        bytes(bsp.bvhBrushes);
+}
+
+static void SetupExtraLumps(
+        CollisionBsp& bsp,
+        uint32_t extraLumpMask,
+        const uint8_t* fileData,
+        const std::string& filePath)
+{
+    extraLumpMask &= cExtraLumps;
+
+    if (!extraLumpMask)
+    {
+        return;
+    }
+
+    auto extra = std::make_unique<ExtraLumps>();
+
+    extra->mask     = extraLumpMask;
+    extra->header   = bsp.header;
+    extra->fileData = fileData;
+    extra->filePath = filePath;
+
+    bsp.storage.extraLumps = std::move(extra);
+}
+
+// /////////////////////
+// Validation
+// /////////////////////
+static bool Fail(std::string& error, const char* format, ...)
+{
+    char buffer[256];
+
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(buffer, sizeof(buffer), format, arguments);
+    va_end(arguments);
+
+    error = buffer;
+
+    return false;
+}
+
+bool ValidateCollisionBsp(const CollisionBsp& bsp, std::string& error)
+{
+    auto inRange = [] (int32_t index, std::size_t count)
+    {
+        return (index >= 0) && (static_cast<std::size_t>(index) < count);
+    };
+
+    auto rangeInRange = [] (int32_t first, int32_t count, std::size_t size)
+    {
+        return
+            (first >= 0) &&
+            (count >= 0) &&
+            (static_cast<std::size_t>(first) + static_cast<std::size_t>(count) <= size);
+    };
+
+    auto childInRange = [&] (int32_t childIndex)
+    {
+        return
+            childIndex < 0 ?
+                inRange(-(childIndex + 1), bsp.leaves.size()) :
+                inRange(childIndex, bsp.nodes.size());
+    };
+
+    // Trace() always starts at node 0.
+    if (bsp.nodes.empty() || bsp.leaves.empty())
+    {
+        return Fail(error, "No nodes or leaves.");
+    }
+
+    for (unsigned i = 0; i < bsp.nodes.size(); ++i)
+    {
+        const auto& node = bsp.nodes[i];
+
+        if (!inRange(node.planeIndex, bsp.planes.size()))
+        {
+            return Fail(error, "Node %u: plane %d out of range.", i, node.planeIndex);
+        }
+
+        if (!childInRange(node.childIndex[0]) || !childInRange(node.childIndex[1]))
+        {
+            return Fail(error, "Node %u: child out of range.", i);
+        }
+    }
+
+    if (!TreeFitsTraceStack(bsp.nodes))
+    {
+        return Fail(error, "Nodes aren't a tree, or are over %u deep.", cMaxTraceDepth);
+    }
+
+    for (unsigned i = 0; i < bsp.leaves.size(); ++i)
+    {
+        const auto& leaf = bsp.leaves[i];
+
+        if (!rangeInRange(
+                leaf.firstLeafBrushIndex,
+                leaf.leafBrushCount,
+                bsp.leafBrushes.size()))
+        {
+            return Fail(error, "Leaf %u: leaf brushes out of range.", i);
+        }
+    }
+
+    for (unsigned i = 0; i < bsp.leafBrushes.size(); ++i)
+    {
+        if (!inRange(bsp.leafBrushes[i].brushIndex, bsp.brushes.size()))
+        {
+            return Fail(error, "Leaf brush %u: brush out of range.", i);
+        }
+    }
+
+    for (unsigned i = 0; i < bsp.brushes.size(); ++i)
+    {
+        const auto& brush = bsp.brushes[i];
+
+        if (!rangeInRange(
+                brush.firstBrushSideIndex,
+                brush.sideCount,
+                bsp.brushSides.size()))
+        {
+            return Fail(error, "Brush %u: brush sides out of range.", i);
+        }
+
+        if (!inRange(brush.textureIndex, bsp.textures.size()))
+        {
+            return Fail(error, "Brush %u: texture %d out of range.", i, brush.textureIndex);
+        }
+    }
+
+    for (unsigned i = 0; i < bsp.brushSides.size(); ++i)
+    {
+        if (!inRange(bsp.brushSides[i].planeIndex, bsp.planes.size()))
+        {
+            return Fail(error, "Brush side %u: plane out of range.", i);
+        }
+    }
+
+    // Derived data is only there if BuildTraceData() has run, or if
+    // it came from a cooked file.
+    if (bsp.traceNodes.empty())
+    {
+        if (!bsp.bvhNodes.empty())
+        {
+            return Fail(error, "BVH without the rest of the derived data.");
+        }
+
+        return true;
+    }
+
+    if  (
+            (bsp.brushAabbs.size()      != bsp.brushes.size()) ||
+            (bsp.planeTypes.size()      != bsp.planes.size()) ||
+            (bsp.brushPlaneRanges.size() != bsp.brushes.size()) ||
+            (bsp.brushPlaneTypes.size() != bsp.brushPlaneData.size() / 4) ||
+            (bsp.traceNodes.size()      != bsp.nodes.size()) ||
+            (bsp.traceNodeSources.size() != bsp.nodes.size()) ||
+            (bsp.leafBrushMasks.empty()) ||
+            (bsp.leafBrushMasks[0] != cContentsSolid) ||
+            (bsp.leafBrushRanges.size() != bsp.leafBrushMasks.size() * bsp.leaves.size())
+        )
+    {
+        return Fail(error, "Derived data doesn't match the lumps.");
+    }
+
+    // Trace() indexes with the sign bits.
+    auto typeIsValid = [] (const PlaneType& type)
+    {
+        return (type.axis <= NonAxial) && (type.signBits < 8);
+    };
+
+    for (unsigned i = 0; i < bsp.brushPlaneTypes.size(); ++i)
+    {
+        if (!typeIsValid(bsp.brushPlaneTypes[i]))
+        {
+            return Fail(error, "Brush plane type %u: invalid.", i);
+        }
+    }
+
+    for (unsigned i = 0; i < bsp.brushPlaneRanges.size(); ++i)
+    {
+        const auto& range = bsp.brushPlaneRanges[i];
+
+        if  (
+                (range.stride < bsp.brushes[i].sideCount) ||
+                (range.stride % cBrushPlaneWidth) ||
+                (static_cast<std::size_t>(range.stride) > bsp.brushPlaneData.size() / 4) ||
+                (!rangeInRange(range.first, 4 * range.stride, bsp.brushPlaneData.size()))
+            )
+        {
+            return Fail(error, "Brush %u: brush planes out of range.", i);
+        }
+    }
+
+    for (unsigned i = 0; i < bsp.traceNodes.size(); ++i)
+    {
+        const auto& node = bsp.traceNodes[i];
+
+        if (!childInRange(node.childIndex[0]) || !childInRange(node.childIndex[1]))
+        {
+            return Fail(error, "Trace node %u: child out of range.", i);
+        }
+
+        if (!typeIsValid(node.type))
+        {
+            return Fail(error, "Trace node %u: invalid plane type.", i);
+        }
+
+        if (!inRange(bsp.traceNodeSources[i], bsp.nodes.size()))
+        {
+            return Fail(error, "Trace node %u: source node out of range.", i);
+        }
+    }
+
+    if (!TreeFitsTraceStack(bsp.traceNodes))
+    {
+        return Fail(error, "Trace nodes aren't a tree, or are over %u deep.", cMaxTraceDepth);
+    }
+
+    for (unsigned i = 0; i < bsp.leafBrushRanges.size(); ++i)
+    {
+        const auto& range = bsp.leafBrushRanges[i];
+
+        if (!rangeInRange(range.first, range.count, bsp.leafBrushEntries.size()))
+        {
+            return Fail(error, "Leaf brush range %u: out of range.", i);
+        }
+    }
+
+    for (unsigned i = 0; i < bsp.leafBrushEntries.size(); ++i)
+    {
+        if (!inRange(bsp.leafBrushEntries[i].brushIndex, bsp.brushes.size()))
+        {
+            return Fail(error, "Leaf brush entry %u: brush out of range.", i);
+        }
+    }
+
+    // Children always come after their parent, so it's a tree (or at worst
+    // shares a subtree) and depths can be worked out in one pass.
+    std::vector<unsigned> bvhDepths(bsp.bvhNodes.size(), 0);
+
+    for (unsigned i = 0; i < bsp.bvhNodes.size(); ++i)
+    {
+        const auto& node = bsp.bvhNodes[i];
+
+        if (node.brushCount)
+        {
+            if (!rangeInRange(node.index, node.brushCount, bsp.bvhBrushes.size()))
+            {
+                return Fail(error, "BVH node %u: brushes out of range.", i);
+            }
+
+            continue;
+        }
+
+        if  (
+                (node.axis > 2) ||
+                (i + 1 >= bsp.bvhNodes.size()) ||
+                (!inRange(node.index, bsp.bvhNodes.size())) ||
+                (static_cast<unsigned>(node.index) <= i)
+            )
+        {
+            return Fail(error, "BVH node %u: child out of range.", i);
+        }
+
+        if (bvhDepths[i] + 1 >= cMaxTraceDepth)
+        {
+            return Fail(error, "BVH is over %u deep.", cMaxTraceDepth);
+        }
+
+        for (auto child : {i + 1, static_cast<unsigned>(node.index)})
+        {
+            bvhDepths[child] = std::max(bvhDepths[child], bvhDepths[i] + 1);
+        }
+    }
+
+    for (unsigned i = 0; i < bsp.bvhBrushes.size(); ++i)
+    {
+        if (!inRange(bsp.bvhBrushes[i].brushIndex, bsp.brushes.size()))
+        {
+            return Fail(error, "BVH brush %u: brush out of range.", i);
+        }
+    }
+
+    return true;
+}
+
+// /////////////////////
+// Loading
+// /////////////////////
+bool GetCollisionBsp(
         const std::string &filePath,
-        CollisionBsp &bsp)
+        CollisionBsp &bsp,
+        const LoadOptions& options)
 {
-    auto fileHandle = fopen(filePath.c_str(), "r+b");
+    bsp = CollisionBsp{};
+
+    StageTimer timer(options.timings);
+
+    auto fileHandle = fopen(filePath.c_str(), "rb");
 
     // Check if the file exists.
     if (!fileHandle)
     {
-        return;
+        return false;
     }
 
+    bool loaded = false;
+
     // Using do once + continue in leiu of scoped_exit
     do
     {
@@ -42,111 +1444,411 @@ void GetCollisionBsp(
         }
 
         // basic checks
+        if (!HeaderIsValid(bsp.header))
+        {
+            continue;
+        }
+
+        // Bounds check all the lumps before reading anything.
+        fseek(fileHandle, 0, SEEK_END);
+        const auto fileByteCount = ftell(fileHandle);
+
         if  (
-                (bsp.header.version != cQuake3BspVersion) ||
-                (bsp.header.magicString[0] != 'I') ||
-                (bsp.header.magicString[1] != 'B') ||
-                (bsp.header.magicString[2] != 'S') ||
-                (bsp.header.magicString[3] != 'P')
+                (fileByteCount < 0) ||
+                (!LumpsFitInFile(bsp.header, static_cast<std::size_t>(fileByteCount)))
             )
         {
             continue;
         }
 
-        // Count
-        const auto& lumps = bsp.header.lumps;
-        size_t Counts[Lumps::Count] =
-        {
-            0,
-            lumps[Textures].byteCount       / sizeof(Texture),
-            lumps[Planes].byteCount         / sizeof(Plane),
-            lumps[Nodes].byteCount          / sizeof(Node),
-            lumps[Leaves].byteCount         / sizeof(Leaf),
-            0,
-            lumps[LeafBrushes].byteCount    / sizeof(LeafBrush),
-            0,
-            lumps[Brushes].byteCount        / sizeof(Brush),
-            lumps[BrushSides].byteCount     / sizeof(BrushSide),
-            0,
-            0,
-            0,
-            0,
-            0,
-            0,
-            0,
-        };
-
-        // Reserve
-        bsp.textures.reserve(Counts[Textures]);
-        bsp.planes.reserve(Counts[Planes]);
-        bsp.nodes.reserve(Counts[Nodes]);
-        bsp.leaves.reserve(Counts[Leaves]);
-        bsp.leafBrushes.reserve(Counts[LeafBrushes]);
-        bsp.brushes.reserve(Counts[Brushes]);
-        bsp.brushSides.reserve(Counts[BrushSides]);
+        auto& storage = bsp.storage;
 
         // My first generic lambda. DRY FTW!
-        auto readTypes = [&] (Lumps lumpEnum, auto& vector, size_t typeSize)
+        // One fread per lump straight into pre-sized storage.
+        auto readTypes = [&] (Lumps lumpEnum, auto& vector)
         {
-            fseek(
-                fileHandle,
-                bsp.header.lumps[lumpEnum].offsetInBytesFromStartOfFile,
-                SEEK_SET);
+            const auto& lump = bsp.header.lumps[lumpEnum];
+            const auto typeSize = sizeof(vector[0]);
 
-            for (unsigned i = 0; i < Counts[lumpEnum]; ++i)
-            {
-                vector.emplace_back();
+            vector.resize(lump.byteCount / typeSize);
 
-                if (!fread(&vector.back(), 1, typeSize, fileHandle))
-                {
-                    return false;
-                }
+            if (vector.empty())
+            {
+                return true;
+            }
 
+            if (fseek(fileHandle, lump.offsetInBytesFromStartOfFile, SEEK_SET))
+            {
+                return false;
             }
 
-            return true;
+            return
+                fread(vector.data(), typeSize, vector.size(), fileHandle) ==
+                vector.size();
         };
 
-        // Grrr, not DRY enough (how to not repeat the enum and type?)
-        // Also note that brushes is a special case it has an extented structure.
-        if (!readTypes(Textures,    bsp.textures,       sizeof(Texture)))  continue;
-        if (!readTypes(Planes,      bsp.planes,         sizeof(Plane)))     continue;
-        if (!readTypes(Nodes,       bsp.nodes,          sizeof(Node)))      continue;
-        if (!readTypes(Leaves,      bsp.leaves,         sizeof(Leaf)))      continue;
-        if (!readTypes(LeafBrushes, bsp.leafBrushes,    sizeof(LeafBrush))) continue;
-        if (!readTypes(Brushes,     bsp.brushes,        sizeof(Brush)))     continue;
-        if (!readTypes(BrushSides,  bsp.brushSides,     sizeof(BrushSide))) continue;
+        if (!readTypes(Textures,    storage.textures))      continue;
+        if (!readTypes(Planes,      storage.planes))        continue;
+        if (!readTypes(Nodes,       storage.nodes))         continue;
+        if (!readTypes(Leaves,      storage.leaves))        continue;
+        if (!readTypes(LeafBrushes, storage.leafBrushes))   continue;
+        if (!readTypes(Brushes,     storage.brushes))       continue;
+        if (!readTypes(BrushSides,  storage.brushSides))    continue;
+
+        timer.Stage("Read lumps");
 
-        // Calculate Brush AABB
-        // Q3 BSP has the first 6 sides as AABB planes.
-        for (auto& brushAabb : bsp.brushes)
+        bsp.textures    = storage.textures;
+        bsp.planes      = storage.planes;
+        bsp.nodes       = storage.nodes;
+        bsp.leaves      = storage.leaves;
+        bsp.leafBrushes = storage.leafBrushes;
+        bsp.brushes     = storage.brushes;
+        bsp.brushSides  = storage.brushSides;
+
+        if (!ValidateLumps(bsp))
         {
-            const auto& brush = brushAabb.brush;
+            continue;
+        }
 
-            if (brush.sideCount < 6)
-            {
-                // Shouldn't happen?
-                continue;
-            }
+        timer.Stage("Validate");
+
+        BuildTraceData(bsp, options);
+
+        // Nothing in memory to point at, so read them when needed.
+        SetupExtraLumps(bsp, options.extraLumpMask, nullptr, filePath);
+
+        loaded = true;
+
+    } while(!fileHandle);
+
+    fclose(fileHandle);
+
+    if (!loaded)
+    {
+        bsp = CollisionBsp{};
+    }
+
+    return loaded;
+}
+
+// Points the lump spans straight into the bsp file data.
+static bool ViewLumps(
+        const void* bspFileData,
+        std::size_t byteCount,
+        CollisionBsp& bsp)
+{
+    const auto* bytes = static_cast<const uint8_t*>(bspFileData);
+
+    // All the lump types only need 4 byte alignment.
+    if  (
+            (!bytes) ||
+            (byteCount < sizeof(Header)) ||
+            (reinterpret_cast<uintptr_t>(bytes) % 4)
+        )
+    {
+        return false;
+    }
+
+    const auto& header = *reinterpret_cast<const Header*>(bytes);
+
+    if (!HeaderIsValid(header))
+    {
+        return false;
+    }
+
+    // Pointing straight into the buffer, so make sure
+    // no lump points outside of it.
+    if (!LumpsFitInFile(header, byteCount))
+    {
+        return false;
+    }
+
+    bsp.header = header;
+
+    auto lumpView = [&] (Lumps lumpEnum, auto& span)
+    {
+        using Type = typename std::remove_reference<decltype(span[0])>::type;
+
+        const auto& lump = header.lumps[lumpEnum];
+
+        span =
+        {
+            reinterpret_cast<Type*>(bytes + lump.offsetInBytesFromStartOfFile),
+            lump.byteCount / sizeof(Type)
+        };
+    };
+
+    lumpView(Textures,      bsp.textures);
+    lumpView(Planes,        bsp.planes);
+    lumpView(Nodes,         bsp.nodes);
+    lumpView(Leaves,        bsp.leaves);
+    lumpView(LeafBrushes,   bsp.leafBrushes);
+    lumpView(Brushes,       bsp.brushes);
+    lumpView(BrushSides,    bsp.brushSides);
+
+    return true;
+}
+
+// Everything after the lumps are in place.
+static bool FinishLoad(
+        CollisionBsp& bsp,
+        const LoadOptions& options,
+        StageTimer& timer)
+{
+    if (!ValidateLumps(bsp))
+    {
+        return false;
+    }
+
+    timer.Stage("Validate");
+
+    BuildTraceData(bsp, options);
+
+    return true;
+}
+
+bool ViewCollisionBsp(
+        const void* bspFileData,
+        std::size_t byteCount,
+        CollisionBsp& bsp,
+        const LoadOptions& options)
+{
+    bsp = CollisionBsp{};
+
+    StageTimer timer(options.timings);
+
+    if  (
+            (!ViewLumps(bspFileData, byteCount, bsp)) ||
+            (!FinishLoad(bsp, options, timer))
+        )
+    {
+        bsp = CollisionBsp{};
+        return false;
+    }
+
+    SetupExtraLumps(
+        bsp,
+        options.extraLumpMask,
+        static_cast<const uint8_t*>(bspFileData),
+        {});
+
+    return true;
+}
+
+bool MapCollisionBsp(
+        const std::string& filePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options)
+{
+    bsp = CollisionBsp{};
+
+    StageTimer timer(options.timings);
 
-            auto sideDistance = [&] (auto index)
+    auto& file = bsp.storage.file;
+
+    if (!file.Open(filePath))
+    {
+        return false;
+    }
+
+    timer.Stage("Map file");
+
+    if  (
+            (!ViewLumps(file.Data(), file.ByteCount(), bsp)) ||
+            (!FinishLoad(bsp, options, timer))
+        )
+    {
+        bsp = CollisionBsp{};
+        return false;
+    }
+
+    SetupExtraLumps(bsp, options.extraLumpMask, file.Data(), filePath);
+
+    return true;
+}
+
+// /////////////////////
+// Extra Lumps
+// /////////////////////
+static Span<const uint8_t> LumpBytes(const CollisionBsp& bsp, Lumps lump)
+{
+    auto* extra = bsp.storage.extraLumps.get();
+
+    if (!extra || !(extra->mask & LumpBit(lump)))
+    {
+        return {};
+    }
+
+    std::call_once(extra->loaded[lump], [extra, lump] ()
+    {
+        const auto& source = extra->header.lumps[lump];
+
+        // Already checked against the file size by the loader.
+        if (extra->fileData)
+        {
+            extra->views[lump] =
             {
-                return bsp.planes[bsp.brushSides[index].planeIndex].distance;
+                extra->fileData + source.offsetInBytesFromStartOfFile,
+                static_cast<std::size_t>(source.byteCount)
             };
 
-            brushAabb.aabbMin.data[0] = -sideDistance(brush.firstBrushSideIndex + 0);
-            brushAabb.aabbMax.data[0] =  sideDistance(brush.firstBrushSideIndex + 1);
+            return;
+        }
 
-            brushAabb.aabbMin.data[1] = -sideDistance(brush.firstBrushSideIndex + 2);
-            brushAabb.aabbMax.data[1] =  sideDistance(brush.firstBrushSideIndex + 3);
+        auto fileHandle = fopen(extra->filePath.c_str(), "rb");
 
-            brushAabb.aabbMin.data[2] = -sideDistance(brush.firstBrushSideIndex + 4);
-            brushAabb.aabbMax.data[2] =  sideDistance(brush.firstBrushSideIndex + 5);
+        if (!fileHandle)
+        {
+            return;
         }
 
-    } while(!fileHandle);
+        // The file could have been replaced since it was loaded, and the
+        // old offsets would read the wrong bytes from a different map.
+        Header header;
 
-    fclose(fileHandle);
+        if  (
+                (fread(&header, sizeof(header), 1, fileHandle) != 1) ||
+                (memcmp(&header, &extra->header, sizeof(header)) != 0)
+            )
+        {
+            fclose(fileHandle);
+
+            return;
+        }
+
+        auto& copy = extra->copies[lump];
+
+        copy.resize(source.byteCount);
+
+        if  (
+                (!copy.empty()) &&
+                (
+                    (fseek(fileHandle, source.offsetInBytesFromStartOfFile, SEEK_SET)) ||
+                    (fread(copy.data(), 1, copy.size(), fileHandle) != copy.size())
+                )
+            )
+        {
+            copy.clear();
+        }
+
+        fclose(fileHandle);
+
+        extra->views[lump] = copy;
+    });
+
+    return extra->views[lump];
+}
+
+template<typename T>
+static Span<const T> LumpAs(const CollisionBsp& bsp, Lumps lump)
+{
+    auto bytes = LumpBytes(bsp, lump);
+
+    return
+    {
+        reinterpret_cast<const T*>(bytes.data()),
+        bytes.size() / sizeof(T)
+    };
+}
+
+Span<const char> GetEntities(const CollisionBsp& bsp)
+{
+    return LumpAs<const char>(bsp, Entities);
+}
+
+Span<const Model> GetModels(const CollisionBsp& bsp)
+{
+    return LumpAs<const Model>(bsp, Models);
+}
+
+Span<const LeafFace> GetLeafFaces(const CollisionBsp& bsp)
+{
+    return LumpAs<const LeafFace>(bsp, LeafFaces);
+}
+
+Span<const Vertex> GetVertexes(const CollisionBsp& bsp)
+{
+    return LumpAs<const Vertex>(bsp, Vertexes);
+}
+
+Span<const Meshvert> GetMeshverts(const CollisionBsp& bsp)
+{
+    return LumpAs<const Meshvert>(bsp, Meshverts);
+}
+
+Span<const Effect> GetEffects(const CollisionBsp& bsp)
+{
+    return LumpAs<const Effect>(bsp, Effects);
+}
+
+Span<const Face> GetFaces(const CollisionBsp& bsp)
+{
+    return LumpAs<const Face>(bsp, Faces);
+}
+
+Span<const Lightmap> GetLightmaps(const CollisionBsp& bsp)
+{
+    return LumpAs<const Lightmap>(bsp, Lightmaps);
+}
+
+Span<const Lightvol> GetLightvols(const CollisionBsp& bsp)
+{
+    return LumpAs<const Lightvol>(bsp, Lightvols);
+}
+
+ClusterVisibility GetVisdata(const CollisionBsp& bsp)
+{
+    auto bytes = LumpBytes(bsp, Visdata);
+
+    if (bytes.size() < sizeof(VisdataHeader))
+    {
+        return {};
+    }
+
+    const auto& header = *reinterpret_cast<const VisdataHeader*>(bytes.data());
+
+    const auto vectorBytes =
+        static_cast<int64_t>(header.clusterCount) * header.bytesPerCluster;
+
+    if  (
+            (header.clusterCount < 0) ||
+            (header.bytesPerCluster < 0) ||
+            (vectorBytes > static_cast<int64_t>(bytes.size() - sizeof(VisdataHeader)))
+        )
+    {
+        return {};
+    }
+
+    return
+    {
+        header.clusterCount,
+        header.bytesPerCluster,
+        {
+            bytes.data() + sizeof(VisdataHeader),
+            static_cast<std::size_t>(vectorBytes)
+        }
+    };
+}
+
+void SetExtraLumpFile(
+        CollisionBsp& bsp,
+        uint32_t extraLumpMask,
+        const std::string& filePath)
+{
+    bsp.storage.extraLumps.reset();
+
+    SetupExtraLumps(bsp, extraLumpMask, nullptr, filePath);
+}
+
+void ReadExtraLumps(const CollisionBsp& bsp)
+{
+    for (unsigned i = 0; i < Lumps::Count; ++i)
+    {
+        if (cExtraLumps & LumpBit(static_cast<Lumps>(i)))
+        {
+            LumpBytes(bsp, static_cast<Lumps>(i));
+        }
+    }
 }
 
 } // namespace
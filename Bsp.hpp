@@ -21,11 +21,18 @@
 #pragma once
 
 #include "Geometry.hpp"
+#include "MappedFile.hpp"
+#include "Span.hpp"
 
+#include <chrono>
 #include <vector>
+#include <memory>
+#include <mutex>
 #include <cstdint>
 #include <string>
 
+class ThreadPool;
+
 namespace Bsp {
 
 enum Lumps
@@ -53,6 +60,25 @@ enum Lumps
 
 const unsigned cQuake3BspVersion = 0x2e;
 
+// Masks of lumps, one bit per Lumps value.
+constexpr uint32_t LumpBit(Lumps lump)
+{
+    return 1u << lump;
+}
+
+/// The lumps a CollisionBsp always loads.
+const uint32_t cCollisionLumps =
+    LumpBit(Textures) |
+    LumpBit(Planes) |
+    LumpBit(Nodes) |
+    LumpBit(Leaves) |
+    LumpBit(LeafBrushes) |
+    LumpBit(Brushes) |
+    LumpBit(BrushSides);
+
+/// Everything else, loaded lazily on request.
+const uint32_t cExtraLumps = ((1u << Lumps::Count) - 1) & ~cCollisionLumps;
+
 struct Lump
 {
     int32_t offsetInBytesFromStartOfFile;
@@ -113,34 +139,516 @@ struct Brush
     int32_t textureIndex;
 };
 
+/// Not in the file, calculated at load time from the brush's corners.
+/// One per brush. Empty (min > max) if the brush is degenerate.
 struct BrushAabb
 {
-    Brush brush;
-    int32_t pad;
     Vec3 aabbMin;
     Vec3 aabbMax;
 };
 
+/// Degenerate brushes don't enclose any space, because they have too
+/// few sides, or sides that don't meet. Trace() never hits them.
+inline bool BrushIsDegenerate(const BrushAabb& brushAabb)
+{
+    return brushAabb.aabbMin.data[0] > brushAabb.aabbMax.data[0];
+}
+
 struct BrushSide
 {
     int32_t planeIndex;
     int32_t textureIndex;
 };
 
-/// Note that planes are paired. The pair of planes with indices i and i ^ 1
-/// are coincident planes with opposing normals.
-struct CollisionBsp
+struct LeafFace
+{
+    int32_t faceIndex;
+};
+
+struct Model
+{
+    float   boundsMin[3];
+    float   boundsMax[3];
+    int32_t firstFaceIndex;
+    int32_t faceCount;
+    int32_t firstBrushIndex;
+    int32_t brushCount;
+};
+
+struct Vertex
+{
+    float   position[3];
+
+    /// [0] is the surface, [1] the lightmap.
+    float   textureCoordinates[2][2];
+    float   normal[3];
+    uint8_t colour[4];
+};
+
+struct Meshvert
+{
+    int32_t offset;
+};
+
+struct Effect
+{
+    char    name[64];
+    int32_t brushIndex;
+    int32_t unknown;
+};
+
+struct Face
+{
+    int32_t textureIndex;
+    int32_t effectIndex;
+
+    /// 1 = polygon, 2 = patch, 3 = mesh, 4 = billboard.
+    int32_t type;
+
+    int32_t firstVertexIndex;
+    int32_t vertexCount;
+    int32_t firstMeshvertIndex;
+    int32_t meshvertCount;
+
+    int32_t lightmapIndex;
+    int32_t lightmapStart[2];
+    int32_t lightmapSize[2];
+    float   lightmapOrigin[3];
+    float   lightmapVectors[2][3];
+
+    float   normal[3];
+
+    /// Patch dimensions.
+    int32_t size[2];
+};
+
+struct Lightmap
+{
+    uint8_t rgb[128][128][3];
+};
+
+/// One cell of the light grid.
+struct Lightvol
+{
+    uint8_t ambient[3];
+    uint8_t directional[3];
+
+    /// Direction to the light, as phi and theta.
+    uint8_t direction[2];
+};
+
+/// The Visdata lump is this, followed by the cluster bit vectors.
+struct VisdataHeader
+{
+    int32_t clusterCount;
+    int32_t bytesPerCluster;
+};
+
+struct ClusterVisibility
+{
+    int32_t             clusterCount;
+    int32_t             bytesPerCluster;
+
+    /// clusterCount * bytesPerCluster bytes. Bit y of cluster x's vector
+    /// is set if cluster y is visible from cluster x.
+    Span<const uint8_t> clusterBits;
+};
+
+// /////////////////////
+// Derived at load time
+// /////////////////////
+
+/// 1 == CONTENTS_SOLID, the only brushes Trace() collides with.
+const int32_t cContentsSolid = 1;
+
+/// Trace() walks the tree with a fixed size stack, so bsps with nodes
+/// deeper than this fail validation.
+const unsigned cMaxTraceDepth = 256;
+
+enum PlaneAxis : uint8_t
+{
+    AxialX = 0,
+    AxialY,
+    AxialZ,
+    NonAxial,
+};
+
+/// Same as Quake3's cplane_t type and signbits, except that planes facing
+/// down an axis are axial too. Bit n of signBits is set if normal[n] < 0.
+struct PlaneType
+{
+    PlaneAxis   axis;
+    uint8_t     signBits;
+    uint8_t     pad[2];
+};
+
+/// Node with the plane inline so Trace() doesn't have to go looking in
+/// planes[] for it, and without the bounds Trace() never reads. Only in
+/// the same order as nodes with NodeLayout::FileOrder, see
+/// traceNodeSources. Child indices are trace node indices.
+struct TraceNode
+{
+    ::Plane     plane;
+    PlaneType   type;
+    int32_t     childIndex[2];
+};
+
+enum class NodeLayout
+{
+    /// Same order as the nodes lump.
+    FileOrder,
+
+    /// The top levels breadth first, then the rest in clusters of a few
+    /// levels, so going down the tree touches fewer cache lines. The root
+    /// is still node 0.
+    Clustered,
+};
+
+enum class TraceBackend
+{
+    /// The compiler's tree, traceNodes. Built for the renderer's
+    /// visibility, so long traces split a lot and visit many leaves.
+    NodeTree,
+
+    /// A BVH over the brushes' AABBs, bvhNodes, built with the surface
+    /// area heuristic. Each brush is in it once, so there's no mailboxing.
+    BrushBvh,
+};
+
+/// Brush planes are padded out to this many, so SIMD code can always
+/// load a whole register's worth (8 floats for AVX).
+const int32_t cBrushPlaneWidth = 8;
+
+/// A brush's planes copied out of planes[] as four arrays in
+/// brushPlaneData: every x, then y, z and distance. Each array is
+/// stride floats, a multiple of cBrushPlaneWidth, and the padding is
+/// a plane that everything is behind (zero normal, FLT_MAX distance).
+/// The sides' plane types are in brushPlaneTypes, starting at first / 4.
+/// Same index as brushes.
+struct BrushPlaneRange
+{
+    int32_t first;
+    int32_t stride;
+};
+
+/// Range into leafBrushEntries for a leaf.
+struct LeafBrushRange
+{
+    int32_t first;
+    int32_t count;
+};
+
+/// A brush in one of a leaf's brush lists, with the AABB inline so the
+/// leaf loop in Trace() doesn't have to look anywhere else to reject it.
+struct LeafBrushEntry
+{
+    BrushAabb   aabb;
+    int32_t     brushIndex;
+    int32_t     contentFlags;
+};
+
+/// Node of the brush BVH, depth first so the first child is always the
+/// next node. Children have higher indices than their parent.
+struct BvhNode
+{
+    /// Everything under the node.
+    BrushAabb   aabb;
+
+    /// Leaf: the first of its brushes in bvhBrushes. Otherwise the second
+    /// child's index.
+    int32_t     index;
+
+    /// Brushes in a leaf, 0 if it's not a leaf.
+    uint8_t     brushCount;
+
+    /// Axis the children were split on, the first child being nearer the
+    /// minimum. Lets Trace() visit the nearer child first.
+    uint8_t     axis;
+
+    /// How far past aabb the brushes under the node can be hit, per unit
+    /// the trace pushes their planes out (sphere radius, box and EPSILON),
+    /// in 256ths. cBvhSpreadOne if they all have axial planes facing every
+    /// way (Q3's bevels), cBvhSpreadUnknown if it's too far to bother.
+    uint16_t    spread;
+};
+
+const uint16_t cBvhSpreadOne        = 256;
+const uint16_t cBvhSpreadUnknown    = 0xffff;
+
+/// The non-collision lumps asked for when the bsp was loaded. They're only
+/// read the first time they're asked for (see GetFaces() etc). If the whole
+/// file is already in memory the lump is used in place, otherwise it's read
+/// from filePath.
+struct ExtraLumps
 {
+    uint32_t                mask = 0;
     Header                  header;
+
+    const uint8_t*          fileData = nullptr;
+    std::string             filePath;
+
+    std::once_flag          loaded[Lumps::Count];
+    std::vector<uint8_t>    copies[Lumps::Count];
+    Span<const uint8_t>     views[Lumps::Count];
+};
+
+/// Whatever the CollisionBsp spans point into. Depending on how the bsp
+/// was loaded that is the mapped file, copies of the lumps, or nothing at
+/// all if the caller owns the memory. Derived data always lives here.
+struct CollisionBspStorage
+{
+    MappedFile              file;
+
+    std::unique_ptr<ExtraLumps> extraLumps;
+
     std::vector<Texture>    textures;
-    std::vector<::Plane>      planes;
+    std::vector<::Plane>    planes;
     std::vector<Node>       nodes;
     std::vector<Leaf>       leaves;
     std::vector<LeafBrush>  leafBrushes;
-    std::vector<BrushAabb>  brushes;
+    std::vector<Brush>      brushes;
     std::vector<BrushSide>  brushSides;
+
+    std::vector<BrushAabb>      brushAabbs;
+    std::vector<PlaneType>      planeTypes;
+    std::vector<BrushPlaneRange> brushPlaneRanges;
+    std::vector<float>          brushPlaneData;
+    std::vector<PlaneType>      brushPlaneTypes;
+    std::vector<TraceNode>      traceNodes;
+    std::vector<int32_t>        traceNodeSources;
+    std::vector<int32_t>        leafBrushMasks;
+    std::vector<LeafBrushRange> leafBrushRanges;
+    std::vector<LeafBrushEntry> leafBrushEntries;
+    std::vector<BvhNode>        bvhNodes;
+    std::vector<LeafBrushEntry> bvhBrushes;
 };
 
-void GetCollisionBsp(const std::string& filePath, CollisionBsp& bsp);
+/// Note that planes are paired. The pair of planes with indices i and i ^ 1
+/// are coincident planes with opposing normals.
+///
+/// All the arrays are read only views, so a CollisionBsp can sit directly on
+/// top of a mapped file without copying anything. Move only, as the views
+/// point into storage.
+struct CollisionBsp
+{
+    Header                  header;
+    Span<const Texture>     textures;
+    Span<const ::Plane>     planes;
+    Span<const Node>        nodes;
+    Span<const Leaf>        leaves;
+    Span<const LeafBrush>   leafBrushes;
+    Span<const Brush>       brushes;
+    Span<const BrushSide>   brushSides;
+
+    // Derived data, see BuildTraceData().
+    Span<const BrushAabb>       brushAabbs;
+    Span<const PlaneType>       planeTypes;
+    Span<const BrushPlaneRange> brushPlaneRanges;
+    Span<const float>           brushPlaneData;
+    Span<const PlaneType>       brushPlaneTypes;
+    Span<const TraceNode>       traceNodes;
+
+    // The nodes index each trace node came from, for the bounds and
+    // anything else Trace() doesn't need.
+    Span<const int32_t>         traceNodeSources;
+
+    // Per leaf brush lists, one set per contents mask in leafBrushMasks
+    // (the first is always cContentsSolid). Each only has the brushes
+    // Trace() can hit with that mask: any of its contents, with sides,
+    // and not degenerate. Mask m's range for leaf l is
+    // leafBrushRanges[m * leaves.size() + l].
+    Span<const int32_t>         leafBrushMasks;
+    Span<const LeafBrushRange>  leafBrushRanges;
+    Span<const LeafBrushEntry>  leafBrushEntries;
+
+    // Only there with TraceBackend::BrushBvh, in which case Trace() walks
+    // these instead of traceNodes. The same brushes as leafBrushEntries,
+    // once each, so it covers the same contents masks. Other masks still
+    // go through traceNodes.
+    Span<const BvhNode>         bvhNodes;
+    Span<const LeafBrushEntry>  bvhBrushes;
+
+    CollisionBspStorage     storage;
+};
+
+/// How long each part of a load took, in the order they happened.
+struct LoadTimings
+{
+    struct Stage
+    {
+        const char*                 name;
+        std::chrono::microseconds   time;
+    };
+
+    std::vector<Stage> stages;
+};
+
+// Records how long it's been since the last stage.
+class StageTimer
+{
+public:
+    explicit StageTimer(LoadTimings* timings)
+        : m_timings(timings)
+        , m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    void Stage(const char* name)
+    {
+        if (!m_timings)
+        {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+
+        m_timings->stages.push_back(
+        {
+            name,
+            std::chrono::duration_cast<std::chrono::microseconds>(now - m_start)
+        });
+
+        m_start = now;
+    }
+
+private:
+    LoadTimings* m_timings;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+struct LoadOptions
+{
+    /// Any of cExtraLumps (use LumpBit()). These lumps are loaded the first
+    /// time they're asked for, the rest are never loaded.
+    uint32_t        extraLumpMask = 0;
+
+    /// If set, the derived data is calculated across these threads.
+    /// Results are the same either way.
+    ThreadPool*     threadPool = nullptr;
+
+    /// If set, filled in with how long each stage of the load took.
+    LoadTimings*    timings = nullptr;
+
+    /// Order of traceNodes. Results are the same either way.
+    NodeLayout      nodeLayout = NodeLayout::Clustered;
+
+    /// What Trace() walks to find the brushes. Which is faster depends on
+    /// the map, so pick per map (MessyBsp -b times both). The tree only
+    /// tests the brushes listed in the leaves the trace passes through, so
+    /// it can miss a brush whose hit region (grown by the radius or box)
+    /// pokes into a leaf that doesn't list it. The BVH tests every brush
+    /// the trace's bounds reach, so it can report an earlier hit, or more
+    /// inside/outside info, than the tree, but never a later hit or less.
+    /// Which plane is reported can also differ when two brushes are hit at
+    /// exactly the same fraction.
+    TraceBackend    traceBackend = TraceBackend::NodeTree;
+
+    /// Contents masks to build leaf brush lists for, on top of
+    /// cContentsSolid. Tracing with any other mask still works, it just
+    /// has to go through the lumps.
+    std::vector<int32_t> contentsMasks;
+};
+
+/// Reads and copies the lumps out of the file.
+/// All the load functions return false (and leave bsp empty) on failure.
+bool GetCollisionBsp(
+        const std::string& filePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options = {});
+
+/// Memory maps the file and uses the lumps in place. Only the derived
+/// data is allocated.
+bool MapCollisionBsp(
+        const std::string& filePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options = {});
+
+/// Uses the lumps in place from a caller owned buffer holding a whole bsp
+/// file. The buffer must be 4 byte aligned and outlive bsp.
+bool ViewCollisionBsp(
+        const void* bspFileData,
+        std::size_t byteCount,
+        CollisionBsp& bsp,
+        const LoadOptions& options = {});
+
+/// Lazily loaded lumps. Empty if the lump wasn't in the extraLumpMask given
+/// to the loader, or can no longer be read (the file has gone, or its header
+/// no longer matches the one loaded). Safe to call from any thread.
+Span<const char>        GetEntities(const CollisionBsp& bsp);
+Span<const Model>       GetModels(const CollisionBsp& bsp);
+Span<const LeafFace>    GetLeafFaces(const CollisionBsp& bsp);
+Span<const Vertex>      GetVertexes(const CollisionBsp& bsp);
+Span<const Meshvert>    GetMeshverts(const CollisionBsp& bsp);
+Span<const Effect>      GetEffects(const CollisionBsp& bsp);
+Span<const Face>        GetFaces(const CollisionBsp& bsp);
+Span<const Lightmap>    GetLightmaps(const CollisionBsp& bsp);
+Span<const Lightvol>    GetLightvols(const CollisionBsp& bsp);
+ClusterVisibility       GetVisdata(const CollisionBsp& bsp);
+
+/// For maps whose collision lumps came from somewhere other than the bsp
+/// file (a cooked or shared image), but whose header is still the file's.
+/// The lumps in extraLumpMask are read from filePath when first asked for,
+/// as if the map had been loaded from it with that mask.
+void SetExtraLumpFile(
+        CollisionBsp& bsp,
+        uint32_t extraLumpMask,
+        const std::string& filePath);
+
+/// Reads all of the lazily loaded lumps now. For maps loaded with
+/// GetCollisionBsp() that have to stay the same map even if the file is
+/// replaced afterwards.
+void ReadExtraLumps(const CollisionBsp& bsp);
+
+/// Checks the magic string and version.
+bool HeaderIsValid(const Header& header);
+
+/// Checks every lump is aligned and within fileByteCount.
+bool LumpsFitInFile(const Header& header, std::size_t fileByteCount);
+
+/// Bounds checks every index in the lumps (and the derived data, if there
+/// is any) so Trace() never has to. The loaders already call this.
+/// On failure, error says what was wrong.
+bool ValidateCollisionBsp(const CollisionBsp& bsp, std::string& error);
+
+/// Calculates all the derived data from the lumps. The loaders already
+/// call this, it's only needed if you've built the lumps yourself.
+/// Only threadPool, timings, nodeLayout, traceBackend and contentsMasks
+/// are used from options. planesClassified skips ClassifyPlanes(), for
+/// loaders that have already run it (see below).
+void BuildTraceData(
+        CollisionBsp& bsp,
+        const LoadOptions& options = {},
+        bool planesClassified = false);
+
+/// The steps of BuildTraceData(), for loaders that want to start on some
+/// of them before all the lumps are in. Each needs the lumps it uses to be
+/// validated first, apart from ClassifyPlanes(), which only uses planes.
+/// CopyBrushPlanes() and BuildTraceNodes() need the plane types as well,
+/// BuildLeafBrushLists() the brush AABBs, and BuildBrushBvh() the leaf
+/// brush lists.
+void CalculateBrushAabbs(CollisionBsp& bsp, ThreadPool* pool = nullptr);
+void ClassifyPlanes(CollisionBsp& bsp, ThreadPool* pool = nullptr);
+void CopyBrushPlanes(CollisionBsp& bsp, ThreadPool* pool = nullptr);
+void BuildTraceNodes(
+        CollisionBsp& bsp,
+        ThreadPool* pool = nullptr,
+        NodeLayout layout = NodeLayout::Clustered);
+void BuildLeafBrushLists(
+        CollisionBsp& bsp,
+        const std::vector<int32_t>& contentsMasks = {},
+        ThreadPool* pool = nullptr);
+
+/// Switches bsp to TraceBackend::BrushBvh. Works on any loaded bsp, cooked
+/// or not. ClearBrushBvh() switches it back to TraceBackend::NodeTree.
+void BuildBrushBvh(CollisionBsp& bsp, ThreadPool* pool = nullptr);
+void ClearBrushBvh(CollisionBsp& bsp);
+
+/// Index into leafBrushMasks of the lists for contentsMask, or -1 if there
+/// aren't any.
+int FindLeafBrushMask(const CollisionBsp& bsp, int32_t contentsMask);
+
+/// Bytes used by the collision lumps and derived data, wherever they live.
+/// Extra lumps aren't counted.
+std::size_t CollisionBspByteCount(const CollisionBsp& bsp);
 
 } // namespace
@@ -0,0 +1,652 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "BspAsync.hpp"
+#include "ThreadPool.hpp"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace Bsp {
+
+// /////////////////////
+// Helpers
+// /////////////////////
+
+#ifndef _WIN32
+
+struct LumpRead
+{
+    Lumps       lump;
+    uint8_t*    data;
+    std::size_t byteCount;
+    std::size_t offset;
+    std::size_t done;
+
+#ifdef __linux__
+    // Has to stay put until the kernel is done with it.
+    iovec       vector;
+#endif
+};
+
+enum class RingResult
+{
+    Unavailable,
+    Failed,
+    Read,
+};
+
+// Plain preads, one lump per task.
+static bool ReadLumpsThreaded(
+        int fileDescriptor,
+        std::vector<LumpRead>& reads,
+        ThreadPool* threadPool)
+{
+    std::vector<uint8_t> failed(reads.size(), 0);
+
+    ParallelFor(threadPool, reads.size(), 1, [&] (auto first, auto last)
+    {
+        for (auto i = first; i < last; ++i)
+        {
+            auto& read = reads[i];
+
+            while (read.done < read.byteCount)
+            {
+                auto result = pread(
+                    fileDescriptor,
+                    read.data + read.done,
+                    read.byteCount - read.done,
+                    static_cast<off_t>(read.offset + read.done));
+
+                if (result < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (result <= 0)
+                {
+                    failed[i] = 1;
+                    break;
+                }
+
+                read.done += static_cast<std::size_t>(result);
+            }
+        }
+    });
+
+    for (auto fail : failed)
+    {
+        if (fail)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif // _WIN32
+
+#ifdef __linux__
+
+// Just enough io_uring to queue up some reads and wait on them, using the
+// raw syscalls so there's no liburing dependency.
+class Ring
+{
+public:
+    ~Ring()
+    {
+        // Closing the ring doesn't wait for reads the kernel has already
+        // started, and their buffers go away as soon as we've returned.
+        Drain();
+
+        if (m_sqes)
+        {
+            munmap(m_sqes, m_sqesByteCount);
+        }
+
+        if (m_cqRing && m_cqRing != m_sqRing)
+        {
+            munmap(m_cqRing, m_cqRingByteCount);
+        }
+
+        if (m_sqRing)
+        {
+            munmap(m_sqRing, m_sqRingByteCount);
+        }
+
+        if (m_fileDescriptor >= 0)
+        {
+            close(m_fileDescriptor);
+        }
+    }
+
+    // False if the kernel doesn't have io_uring, or won't let us use it.
+    bool Open(unsigned entryCount)
+    {
+        io_uring_params parameters;
+        memset(&parameters, 0, sizeof(parameters));
+
+        m_fileDescriptor = static_cast<int>(
+            syscall(__NR_io_uring_setup, entryCount, &parameters));
+
+        if (m_fileDescriptor < 0)
+        {
+            return false;
+        }
+
+        m_sqRingByteCount =
+            parameters.sq_off.array +
+            parameters.sq_entries * sizeof(uint32_t);
+
+        m_cqRingByteCount =
+            parameters.cq_off.cqes +
+            parameters.cq_entries * sizeof(io_uring_cqe);
+
+        const bool singleMap = parameters.features & IORING_FEAT_SINGLE_MMAP;
+
+        if (singleMap)
+        {
+            m_sqRingByteCount = std::max(m_sqRingByteCount, m_cqRingByteCount);
+            m_cqRingByteCount = m_sqRingByteCount;
+        }
+
+        m_sqRing = MapRing(m_sqRingByteCount, IORING_OFF_SQ_RING);
+        m_cqRing = singleMap
+            ? m_sqRing
+            : MapRing(m_cqRingByteCount, IORING_OFF_CQ_RING);
+
+        m_sqesByteCount = parameters.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = MapRing(m_sqesByteCount, IORING_OFF_SQES);
+
+        if (!m_sqRing || !m_cqRing || !m_sqes)
+        {
+            return false;
+        }
+
+        auto* sq = static_cast<uint8_t*>(m_sqRing);
+        auto* cq = static_cast<uint8_t*>(m_cqRing);
+
+        m_sqTail    = reinterpret_cast<uint32_t*>(sq + parameters.sq_off.tail);
+        m_sqMask    = *reinterpret_cast<uint32_t*>(sq + parameters.sq_off.ring_mask);
+        m_sqArray   = reinterpret_cast<uint32_t*>(sq + parameters.sq_off.array);
+
+        m_cqHead    = reinterpret_cast<uint32_t*>(cq + parameters.cq_off.head);
+        m_cqTail    = reinterpret_cast<uint32_t*>(cq + parameters.cq_off.tail);
+        m_cqMask    = *reinterpret_cast<uint32_t*>(cq + parameters.cq_off.ring_mask);
+        m_cqes      = reinterpret_cast<io_uring_cqe*>(cq + parameters.cq_off.cqes);
+
+        return true;
+    }
+
+    // Only one read per lump is ever in flight, so the ring never fills.
+    void QueueRead(int fileDescriptor, LumpRead& read, uint64_t userData)
+    {
+        read.vector.iov_base    = read.data + read.done;
+        read.vector.iov_len     = read.byteCount - read.done;
+
+        const auto tail = *m_sqTail;
+        const auto index = tail & m_sqMask;
+
+        auto& sqe = static_cast<io_uring_sqe*>(m_sqes)[index];
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode      = IORING_OP_READV;
+        sqe.fd          = fileDescriptor;
+        sqe.addr        = reinterpret_cast<uint64_t>(&read.vector);
+        sqe.len         = 1;
+        sqe.off         = read.offset + read.done;
+        sqe.user_data   = userData;
+
+        m_sqArray[index] = index;
+
+        // The kernel mustn't see the new tail before the entry.
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        ++m_queuedCount;
+    }
+
+    // Submits anything queued and waits for at least one completion.
+    bool SubmitAndWait()
+    {
+        for (;;)
+        {
+            auto result = syscall(
+                __NR_io_uring_enter,
+                m_fileDescriptor,
+                m_queuedCount,
+                1,
+                IORING_ENTER_GETEVENTS,
+                nullptr,
+                0);
+
+            if (result >= 0)
+            {
+                m_queuedCount   -= static_cast<unsigned>(result);
+                m_inFlightCount += static_cast<unsigned>(result);
+                return true;
+            }
+
+            if (errno != EINTR)
+            {
+                return false;
+            }
+        }
+    }
+
+    bool NextCompletion(uint64_t& userData, int32_t& result)
+    {
+        const auto head = *m_cqHead;
+
+        if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+        {
+            return false;
+        }
+
+        const auto& cqe = m_cqes[head & m_cqMask];
+
+        userData    = cqe.user_data;
+        result      = cqe.res;
+
+        __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+
+        --m_inFlightCount;
+
+        return true;
+    }
+
+private:
+    // Waits for everything submitted to complete, throwing the results
+    // away. Reads that were queued but never submitted never start.
+    void Drain()
+    {
+        while (m_inFlightCount)
+        {
+            auto result = syscall(
+                __NR_io_uring_enter,
+                m_fileDescriptor,
+                0,
+                1,
+                IORING_ENTER_GETEVENTS,
+                nullptr,
+                0);
+
+            if  (
+                    (result < 0) &&
+                    (errno != EINTR) &&
+                    (errno != EAGAIN) &&
+                    (errno != EBUSY)
+                )
+            {
+                // The ring itself is broken, nothing left to wait with.
+                return;
+            }
+
+            uint64_t userData;
+            int32_t readResult;
+
+            while (NextCompletion(userData, readResult))
+            {
+            }
+        }
+    }
+
+    void* MapRing(std::size_t byteCount, off_t offset)
+    {
+        auto* data = mmap(
+            nullptr,
+            byteCount,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            m_fileDescriptor,
+            offset);
+
+        return (data == MAP_FAILED) ? nullptr : data;
+    }
+
+    int             m_fileDescriptor    = -1;
+    unsigned        m_queuedCount       = 0;
+    unsigned        m_inFlightCount     = 0;
+
+    void*           m_sqRing            = nullptr;
+    void*           m_cqRing            = nullptr;
+    void*           m_sqes              = nullptr;
+    std::size_t     m_sqRingByteCount   = 0;
+    std::size_t     m_cqRingByteCount   = 0;
+    std::size_t     m_sqesByteCount     = 0;
+
+    uint32_t*       m_sqTail            = nullptr;
+    uint32_t        m_sqMask            = 0;
+    uint32_t*       m_sqArray           = nullptr;
+
+    uint32_t*       m_cqHead            = nullptr;
+    uint32_t*       m_cqTail            = nullptr;
+    uint32_t        m_cqMask            = 0;
+    io_uring_cqe*   m_cqes              = nullptr;
+};
+
+// Issues every read at once, then calls onRead for each lump as it
+// finishes, while the others are still in flight. Nothing is left in
+// flight once it returns, whatever the result, so the reads' buffers can
+// be reused or freed.
+template<typename OnRead>
+static RingResult ReadLumpsWithRing(
+        int fileDescriptor,
+        std::vector<LumpRead>& reads,
+        OnRead onRead)
+{
+    Ring ring;
+
+    if (!ring.Open(static_cast<unsigned>(reads.size())))
+    {
+        return RingResult::Unavailable;
+    }
+
+    for (std::size_t i = 0; i < reads.size(); ++i)
+    {
+        ring.QueueRead(fileDescriptor, reads[i], i);
+    }
+
+    auto remaining = reads.size();
+
+    while (remaining)
+    {
+        if (!ring.SubmitAndWait())
+        {
+            return RingResult::Failed;
+        }
+
+        uint64_t index;
+        int32_t result;
+
+        while (ring.NextCompletion(index, result))
+        {
+            auto& read = reads[index];
+
+            // Kernels without IORING_OP_READV, nothing's been trusted yet.
+            if  (
+                    (result == -EINVAL) ||
+                    (result == -EOPNOTSUPP)
+                )
+            {
+                return RingResult::Unavailable;
+            }
+
+            if  (
+                    (result == -EAGAIN) ||
+                    (result == -EINTR)
+                )
+            {
+                ring.QueueRead(fileDescriptor, read, index);
+                continue;
+            }
+
+            if (result <= 0)
+            {
+                return RingResult::Failed;
+            }
+
+            read.done += static_cast<std::size_t>(result);
+
+            // Short read, go again for the rest.
+            if (read.done < read.byteCount)
+            {
+                ring.QueueRead(fileDescriptor, read, index);
+                continue;
+            }
+
+            onRead(read);
+            --remaining;
+        }
+    }
+
+    return RingResult::Read;
+}
+
+#endif // __linux__
+
+// /////////////////////
+// Loading
+// /////////////////////
+
+#ifdef _WIN32
+
+// RAM: TODO: Overlapped IO would do the same job on windows.
+static MapHandle LoadAsync(
+        const std::string& filePath,
+        const LoadOptions& options)
+{
+    auto bsp = std::make_shared<CollisionBsp>();
+
+    if (!GetCollisionBsp(filePath, *bsp, options))
+    {
+        return {};
+    }
+
+    return bsp;
+}
+
+#else
+
+static MapHandle LoadAsync(
+        const std::string& filePath,
+        const LoadOptions& options)
+{
+    auto bsp = std::make_shared<CollisionBsp>();
+
+    StageTimer timer(options.timings);
+
+    auto fileDescriptor = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fileDescriptor < 0)
+    {
+        return {};
+    }
+
+    bool loaded = false;
+
+    // Using do once + continue in leiu of scoped_exit
+    do
+    {
+        struct stat status;
+
+        if  (
+                (fstat(fileDescriptor, &status) != 0) ||
+                (pread(fileDescriptor, &bsp->header, sizeof(Header), 0) != sizeof(Header)) ||
+                (!HeaderIsValid(bsp->header)) ||
+                (!LumpsFitInFile(bsp->header, static_cast<std::size_t>(status.st_size)))
+            )
+        {
+            continue;
+        }
+
+        auto& storage = bsp->storage;
+        std::vector<LumpRead> reads;
+
+        auto addTypes = [&] (Lumps lumpEnum, auto& vector)
+        {
+            const auto& lump = bsp->header.lumps[lumpEnum];
+            const auto typeSize = sizeof(vector[0]);
+
+            vector.resize(lump.byteCount / typeSize);
+
+            if (!vector.empty())
+            {
+                LumpRead read = {};
+
+                read.lump       = lumpEnum;
+                read.data       = reinterpret_cast<uint8_t*>(vector.data());
+                read.byteCount  = vector.size() * typeSize;
+                read.offset     = static_cast<std::size_t>(lump.offsetInBytesFromStartOfFile);
+
+                reads.push_back(read);
+            }
+        };
+
+        addTypes(Textures,    storage.textures);
+        addTypes(Planes,      storage.planes);
+        addTypes(Nodes,       storage.nodes);
+        addTypes(Leaves,      storage.leaves);
+        addTypes(LeafBrushes, storage.leafBrushes);
+        addTypes(Brushes,     storage.brushes);
+        addTypes(BrushSides,  storage.brushSides);
+
+        timer.Stage("Read header");
+
+        bool classified = false;
+
+        // Plane types only need the planes, so there's no need to wait
+        // for the rest.
+        auto onRead = [&] (const LumpRead& read)
+        {
+            if (read.lump == Planes)
+            {
+                bsp->planes = storage.planes;
+                ClassifyPlanes(*bsp, options.threadPool);
+                classified = true;
+            }
+        };
+
+        bool lumpsRead = false;
+
+#ifdef __linux__
+        auto ringResult = ReadLumpsWithRing(fileDescriptor, reads, onRead);
+
+        if (ringResult == RingResult::Failed)
+        {
+            continue;
+        }
+
+        if (ringResult == RingResult::Read)
+        {
+            timer.Stage("Read lumps (io_uring)");
+            lumpsRead = true;
+        }
+        else
+        {
+            // Start again from scratch.
+            for (auto& read : reads)
+            {
+                read.done = 0;
+            }
+
+            classified = false;
+        }
+#endif
+
+        if (!lumpsRead)
+        {
+            if (!ReadLumpsThreaded(fileDescriptor, reads, options.threadPool))
+            {
+                continue;
+            }
+
+            timer.Stage("Read lumps (threads)");
+        }
+
+        bsp->textures    = storage.textures;
+        bsp->planes      = storage.planes;
+        bsp->nodes       = storage.nodes;
+        bsp->leaves      = storage.leaves;
+        bsp->leafBrushes = storage.leafBrushes;
+        bsp->brushes     = storage.brushes;
+        bsp->brushSides  = storage.brushSides;
+
+        if (!classified)
+        {
+            ClassifyPlanes(*bsp, options.threadPool);
+            timer.Stage("Plane types");
+        }
+
+        std::string error;
+
+        if (!ValidateCollisionBsp(*bsp, error))
+        {
+            fprintf(stderr, "Invalid bsp: %s\n", error.c_str());
+            continue;
+        }
+
+        timer.Stage("Validate");
+
+        // The planes were classified above, as soon as they were read.
+        BuildTraceData(*bsp, options, true);
+
+        // Nothing in memory to point at, so read them when needed.
+        SetExtraLumpFile(*bsp, options.extraLumpMask, filePath);
+
+        loaded = true;
+
+    } while(fileDescriptor < 0);
+
+    close(fileDescriptor);
+
+    if (!loaded)
+    {
+        return {};
+    }
+
+    return bsp;
+}
+
+#endif // _WIN32
+
+std::future<MapHandle> LoadCollisionBspAsync(
+        const std::string& filePath,
+        const LoadOptions& options)
+{
+    // Not detached, so whoever owns the future can always wait for the
+    // load, rather than it racing them (or static destruction) at exit.
+    return std::async(std::launch::async, [filePath, options] ()
+    {
+        return LoadAsync(filePath, options);
+    });
+}
+
+std::future<void> LoadCollisionBspAsync(
+        const std::string& filePath,
+        LoadCallback onLoaded,
+        const LoadOptions& options)
+{
+    return std::async(std::launch::async, [filePath, onLoaded, options] ()
+    {
+        auto bsp = LoadAsync(filePath, options);
+
+        if (onLoaded)
+        {
+            onLoaded(std::move(bsp));
+        }
+    });
+}
+
+} // namespace
@@ -0,0 +1,57 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "Bsp.hpp"
+#include "BspRegistry.hpp"
+
+#include <functional>
+#include <future>
+#include <string>
+
+// Loading a map without blocking the caller, so a server can keep ticking
+// while the next map comes in.
+//
+// All the collision lump reads go out at once, through io_uring on linux
+// kernels that have it, otherwise spread across options.threadPool. Plane
+// types are worked out as soon as the planes are in, while the rest of the
+// reads are still going.
+
+namespace Bsp {
+
+using LoadCallback = std::function<void(MapHandle bsp)>;
+
+/// Loads filePath on a thread of its own (std::async). The map is nullptr
+/// if it won't load. options.threadPool and options.timings are used from
+/// that thread, so they have to outlive the load. Extra lumps are read
+/// when first asked for, the same as GetCollisionBsp().
+///
+/// The future's destructor waits for the load, so nothing is left running
+/// once it's gone. Dropping it straight away makes the load synchronous.
+std::future<MapHandle> LoadCollisionBspAsync(
+        const std::string& filePath,
+        const LoadOptions& options = {});
+
+/// Same, but calls onLoaded (from the loading thread) when it's done. The
+/// future is ready once onLoaded has returned, and waits for it the same
+/// way, so keep it until then (eg. until shutdown).
+std::future<void> LoadCollisionBspAsync(
+        const std::string& filePath,
+        LoadCallback onLoaded,
+        const LoadOptions& options = {});
+
+} // namespace
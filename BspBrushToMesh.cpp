@@ -16,78 +16,18 @@
 
 #include "BspBrushToMesh.hpp"
 #include "PlaneMaths.hpp"
+#include "ThreadPool.hpp"
 #include "third-party/ConvexHull/hull.h"
 
 namespace Bsp {
 
-std::vector<float> BrushMeshesAsTriangleListWithNormals(
-        const CollisionBsp &bsp,
-        unsigned maxBrushCount)
-{
-    std::vector<float> result;
-    std::vector<bool> flags(bsp.brushes.size());
-
-    // For each brush that's solid, get all the plane equations
-    // and then get all the intersection points between all the planes.
-    // Once you have those, get the convex hull for those points, then
-    // turn it into a triangle mesh. Return.
-    unsigned count = 0;
-    for (const auto& leaf : bsp.leaves)
-    {
-        const auto* leafBrushes = &bsp.leafBrushes[leaf.firstLeafBrushIndex];
-
-        for (auto i = 0; i < leaf.leafBrushCount; ++i)
-        {
-            auto index = leafBrushes[i].brushIndex;
-
-            // Avoid repeating brushes.
-            if (flags[index])
-            {
-                continue;
-            }
-            flags[index] = true;
-
-            const auto& brush = bsp.brushes[index].brush;
-
-            if (!(bsp.textures[brush.textureIndex].contentFlags & 1))
-            {
-                continue;
-            }
-
-            auto mesh = MeshFromBrush(bsp, brush);
-
-            if (!mesh.empty())
-            {
-                for (const auto& v : mesh)
-                {
-                    result.push_back(v.data[0]);
-                    result.push_back(v.data[1]);
-                    result.push_back(v.data[2]);
-
-                    count++;
-
-                    if (count >= maxBrushCount)
-                    {
-                        break;
-                    }
-                }
-            }
-        }        
-
-        if (count >= maxBrushCount)
-        {
-            break;
-        }
-    }
-
-    return result;
-}
-
-std::vector<Vec3> MeshFromBrush(
+// /////////////////////
+// Helpers
+// /////////////////////
+static std::vector<Vec3> VerticiesFromBrush(
         const Bsp::CollisionBsp& bsp,
         const Bsp::Brush& brush)
 {
-    std::vector<Vec3> mesh;
     std::vector<Plane> planes;
 
     // Q3 stores plane distance as the distance from the origin along the normal
@@ -115,7 +55,13 @@ std::vector<Vec3> MeshFromBrush(
         planes.push_back(convertD(bsp.planes[planeIndex]));
     }
 
-    const auto verts = VerticiesFromIntersectingPlanes(planes);
+    return VerticiesFromIntersectingPlanes(planes);
+}
+
+// Not thread safe, the convex hull library uses static variables.
+static std::vector<Vec3> MeshFromVerticies(const std::vector<Vec3>& verts)
+{
+    std::vector<Vec3> mesh;
 
     if (!verts.empty())
     {
@@ -183,4 +129,107 @@ std::vector<Vec3> MeshFromBrush(
     return mesh;
 }
 
+// /////////////////////
+// Meshes
+// /////////////////////
+std::vector<float> BrushMeshesAsTriangleListWithNormals(
+        const CollisionBsp &bsp,
+        unsigned maxBrushCount,
+        ThreadPool* threadPool)
+{
+    std::vector<float> result;
+    std::vector<bool> flags(bsp.brushes.size());
+
+    // For each brush that's solid, get all the plane equations
+    // and then get all the intersection points between all the planes.
+    // Once you have those, get the convex hull for those points, then
+    // turn it into a triangle mesh. Return.
+    //
+    // Finding the intersection points is the slow bit, so first work out
+    // which brushes to do (in leaf order), find all their points across
+    // the thread pool, then do the hulls in the original order.
+    std::vector<int32_t> brushOrder;
+    std::vector<std::size_t> leafEnds;
+
+    for (const auto& leaf : bsp.leaves)
+    {
+        const auto* leafBrushes = &bsp.leafBrushes[leaf.firstLeafBrushIndex];
+
+        for (auto i = 0; i < leaf.leafBrushCount; ++i)
+        {
+            auto index = leafBrushes[i].brushIndex;
+
+            // Avoid repeating brushes.
+            if (flags[index])
+            {
+                continue;
+            }
+            flags[index] = true;
+
+            const auto& brush = bsp.brushes[index];
+
+            if (!(bsp.textures[brush.textureIndex].contentFlags & cContentsSolid))
+            {
+                continue;
+            }
+
+            brushOrder.push_back(index);
+        }
+
+        leafEnds.push_back(brushOrder.size());
+    }
+
+    std::vector<std::vector<Vec3>> brushVerts(brushOrder.size());
+
+    ParallelFor(threadPool, brushOrder.size(), 16, [&] (auto first, auto last)
+    {
+        for (auto i = first; i < last; ++i)
+        {
+            brushVerts[i] = VerticiesFromBrush(bsp, bsp.brushes[brushOrder[i]]);
+        }
+    });
+
+    unsigned count = 0;
+    std::size_t brush = 0;
+
+    for (auto leafEnd : leafEnds)
+    {
+        for (; brush < leafEnd; ++brush)
+        {
+            auto mesh = MeshFromVerticies(brushVerts[brush]);
+
+            if (!mesh.empty())
+            {
+                for (const auto& v : mesh)
+                {
+                    result.push_back(v.data[0]);
+                    result.push_back(v.data[1]);
+                    result.push_back(v.data[2]);
+
+                    count++;
+
+                    if (count >= maxBrushCount)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (count >= maxBrushCount)
+        {
+            break;
+        }
+    }
+
+    return result;
+}
+
+std::vector<Vec3> MeshFromBrush(
+        const Bsp::CollisionBsp& bsp,
+        const Bsp::Brush& brush)
+{
+    return MeshFromVerticies(VerticiesFromBrush(bsp, brush));
+}
+
 } // namespace
@@ -22,13 +22,17 @@
 #include <vector>
 #include <stdint.h>
 
+class ThreadPool;
+
 namespace Bsp {
 
 struct CollisionBsp;
 
+/// threadPool is optional, the result is the same with or without.
 std::vector<float> BrushMeshesAsTriangleListWithNormals(
         const CollisionBsp &bsp,
-        unsigned maxBrushCount);
+        unsigned maxBrushCount,
+        ThreadPool* threadPool = nullptr);
 
 std::vector<Vec3> MeshFromBrush(
         const Bsp::CollisionBsp& bsp,
@@ -0,0 +1,504 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "BspCooked.hpp"
+
+#include <sys/stat.h>
+
+#include <atomic>
+
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Bsp {
+
+// /////////////////////
+// Constants
+// /////////////////////
+static const std::size_t cSectionAlignment = 16;
+
+// /////////////////////
+// Helpers
+// /////////////////////
+static std::size_t AlignUp(std::size_t value)
+{
+    return (value + cSectionAlignment - 1) & ~(cSectionAlignment - 1);
+}
+
+bool CookedImageIsPublished(const CookedHeader& header)
+{
+    uint32_t expected;
+    memcpy(&expected, "MBSP", sizeof(expected));
+
+    auto magic =
+        reinterpret_cast<const std::atomic<uint32_t>*>(header.magicString)->load(
+            std::memory_order_acquire);
+
+    return magic == expected;
+}
+
+static bool GetSourceInfo(
+        const std::string& bspFilePath,
+        uint64_t& byteCount,
+        int64_t& modifiedTime)
+{
+    struct stat status;
+
+    if (stat(bspFilePath.c_str(), &status) != 0)
+    {
+        return false;
+    }
+
+    byteCount       = static_cast<uint64_t>(status.st_size);
+    modifiedTime    = static_cast<int64_t>(status.st_mtime);
+
+    return true;
+}
+
+bool CookedSourceMatches(
+        const CookedHeader& header,
+        const std::string& bspFilePath)
+{
+    uint64_t byteCount;
+    int64_t modifiedTime;
+
+    if (!GetSourceInfo(bspFilePath, byteCount, modifiedTime))
+    {
+        return false;
+    }
+
+    if (byteCount != header.sourceByteCount)
+    {
+        return false;
+    }
+
+    if (modifiedTime == header.sourceModifiedTime)
+    {
+        return true;
+    }
+
+    // Touched, but maybe not changed (copied to a new server, etc).
+    MappedFile source;
+
+    if (!source.Open(bspFilePath))
+    {
+        return false;
+    }
+
+    return HashBytes(source.Data(), source.ByteCount()) == header.sourceHash;
+}
+
+// /////////////////////
+// Hashing
+// /////////////////////
+uint64_t HashBytes(const void* data, std::size_t byteCount)
+{
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = 14695981039346656037ull;
+
+    for (std::size_t i = 0; i < byteCount; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// /////////////////////
+// Cooking
+// /////////////////////
+struct CookedLayout
+{
+    CookedHeader header;
+
+    struct Source
+    {
+        const void* data;
+        std::size_t byteCount;
+    };
+
+    Source sources[CookedCount];
+    std::size_t byteCount;
+};
+
+static CookedLayout LayoutCookedImage(
+        const CollisionBsp& bsp,
+        const CookedSource& source)
+{
+    CookedLayout layout = {};
+    auto& header = layout.header;
+
+    // magicString is left blank until PublishCookedImage().
+    header.version              = cCookedVersion;
+    header.bspHeader            = bsp.header;
+    header.sourceHash           = source.hash;
+    header.sourceByteCount      = source.byteCount;
+    header.sourceModifiedTime   = source.modifiedTime;
+
+    auto addSection = [&] (CookedSections section, const auto& span)
+    {
+        layout.sources[section] =
+        {
+            span.data(),
+            span.size() * sizeof(span[0])
+        };
+    };
+
+    addSection(CookedTextures,          bsp.textures);
+    addSection(CookedPlanes,            bsp.planes);
+    addSection(CookedNodes,             bsp.nodes);
+    addSection(CookedLeaves,            bsp.leaves);
+    addSection(CookedLeafBrushes,       bsp.leafBrushes);
+    addSection(CookedBrushes,           bsp.brushes);
+    addSection(CookedBrushSides,        bsp.brushSides);
+    addSection(CookedBrushAabbs,        bsp.brushAabbs);
+    addSection(CookedPlaneTypes,        bsp.planeTypes);
+    addSection(CookedBrushPlaneRanges,  bsp.brushPlaneRanges);
+    addSection(CookedBrushPlaneData,    bsp.brushPlaneData);
+    addSection(CookedBrushPlaneTypes,   bsp.brushPlaneTypes);
+    addSection(CookedTraceNodes,        bsp.traceNodes);
+    addSection(CookedTraceNodeSources,  bsp.traceNodeSources);
+    addSection(CookedLeafBrushMasks,    bsp.leafBrushMasks);
+    addSection(CookedLeafBrushRanges,   bsp.leafBrushRanges);
+    addSection(CookedLeafBrushEntries,  bsp.leafBrushEntries);
+    addSection(CookedBvhNodes,          bsp.bvhNodes);
+    addSection(CookedBvhBrushes,        bsp.bvhBrushes);
+
+    std::size_t offset = AlignUp(sizeof(CookedHeader));
+
+    for (unsigned i = 0; i < CookedCount; ++i)
+    {
+        header.sections[i].offsetInBytesFromStartOfFile = offset;
+        header.sections[i].byteCount = layout.sources[i].byteCount;
+
+        offset = AlignUp(offset + layout.sources[i].byteCount);
+    }
+
+    layout.byteCount = offset;
+
+    return layout;
+}
+
+bool GetCookedSource(
+        const std::string& bspFilePath,
+        const void* bspFileData,
+        std::size_t byteCount,
+        CookedSource& source)
+{
+    source.hash = HashBytes(bspFileData, byteCount);
+
+    return GetSourceInfo(bspFilePath, source.byteCount, source.modifiedTime);
+}
+
+std::size_t CookedByteCount(const CollisionBsp& bsp)
+{
+    return LayoutCookedImage(bsp, {}).byteCount;
+}
+
+void WriteCookedImage(
+        const CollisionBsp& bsp,
+        const CookedSource& source,
+        void* image)
+{
+    const auto layout = LayoutCookedImage(bsp, source);
+    auto* bytes = static_cast<uint8_t*>(image);
+
+    memset(bytes, 0, layout.byteCount);
+    memcpy(bytes, &layout.header, sizeof(layout.header));
+
+    for (unsigned i = 0; i < CookedCount; ++i)
+    {
+        if (layout.sources[i].byteCount)
+        {
+            memcpy(
+                bytes + layout.header.sections[i].offsetInBytesFromStartOfFile,
+                layout.sources[i].data,
+                layout.sources[i].byteCount);
+        }
+    }
+}
+
+void PublishCookedImage(void* image)
+{
+    static_assert(
+        sizeof(std::atomic<uint32_t>) == sizeof(CookedHeader::magicString),
+        "magicString has to be written in one go.");
+
+    uint32_t magic;
+    memcpy(&magic, "MBSP", sizeof(magic));
+
+    // Everything else has to be visible before the magic is.
+    auto* header = static_cast<CookedHeader*>(image);
+
+    reinterpret_cast<std::atomic<uint32_t>*>(header->magicString)->store(
+        magic,
+        std::memory_order_release);
+}
+
+bool CookCollisionBsp(
+        const std::string& bspFilePath,
+        const std::string& cookedFilePath)
+{
+    CollisionBsp bsp;
+
+    if (!MapCollisionBsp(bspFilePath, bsp))
+    {
+        return false;
+    }
+
+    CookedSource source;
+
+    if (!GetCookedSource(
+            bspFilePath,
+            bsp.storage.file.Data(),
+            bsp.storage.file.ByteCount(),
+            source))
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> image(CookedByteCount(bsp));
+
+    WriteCookedImage(bsp, source, image.data());
+    PublishCookedImage(image.data());
+
+    // Write to a temporary file first so a half written cache
+    // is never mistaken for a good one.
+    const auto temporaryPath = cookedFilePath + ".tmp";
+    auto fileHandle = fopen(temporaryPath.c_str(), "wb");
+
+    if (!fileHandle)
+    {
+        return false;
+    }
+
+    bool ok = (fwrite(image.data(), 1, image.size(), fileHandle) == image.size());
+
+    ok = (fclose(fileHandle) == 0) && ok;
+
+    if (ok)
+    {
+        // Windows won't rename over an existing file.
+        remove(cookedFilePath.c_str());
+        ok = (rename(temporaryPath.c_str(), cookedFilePath.c_str()) == 0);
+    }
+
+    if (!ok)
+    {
+        remove(temporaryPath.c_str());
+    }
+
+    return ok;
+}
+
+// /////////////////////
+// Loading
+// /////////////////////
+static bool ViewCookedSections(
+        const void* cookedData,
+        std::size_t byteCount,
+        CollisionBsp& bsp)
+{
+    const auto* bytes = static_cast<const uint8_t*>(cookedData);
+
+    if  (
+            (!bytes) ||
+            (byteCount < sizeof(CookedHeader)) ||
+            (reinterpret_cast<uintptr_t>(bytes) % cSectionAlignment)
+        )
+    {
+        return false;
+    }
+
+    const auto& header = *reinterpret_cast<const CookedHeader*>(bytes);
+
+    if  (
+            (!CookedImageIsPublished(header)) ||
+            (header.version != cCookedVersion)
+        )
+    {
+        return false;
+    }
+
+    bool ok = true;
+
+    auto sectionView = [&] (CookedSections section, auto& span)
+    {
+        using Type = typename std::remove_reference<decltype(span[0])>::type;
+
+        const auto& source = header.sections[section];
+
+        if  (
+                (source.offsetInBytesFromStartOfFile % cSectionAlignment) ||
+                (source.byteCount % sizeof(Type)) ||
+                (source.offsetInBytesFromStartOfFile > byteCount) ||
+                (source.byteCount > byteCount - source.offsetInBytesFromStartOfFile)
+            )
+        {
+            ok = false;
+            return;
+        }
+
+        span =
+        {
+            reinterpret_cast<Type*>(bytes + source.offsetInBytesFromStartOfFile),
+            static_cast<std::size_t>(source.byteCount / sizeof(Type))
+        };
+    };
+
+    bsp.header = header.bspHeader;
+
+    sectionView(CookedTextures,         bsp.textures);
+    sectionView(CookedPlanes,           bsp.planes);
+    sectionView(CookedNodes,            bsp.nodes);
+    sectionView(CookedLeaves,           bsp.leaves);
+    sectionView(CookedLeafBrushes,      bsp.leafBrushes);
+    sectionView(CookedBrushes,          bsp.brushes);
+    sectionView(CookedBrushSides,       bsp.brushSides);
+    sectionView(CookedBrushAabbs,       bsp.brushAabbs);
+    sectionView(CookedPlaneTypes,       bsp.planeTypes);
+    sectionView(CookedBrushPlaneRanges, bsp.brushPlaneRanges);
+    sectionView(CookedBrushPlaneData,   bsp.brushPlaneData);
+    sectionView(CookedBrushPlaneTypes,  bsp.brushPlaneTypes);
+    sectionView(CookedTraceNodes,       bsp.traceNodes);
+    sectionView(CookedTraceNodeSources, bsp.traceNodeSources);
+    sectionView(CookedLeafBrushMasks,   bsp.leafBrushMasks);
+    sectionView(CookedLeafBrushRanges,  bsp.leafBrushRanges);
+    sectionView(CookedLeafBrushEntries, bsp.leafBrushEntries);
+    sectionView(CookedBvhNodes,         bsp.bvhNodes);
+    sectionView(CookedBvhBrushes,       bsp.bvhBrushes);
+
+    if (!ok)
+    {
+        return false;
+    }
+
+    std::string error;
+
+    if (!ValidateCollisionBsp(bsp, error))
+    {
+        fprintf(stderr, "Invalid cooked bsp: %s\n", error.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool ViewCookedCollisionBsp(
+        const void* cookedData,
+        std::size_t byteCount,
+        CollisionBsp& bsp)
+{
+    bsp = CollisionBsp{};
+
+    if (!ViewCookedSections(cookedData, byteCount, bsp))
+    {
+        bsp = CollisionBsp{};
+        return false;
+    }
+
+    return true;
+}
+
+bool AdoptCookedCollisionBsp(MappedFile&& image, CollisionBsp& bsp)
+{
+    bsp = CollisionBsp{};
+    bsp.storage.file = std::move(image);
+
+    const auto& file = bsp.storage.file;
+
+    if (!ViewCookedSections(file.Data(), file.ByteCount(), bsp))
+    {
+        bsp = CollisionBsp{};
+        return false;
+    }
+
+    return true;
+}
+
+bool MapCookedCollisionBsp(
+        const std::string& cookedFilePath,
+        const std::string& bspFilePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options)
+{
+    bsp = CollisionBsp{};
+
+    StageTimer timer(options.timings);
+
+    MappedFile file;
+
+    if (!file.Open(cookedFilePath))
+    {
+        return false;
+    }
+
+    timer.Stage("Map cooked file");
+
+    if (!AdoptCookedCollisionBsp(std::move(file), bsp))
+    {
+        return false;
+    }
+
+    timer.Stage("Validate");
+
+    if (!CookedSourceMatches(
+            *reinterpret_cast<const CookedHeader*>(bsp.storage.file.Data()),
+            bspFilePath))
+    {
+        bsp = CollisionBsp{};
+        return false;
+    }
+
+    timer.Stage("Check source");
+
+    if (options.traceBackend == TraceBackend::BrushBvh)
+    {
+        if (bsp.bvhNodes.empty())
+        {
+            BuildBrushBvh(bsp, options.threadPool);
+            timer.Stage("Brush BVH");
+        }
+    }
+    else
+    {
+        ClearBrushBvh(bsp);
+    }
+
+    return true;
+}
+
+bool LoadCollisionBsp(
+        const std::string& bspFilePath,
+        const std::string& cookedFilePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options)
+{
+    if (MapCookedCollisionBsp(cookedFilePath, bspFilePath, bsp, options))
+    {
+        return true;
+    }
+
+    // Any timings from the failed attempt are kept, they're
+    // still part of the load time.
+    return MapCollisionBsp(bspFilePath, bsp, options);
+}
+
+} // namespace
@@ -0,0 +1,160 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "Bsp.hpp"
+
+#include <string>
+#include <cstdint>
+
+// A "cooked" bsp is a CollisionBsp saved after BuildTraceData(), so
+// loading one is just a memory map with no post processing at all.
+//
+// Layout: CookedHeader, then each section 16 byte aligned. Section offsets
+// are from the start of the file so the image can be mapped anywhere.
+// Native endian, it's a cache not an interchange format.
+
+namespace Bsp {
+
+/// Bump whenever any of the cooked structures change, or how the derived
+/// data in them is worked out.
+const uint32_t cCookedVersion = 8;
+
+enum CookedSections
+{
+    CookedTextures = 0,
+    CookedPlanes,
+    CookedNodes,
+    CookedLeaves,
+    CookedLeafBrushes,
+    CookedBrushes,
+    CookedBrushSides,
+    CookedBrushAabbs,
+    CookedPlaneTypes,
+    CookedBrushPlaneRanges,
+    CookedBrushPlaneData,
+    CookedBrushPlaneTypes,
+    CookedTraceNodes,
+    CookedTraceNodeSources,
+    CookedLeafBrushMasks,
+    CookedLeafBrushRanges,
+    CookedLeafBrushEntries,
+    CookedBvhNodes,
+    CookedBvhBrushes,
+
+    CookedCount,
+};
+
+struct CookedSection
+{
+    uint64_t offsetInBytesFromStartOfFile;
+    uint64_t byteCount;
+};
+
+struct CookedHeader
+{
+    // Always "MBSP"
+    char        magicString[4];
+    uint32_t    version;
+
+    // Identifies the .bsp this was cooked from.
+    uint64_t    sourceHash;
+    uint64_t    sourceByteCount;
+    int64_t     sourceModifiedTime;
+
+    // Header of the original bsp.
+    Header          bspHeader;
+    CookedSection   sections[CookedCount];
+};
+
+/// Identifies the .bsp a cooked image was made from.
+struct CookedSource
+{
+    uint64_t    hash;
+    uint64_t    byteCount;
+    int64_t     modifiedTime;
+};
+
+/// 64 bit FNV-1a. Cooked files are keyed on the hash of the source bsp.
+uint64_t HashBytes(const void* data, std::size_t byteCount);
+
+/// bspFileData is the whole file at bspFilePath.
+bool GetCookedSource(
+        const std::string& bspFilePath,
+        const void* bspFileData,
+        std::size_t byteCount,
+        CookedSource& source);
+
+/// True if bspFilePath is still the file header was cooked from.
+bool CookedSourceMatches(
+        const CookedHeader& header,
+        const std::string& bspFilePath);
+
+// Building an image in place (for a file, shared memory, etc) is:
+// WriteCookedImage() into CookedByteCount() bytes, 16 byte aligned, then
+// PublishCookedImage(). Until it's published the loaders reject it, so
+// another process can watch the image being written safely.
+std::size_t CookedByteCount(const CollisionBsp& bsp);
+
+void WriteCookedImage(
+        const CollisionBsp& bsp,
+        const CookedSource& source,
+        void* image);
+
+void PublishCookedImage(void* image);
+
+bool CookedImageIsPublished(const CookedHeader& header);
+
+/// Loads bspFilePath and writes its cooked version to cookedFilePath.
+/// Only the cContentsSolid leaf brush lists are cooked.
+bool CookCollisionBsp(
+        const std::string& bspFilePath,
+        const std::string& cookedFilePath);
+
+/// Maps the cooked image in place. Fails if the image is corrupt, was
+/// made by a different cCookedVersion, or bspFilePath has changed since
+/// it was cooked. Only options.timings, traceBackend and threadPool are
+/// used, there's nothing else to calculate and cooked files only hold the
+/// collision lumps. The BVH is built after mapping if options asks for
+/// one and the image doesn't have it, or dropped if it has one and
+/// options doesn't.
+bool MapCookedCollisionBsp(
+        const std::string& cookedFilePath,
+        const std::string& bspFilePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options = {});
+
+/// Same as MapCookedCollisionBsp(), but with the cooked image already in
+/// memory (16 byte aligned, outliving bsp). Doesn't check the source.
+bool ViewCookedCollisionBsp(
+        const void* cookedData,
+        std::size_t byteCount,
+        CollisionBsp& bsp);
+
+/// Takes over a mapping holding a cooked image and uses it in place.
+/// Like ViewCookedCollisionBsp(), doesn't check the source.
+bool AdoptCookedCollisionBsp(MappedFile&& image, CollisionBsp& bsp);
+
+/// Uses the cooked file if it's up to date, otherwise falls back to
+/// MapCollisionBsp() on the original.
+bool LoadCollisionBsp(
+        const std::string& bspFilePath,
+        const std::string& cookedFilePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options = {});
+
+} // namespace
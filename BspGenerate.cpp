@@ -0,0 +1,160 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "Bsp.hpp"
+#include "BspGenerator.hpp"
+
+#include "third-party/getopt/getopt.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+void PrintHelp()
+{
+    printf("\n");
+    printf("BspGenerate - Makes made up quake3 bsps for benchmarking.\n\n");
+
+    printf("  BspGenerate [-h] [-t rooms|clutter|terrain] [-n <brushes>]\n");
+    printf("              [-e <extra sides>] [-r <seed>] -o <bsp to write>\n\n");
+
+    printf("  -t:  Layout. Rooms and corridors, dense clutter, or open\n");
+    printf("       terrain. Defaults to rooms.\n\n");
+
+    printf("  -n:  How many brushes to make. Defaults to 1000.\n\n");
+
+    printf("  -e:  Bevels this many edges of every brush, 0 to 12.\n");
+    printf("       Defaults to 0 (6 sided boxes).\n\n");
+
+    printf("  -r:  Random seed. Defaults to 1.\n\n");
+
+    printf("  -o:  Where to write the bsp.\n\n");
+
+    printf("  -h:  This help text.\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    Bsp::GeneratorOptions options;
+    std::string outputFileName;
+
+    // Parse options
+    while (auto ch = getopt(argc, argv, "ht:n:e:r:o:"))
+    {
+        if (ch < 0)
+        {
+            break;
+        }
+
+        if (ch == 'h')
+        {
+            PrintHelp();
+            return 0;
+        }
+
+        if (ch == 't' && optarg)
+        {
+            if (!strcmp(optarg, "rooms"))
+            {
+                options.layout = Bsp::GeneratorLayout::Rooms;
+            }
+            else if (!strcmp(optarg, "clutter"))
+            {
+                options.layout = Bsp::GeneratorLayout::Clutter;
+            }
+            else if (!strcmp(optarg, "terrain"))
+            {
+                options.layout = Bsp::GeneratorLayout::Terrain;
+            }
+            else
+            {
+                PrintHelp();
+                printf("Unknown layout '%s'.\n", optarg);
+                return -1;
+            }
+        }
+
+        if (ch == 'n' && optarg)
+        {
+            options.brushCount = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+        }
+
+        if (ch == 'e' && optarg)
+        {
+            options.extraSideCount = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+        }
+
+        if (ch == 'r' && optarg)
+        {
+            options.seed = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+        }
+
+        if (ch == 'o' && optarg)
+        {
+            outputFileName = optarg;
+        }
+    }
+
+    if (outputFileName.empty())
+    {
+        PrintHelp();
+        return -1;
+    }
+
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+
+    if (!Bsp::WriteGeneratedBsp(outputFileName, options))
+    {
+        printf("Cannot write '%s'.\n", outputFileName.c_str());
+        return -1;
+    }
+
+    auto generated = steady_clock::now();
+
+    // Make sure it loads the same way any other map would.
+    Bsp::CollisionBsp bsp;
+
+    if (!Bsp::GetCollisionBsp(outputFileName, bsp))
+    {
+        printf("Wrote '%s', but it doesn't load!\n", outputFileName.c_str());
+        return -1;
+    }
+
+    auto loaded = steady_clock::now();
+
+    printf(
+        "Wrote '%s': %zu brushes, %zu brush sides, %zu planes, "
+        "%zu nodes, %zu leaves, %zu leaf brushes.\n",
+        outputFileName.c_str(),
+        bsp.brushes.size(),
+        bsp.brushSides.size(),
+        bsp.planes.size(),
+        bsp.nodes.size(),
+        bsp.leaves.size(),
+        bsp.leafBrushes.size());
+
+    printf(
+        "Generate %ld ms, load %ld ms.\n",
+        static_cast<long>(duration_cast<milliseconds>(generated - start).count()),
+        static_cast<long>(duration_cast<milliseconds>(loaded - generated).count()));
+
+    return 0;
+}
@@ -0,0 +1,840 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "BspGenerator.hpp"
+#include "Bsp.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+
+namespace Bsp {
+
+// /////////////////////
+// Constants
+// /////////////////////
+const int32_t cGeneratorTextureSolid    = 0;
+const int32_t cGeneratorTextureWater    = 1;
+const int32_t cContentsWater            = 32;
+
+// Tree building stops splitting at this many brushes per leaf, or this
+// deep, whichever comes first.
+const std::size_t   cGeneratorLeafBrushCount    = 4;
+const unsigned      cGeneratorMaxDepth          = 48;
+
+const unsigned cMaxExtraSideCount = 12;
+
+// /////////////////////
+// Helpers
+// /////////////////////
+
+// Integer coordinates, like a map made in an editor with the grid on.
+struct GeneratorBox
+{
+    int32_t min[3];
+    int32_t max[3];
+};
+
+// Planes are found by their exact bits, so the same plane is only stored
+// once, same as q3map does.
+struct GeneratorPlaneKey
+{
+    uint32_t bits[4];
+
+    bool operator==(const GeneratorPlaneKey& other) const
+    {
+        return memcmp(bits, other.bits, sizeof(bits)) == 0;
+    }
+};
+
+struct GeneratorPlaneHash
+{
+    std::size_t operator()(const GeneratorPlaneKey& key) const
+    {
+        uint64_t hash = 1469598103934665603ull;
+
+        for (auto bits : key.bits)
+        {
+            hash = (hash ^ bits) * 1099511628211ull;
+        }
+
+        return static_cast<std::size_t>(hash);
+    }
+};
+
+static GeneratorPlaneKey PlaneKey(const ::Plane& plane)
+{
+    GeneratorPlaneKey key;
+
+    memcpy(&key.bits[0], plane.normal.data, sizeof(float) * 3);
+    memcpy(&key.bits[3], &plane.distance, sizeof(float));
+
+    return key;
+}
+
+// Not std::uniform_int_distribution, so the same seed makes the same map
+// with any standard library.
+class GeneratorRandom
+{
+public:
+    explicit GeneratorRandom(uint32_t seed)
+        : m_engine(seed ? seed : 1)
+    {
+    }
+
+    // [low, high]
+    int32_t Range(int32_t low, int32_t high)
+    {
+        const auto span = static_cast<uint32_t>(high - low) + 1;
+
+        return low + static_cast<int32_t>(m_engine() % span);
+    }
+
+private:
+    std::minstd_rand m_engine;
+};
+
+class BspBuilder
+{
+public:
+    BspBuilder(std::size_t brushCount, uint32_t extraSideCount)
+        : m_brushCount(brushCount)
+        , m_extraSideCount(std::min(extraSideCount, cMaxExtraSideCount))
+    {
+        m_brushes.reserve(brushCount);
+        m_boxes.reserve(brushCount);
+
+        Texture solid = {};
+        strcpy(solid.name, "textures/generated/solid");
+        solid.contentFlags = cContentsSolid;
+
+        Texture water = {};
+        strcpy(water.name, "textures/generated/water");
+        water.contentFlags = cContentsWater;
+
+        m_textures.push_back(solid);
+        m_textures.push_back(water);
+    }
+
+    bool Full() const
+    {
+        return m_brushes.size() >= m_brushCount;
+    }
+
+    // topPlane is an extra (sloped) side on top of the box, box.max[2]
+    // has to be at or above its highest point.
+    void AddBox(
+            const GeneratorBox& box,
+            int32_t textureIndex = cGeneratorTextureSolid,
+            const ::Plane* topPlane = nullptr)
+    {
+        if  (
+                (Full()) ||
+                (box.min[0] >= box.max[0]) ||
+                (box.min[1] >= box.max[1]) ||
+                (box.min[2] >= box.max[2])
+            )
+        {
+            return;
+        }
+
+        Brush brush;
+        brush.firstBrushSideIndex = static_cast<int32_t>(m_brushSides.size());
+        brush.textureIndex = textureIndex;
+
+        auto addSide = [&] (const ::Plane& plane)
+        {
+            m_brushSides.push_back({AddPlane(plane), textureIndex});
+        };
+
+        // Q3 puts the axial sides first: -x, +x, -y, +y, -z, +z.
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            ::Plane minSide = {{0, 0, 0}, static_cast<float>(-box.min[axis])};
+            ::Plane maxSide = {{0, 0, 0}, static_cast<float>(box.max[axis])};
+
+            minSide.normal.data[axis] = -1.0f;
+            maxSide.normal.data[axis] =  1.0f;
+
+            addSide(minSide);
+            addSide(maxSide);
+        }
+
+        if (topPlane)
+        {
+            addSide(*topPlane);
+        }
+
+        // Bevel edges, each edge is where two faces meet.
+        static const int edges[cMaxExtraSideCount][2] =
+        {
+            // Upright edges (face = axis * 2 + (max ? 1 : 0)).
+            {0, 2}, {1, 2}, {0, 3}, {1, 3},
+
+            // Top edges
+            {0, 5}, {1, 5}, {2, 5}, {3, 5},
+
+            // Bottom edges
+            {0, 4}, {1, 4}, {2, 4}, {3, 4},
+        };
+
+        auto smallest = std::min(
+            box.max[0] - box.min[0],
+            std::min(box.max[1] - box.min[1], box.max[2] - box.min[2]));
+
+        const float bevel = static_cast<float>(std::max(smallest / 4, 1));
+        const float inverseRoot2 = 1.0f / std::sqrt(2.0f);
+
+        for (unsigned i = 0; i < m_extraSideCount; ++i)
+        {
+            ::Plane plane = {{0, 0, 0}, 0.0f};
+            float distance = -bevel;
+
+            for (auto face : edges[i])
+            {
+                const auto axis = face / 2;
+                const float sign = (face & 1) ? 1.0f : -1.0f;
+                const auto bound = (face & 1) ? box.max[axis] : box.min[axis];
+
+                plane.normal.data[axis] = sign * inverseRoot2;
+                distance += sign * static_cast<float>(bound);
+            }
+
+            plane.distance = distance * inverseRoot2;
+
+            addSide(plane);
+        }
+
+        brush.sideCount =
+            static_cast<int32_t>(m_brushSides.size()) -
+            brush.firstBrushSideIndex;
+
+        m_brushes.push_back(brush);
+        m_boxes.push_back(box);
+    }
+
+    void BuildTree()
+    {
+        GeneratorBox bounds = {{0, 0, 0}, {1, 1, 1}};
+
+        if (!m_boxes.empty())
+        {
+            bounds = m_boxes[0];
+        }
+
+        for (const auto& box : m_boxes)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                bounds.min[axis] = std::min(bounds.min[axis], box.min[axis]);
+                bounds.max[axis] = std::max(bounds.max[axis], box.max[axis]);
+            }
+        }
+
+        // Room to move around the outside.
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            bounds.min[axis] -= 64;
+            bounds.max[axis] += 64;
+        }
+
+        m_worldBounds = bounds;
+
+        std::vector<int32_t> brushIndices(m_boxes.size());
+
+        for (std::size_t i = 0; i < brushIndices.size(); ++i)
+        {
+            brushIndices[i] = static_cast<int32_t>(i);
+        }
+
+        BuildNode(std::move(brushIndices), bounds, 0);
+    }
+
+    std::vector<uint8_t> Write(const std::string& entities) const
+    {
+        Model world = {};
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            world.boundsMin[axis] = static_cast<float>(m_worldBounds.min[axis]);
+            world.boundsMax[axis] = static_cast<float>(m_worldBounds.max[axis]);
+        }
+
+        world.brushCount = static_cast<int32_t>(m_brushes.size());
+
+        struct LumpData
+        {
+            const void* data;
+            std::size_t byteCount;
+        };
+
+        LumpData lumps[Lumps::Count] = {};
+
+        auto setLump = [&lumps] (Lumps lump, const auto& vector)
+        {
+            lumps[lump] = {vector.data(), vector.size() * sizeof(vector[0])};
+        };
+
+        // Includes the terminating 0.
+        lumps[Entities]     = {entities.c_str(), entities.size() + 1};
+        lumps[Models]       = {&world, sizeof(world)};
+
+        setLump(Textures,       m_textures);
+        setLump(Planes,         m_planes);
+        setLump(Nodes,          m_nodes);
+        setLump(Leaves,         m_leaves);
+        setLump(LeafBrushes,    m_leafBrushes);
+        setLump(Brushes,        m_brushes);
+        setLump(BrushSides,     m_brushSides);
+
+        Header header = {};
+        memcpy(header.magicString, "IBSP", 4);
+        header.version = cQuake3BspVersion;
+
+        std::size_t byteCount = sizeof(Header);
+
+        for (unsigned i = 0; i < Lumps::Count; ++i)
+        {
+            header.lumps[i].offsetInBytesFromStartOfFile =
+                static_cast<int32_t>(byteCount);
+            header.lumps[i].byteCount =
+                static_cast<int32_t>(lumps[i].byteCount);
+
+            byteCount += (lumps[i].byteCount + 3) & ~std::size_t(3);
+        }
+
+        std::vector<uint8_t> file(byteCount, 0);
+
+        memcpy(file.data(), &header, sizeof(header));
+
+        for (unsigned i = 0; i < Lumps::Count; ++i)
+        {
+            if (lumps[i].byteCount)
+            {
+                memcpy(
+                    file.data() + header.lumps[i].offsetInBytesFromStartOfFile,
+                    lumps[i].data,
+                    lumps[i].byteCount);
+            }
+        }
+
+        return file;
+    }
+
+private:
+    // Planes come in pairs, i and i ^ 1 face opposite ways.
+    int32_t AddPlane(::Plane plane)
+    {
+        // No -0.0f, it'd make a different key.
+        for (auto& component : plane.normal.data)
+        {
+            component += 0.0f;
+        }
+
+        plane.distance += 0.0f;
+
+        auto found = m_planeLookup.find(PlaneKey(plane));
+
+        if (found != m_planeLookup.end())
+        {
+            return found->second;
+        }
+
+        ::Plane flipped =
+        {
+            {
+                -plane.normal.data[0] + 0.0f,
+                -plane.normal.data[1] + 0.0f,
+                -plane.normal.data[2] + 0.0f
+            },
+            -plane.distance + 0.0f
+        };
+
+        const auto index = static_cast<int32_t>(m_planes.size());
+
+        m_planes.push_back(plane);
+        m_planes.push_back(flipped);
+
+        m_planeLookup[PlaneKey(plane)]      = index;
+        m_planeLookup[PlaneKey(flipped)]    = index + 1;
+
+        return index;
+    }
+
+    // Returns the child index for whatever was made: a node index, or
+    // -(leaf + 1) for a leaf. Brushes that straddle a split go both ways.
+    int32_t BuildNode(
+            std::vector<int32_t> brushIndices,
+            const GeneratorBox& bounds,
+            unsigned depth)
+    {
+        const auto count = brushIndices.size();
+
+        // Trace() starts at node 0, so there's always at least one node.
+        if  (
+                (depth > 0) &&
+                (
+                    (count <= cGeneratorLeafBrushCount) ||
+                    (depth >= cGeneratorMaxDepth)
+                )
+            )
+        {
+            return MakeLeaf(brushIndices, bounds);
+        }
+
+        // Longest axis first, but any axis that actually splits the
+        // brushes up will do.
+        int axes[3] = {0, 1, 2};
+
+        std::sort(axes, axes + 3, [&bounds] (int a, int b)
+        {
+            return
+                (bounds.max[a] - bounds.min[a]) >
+                (bounds.max[b] - bounds.min[b]);
+        });
+
+        std::vector<int32_t> front;
+        std::vector<int32_t> back;
+
+        int axis = axes[0];
+        int32_t split = 0;
+        bool splitFound = false;
+
+        for (auto tryAxis : axes)
+        {
+            axis = tryAxis;
+
+            // Split on the median brush face, like q3map splitting on brush
+            // sides. Brushes that just touch the split only go on the side
+            // they're on, same as any other bsp. Otherwise every corner
+            // where brushes meet would never split up.
+            std::vector<int32_t> faces;
+
+            faces.reserve(count * 2);
+
+            for (auto brushIndex : brushIndices)
+            {
+                const auto& box = m_boxes[brushIndex];
+
+                if (box.min[axis] > bounds.min[axis])
+                {
+                    faces.push_back(box.min[axis]);
+                }
+
+                if (box.max[axis] < bounds.max[axis])
+                {
+                    faces.push_back(box.max[axis]);
+                }
+            }
+
+            if (faces.empty())
+            {
+                // Nothing to split on but the middle.
+                if (bounds.max[axis] - bounds.min[axis] < 2)
+                {
+                    continue;
+                }
+
+                split = bounds.min[axis] + (bounds.max[axis] - bounds.min[axis]) / 2;
+            }
+            else
+            {
+                std::nth_element(faces.begin(), faces.begin() + faces.size() / 2, faces.end());
+                split = faces[faces.size() / 2];
+            }
+
+            front.clear();
+            back.clear();
+
+            for (auto brushIndex : brushIndices)
+            {
+                const auto& box = m_boxes[brushIndex];
+
+                if (box.max[axis] > split)
+                {
+                    front.push_back(brushIndex);
+                }
+
+                if (box.min[axis] < split)
+                {
+                    back.push_back(brushIndex);
+                }
+            }
+
+            splitFound = true;
+
+            if ((front.size() < count) || (back.size() < count))
+            {
+                break;
+            }
+        }
+
+        // Splitting isn't getting anywhere.
+        if  (
+                (depth > 0) &&
+                (
+                    (!splitFound) ||
+                    (
+                        (front.size() == count) &&
+                        (back.size() == count)
+                    )
+                )
+            )
+        {
+            return MakeLeaf(brushIndices, bounds);
+        }
+
+        brushIndices.clear();
+        brushIndices.shrink_to_fit();
+
+        ::Plane plane = {{0, 0, 0}, static_cast<float>(split)};
+        plane.normal.data[axis] = 1.0f;
+
+        const auto nodeIndex = static_cast<int32_t>(m_nodes.size());
+
+        Node node = {};
+        node.planeIndex = AddPlane(plane);
+
+        for (int i = 0; i < 3; ++i)
+        {
+            node.boundsMin[i] = bounds.min[i];
+            node.boundsMax[i] = bounds.max[i];
+        }
+
+        m_nodes.push_back(node);
+
+        auto frontBounds = bounds;
+        auto backBounds = bounds;
+
+        frontBounds.min[axis] = split;
+        backBounds.max[axis] = split;
+
+        const auto frontChild = BuildNode(std::move(front), frontBounds, depth + 1);
+        const auto backChild = BuildNode(std::move(back), backBounds, depth + 1);
+
+        m_nodes[nodeIndex].childIndex[0] = frontChild;
+        m_nodes[nodeIndex].childIndex[1] = backChild;
+
+        return nodeIndex;
+    }
+
+    int32_t MakeLeaf(
+            const std::vector<int32_t>& brushIndices,
+            const GeneratorBox& bounds)
+    {
+        Leaf leaf = {};
+
+        // No vis data.
+        leaf.visdataClusterIndex = -1;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            leaf.boundsMin[i] = bounds.min[i];
+            leaf.boundsMax[i] = bounds.max[i];
+        }
+
+        leaf.firstLeafBrushIndex = static_cast<int32_t>(m_leafBrushes.size());
+        leaf.leafBrushCount = static_cast<int32_t>(brushIndices.size());
+
+        for (auto brushIndex : brushIndices)
+        {
+            m_leafBrushes.push_back({brushIndex});
+        }
+
+        m_leaves.push_back(leaf);
+
+        return -static_cast<int32_t>(m_leaves.size());
+    }
+
+    const std::size_t       m_brushCount;
+    const uint32_t          m_extraSideCount;
+
+    std::vector<Texture>    m_textures;
+    std::vector<::Plane>    m_planes;
+    std::vector<Node>       m_nodes;
+    std::vector<Leaf>       m_leaves;
+    std::vector<LeafBrush>  m_leafBrushes;
+    std::vector<Brush>      m_brushes;
+    std::vector<BrushSide>  m_brushSides;
+
+    // Same index as m_brushes, for building the tree.
+    std::vector<GeneratorBox> m_boxes;
+    GeneratorBox            m_worldBounds = {{0, 0, 0}, {0, 0, 0}};
+
+    std::unordered_map<GeneratorPlaneKey, int32_t, GeneratorPlaneHash> m_planeLookup;
+};
+
+// /////////////////////
+// Layouts
+// /////////////////////
+static void GenerateRooms(BspBuilder& builder, uint32_t brushCount, GeneratorRandom& random)
+{
+    const int32_t cellSize      = 512;
+    const int32_t cellHeight    = 256;
+    const int32_t wall          = 16;
+    const int32_t doorWidth     = 128;
+    const int32_t doorHeight    = 128;
+
+    // About 10 brushes a room. Big maps get more floors rather than
+    // going past the +-65536 Quake3 can handle.
+    const auto cellCount = brushCount / 10 + 1;
+    const auto floorCount = std::min(1u + cellCount / 4096u, 16u);
+    const auto side = static_cast<int32_t>(
+        std::ceil(std::sqrt(static_cast<double>(cellCount) / floorCount)));
+
+    for (unsigned level = 0; !builder.Full(); ++level)
+    {
+        const int32_t z0 = static_cast<int32_t>(level) * cellHeight;
+        const int32_t z1 = z0 + cellHeight;
+
+        for (int32_t j = 0; j < side && !builder.Full(); ++j)
+        {
+            for (int32_t i = 0; i < side && !builder.Full(); ++i)
+            {
+                const int32_t x0 = (i - side / 2) * cellSize;
+                const int32_t y0 = (j - side / 2) * cellSize;
+                const int32_t x1 = x0 + cellSize;
+                const int32_t y1 = y0 + cellSize;
+
+                const int32_t xMid = x0 + cellSize / 2;
+                const int32_t yMid = y0 + cellSize / 2;
+
+                // Floor and ceiling.
+                builder.AddBox({{x0, y0, z0}, {x1, y1, z0 + wall}});
+                builder.AddBox({{x0, y0, z1 - wall}, {x1, y1, z1}});
+
+                const int32_t doorTop = z0 + wall + doorHeight;
+
+                // Wall on the +x side, with a doorway.
+                builder.AddBox({{x1 - wall / 2, y0, z0 + wall}, {x1 + wall / 2, yMid - doorWidth / 2, z1 - wall}});
+                builder.AddBox({{x1 - wall / 2, yMid + doorWidth / 2, z0 + wall}, {x1 + wall / 2, y1, z1 - wall}});
+                builder.AddBox({{x1 - wall / 2, yMid - doorWidth / 2, doorTop}, {x1 + wall / 2, yMid + doorWidth / 2, z1 - wall}});
+
+                // Wall on the +y side, with a doorway.
+                builder.AddBox({{x0, y1 - wall / 2, z0 + wall}, {xMid - doorWidth / 2, y1 + wall / 2, z1 - wall}});
+                builder.AddBox({{xMid + doorWidth / 2, y1 - wall / 2, z0 + wall}, {x1, y1 + wall / 2, z1 - wall}});
+                builder.AddBox({{xMid - doorWidth / 2, y1 - wall / 2, doorTop}, {xMid + doorWidth / 2, y1 + wall / 2, z1 - wall}});
+
+                // Close off the outside.
+                if (i == 0)
+                {
+                    builder.AddBox({{x0 - wall / 2, y0, z0 + wall}, {x0 + wall / 2, y1, z1 - wall}});
+                }
+
+                if (j == 0)
+                {
+                    builder.AddBox({{x0, y0 - wall / 2, z0 + wall}, {x1, y0 + wall / 2, z1 - wall}});
+                }
+
+                if ((i + j) % 3 == 0)
+                {
+                    // Corridor running along x, filled in either side.
+                    builder.AddBox({{x0 + wall, y0 + wall, z0 + wall}, {x1 - wall, yMid - doorWidth / 2, z1 - wall}});
+                    builder.AddBox({{x0 + wall, yMid + doorWidth / 2, z0 + wall}, {x1 - wall, y1 - wall, z1 - wall}});
+                }
+                else
+                {
+                    // Room, with a couple of pillars.
+                    for (int pillar = 0; pillar < 2; ++pillar)
+                    {
+                        const auto px = random.Range(x0 + 48, x1 - 96);
+                        const auto py = random.Range(y0 + 48, y1 - 96);
+
+                        builder.AddBox({{px, py, z0 + wall}, {px + 32, py + 32, z1 - wall}});
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void GenerateClutter(BspBuilder& builder, uint32_t brushCount, GeneratorRandom& random)
+{
+    const int32_t spacing   = 96;
+    const int32_t layers    = 4;
+
+    const auto perLayer = std::max(brushCount / layers, 1u);
+    const auto halfSide = static_cast<int32_t>(
+        std::ceil(std::sqrt(static_cast<double>(perLayer)))) * spacing / 2;
+
+    // Something to stand on.
+    builder.AddBox({{-halfSide, -halfSide, -16}, {halfSide, halfSide, 0}});
+
+    while (!builder.Full())
+    {
+        int32_t size[3];
+
+        for (auto& length : size)
+        {
+            length = random.Range(16, 64);
+        }
+
+        const auto x = random.Range(-halfSide, halfSide - size[0]);
+        const auto y = random.Range(-halfSide, halfSide - size[1]);
+        const auto z = random.Range(0, layers * spacing - size[2]);
+
+        const auto texture = (random.Range(0, 19) == 0)
+            ? cGeneratorTextureWater
+            : cGeneratorTextureSolid;
+
+        builder.AddBox({{x, y, z}, {x + size[0], y + size[1], z + size[2]}}, texture);
+    }
+}
+
+static void GenerateTerrain(BspBuilder& builder, uint32_t brushCount, GeneratorRandom& random)
+{
+    const int32_t spacing   = 64;
+    const int32_t bottom    = -512;
+
+    const auto side = static_cast<int32_t>(
+        std::ceil(std::sqrt(static_cast<double>(brushCount))));
+
+    // Rolling hills, different for each seed.
+    const float phaseX = static_cast<float>(random.Range(0, 6283)) / 1000.0f;
+    const float phaseY = static_cast<float>(random.Range(0, 6283)) / 1000.0f;
+
+    auto height = [&] (int32_t x, int32_t y)
+    {
+        const float fx = static_cast<float>(x);
+        const float fy = static_cast<float>(y);
+
+        return std::floor(
+            128.0f * std::sin(fx * 0.002f + phaseX) +
+             64.0f * std::sin(fy * 0.003f + phaseY) +
+             32.0f * std::sin((fx + fy) * 0.011f));
+    };
+
+    for (int32_t j = 0; j < side && !builder.Full(); ++j)
+    {
+        for (int32_t i = 0; i < side && !builder.Full(); ++i)
+        {
+            const int32_t x0 = (i - side / 2) * spacing;
+            const int32_t y0 = (j - side / 2) * spacing;
+            const int32_t x1 = x0 + spacing;
+            const int32_t y1 = y0 + spacing;
+
+            // The top goes through three of the corners, and the fourth is
+            // wherever that puts it.
+            const float h00 = height(x0, y0);
+            const float h10 = height(x1, y0);
+            const float h01 = height(x0, y1);
+            const float h11 = h10 + h01 - h00;
+
+            const float dx = static_cast<float>(spacing);
+            const float dy = static_cast<float>(spacing);
+
+            // (dx, 0, h10 - h00) x (0, dy, h01 - h00)
+            float normal[3] =
+            {
+                -(h10 - h00) * dy,
+                -(h01 - h00) * dx,
+                dx * dy
+            };
+
+            const float length = std::sqrt(
+                normal[0] * normal[0] +
+                normal[1] * normal[1] +
+                normal[2] * normal[2]);
+
+            ::Plane top = {{normal[0] / length, normal[1] / length, normal[2] / length}, 0.0f};
+
+            top.distance =
+                top.normal.data[0] * static_cast<float>(x0) +
+                top.normal.data[1] * static_cast<float>(y0) +
+                top.normal.data[2] * h00;
+
+            const auto highest = static_cast<int32_t>(std::ceil(
+                std::max(std::max(h00, h10), std::max(h01, h11))));
+
+            builder.AddBox({{x0, y0, bottom}, {x1, y1, highest}}, cGeneratorTextureSolid, &top);
+        }
+    }
+}
+
+// /////////////////////
+// Generate
+// /////////////////////
+std::vector<uint8_t> GenerateBsp(const GeneratorOptions& options)
+{
+    BspBuilder builder(options.brushCount, options.extraSideCount);
+    GeneratorRandom random(options.seed);
+
+    const char* layoutName = "rooms";
+
+    switch (options.layout)
+    {
+        case GeneratorLayout::Rooms:
+        {
+            GenerateRooms(builder, options.brushCount, random);
+            break;
+        }
+
+        case GeneratorLayout::Clutter:
+        {
+            layoutName = "clutter";
+            GenerateClutter(builder, options.brushCount, random);
+            break;
+        }
+
+        case GeneratorLayout::Terrain:
+        {
+            layoutName = "terrain";
+            GenerateTerrain(builder, options.brushCount, random);
+            break;
+        }
+    }
+
+    builder.BuildTree();
+
+    char entities[256];
+
+    snprintf(
+        entities,
+        sizeof(entities),
+        "{\n"
+        "\"classname\" \"worldspawn\"\n"
+        "\"message\" \"Generated %s, %u brushes, seed %u\"\n"
+        "}\n",
+        layoutName,
+        options.brushCount,
+        options.seed);
+
+    return builder.Write(entities);
+}
+
+bool WriteGeneratedBsp(
+        const std::string& filePath,
+        const GeneratorOptions& options)
+{
+    const auto file = GenerateBsp(options);
+
+    auto fileHandle = fopen(filePath.c_str(), "wb");
+
+    if (!fileHandle)
+    {
+        return false;
+    }
+
+    const bool written =
+        fwrite(file.data(), 1, file.size(), fileHandle) == file.size();
+
+    return (fclose(fileHandle) == 0) && written;
+}
+
+} // namespace
@@ -0,0 +1,64 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Makes made up Quake3 bsp files, of any size, for seeing how loading and
+// tracing scale past the one real map in data/. Only the collision side of
+// things is there: brushes, planes and a node tree, but no faces, so the
+// viewer draws them with the brush meshes as usual.
+
+namespace Bsp {
+
+enum class GeneratorLayout
+{
+    /// Grid of rooms joined by doorways, with corridors and pillars,
+    /// stacked into floors as it gets bigger.
+    Rooms,
+
+    /// Lots of small crates packed into a box, some of them water.
+    Clutter,
+
+    /// Height field of columns with sloped tops.
+    Terrain,
+};
+
+struct GeneratorOptions
+{
+    GeneratorLayout layout      = GeneratorLayout::Rooms;
+
+    /// Exactly this many brushes are made.
+    uint32_t        brushCount  = 1000;
+
+    /// 0 - 12. Bevels this many edges of each brush, so each one has
+    /// 6 + extraSideCount sides.
+    uint32_t        extraSideCount = 0;
+
+    uint32_t        seed        = 1;
+};
+
+/// The whole bsp file. Always valid, everything is centred on the origin.
+std::vector<uint8_t> GenerateBsp(const GeneratorOptions& options);
+
+bool WriteGeneratedBsp(
+        const std::string& filePath,
+        const GeneratorOptions& options);
+
+} // namespace
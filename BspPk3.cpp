@@ -0,0 +1,584 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "BspPk3.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace Bsp {
+
+// /////////////////////
+// Zip Format
+// /////////////////////
+
+// Little endian, and not aligned, so everything is read a byte at a time.
+// No zip64, pk3 files never need it.
+const uint32_t cEndOfCentralDirectorySignature  = 0x06054b50;
+const uint32_t cCentralDirectorySignature       = 0x02014b50;
+const uint32_t cLocalHeaderSignature            = 0x04034b50;
+
+const std::size_t cEndOfCentralDirectoryByteCount   = 22;
+const std::size_t cCentralDirectoryByteCount        = 46;
+const std::size_t cLocalHeaderByteCount             = 30;
+
+// The end record is followed by a comment of up to 64k.
+const std::size_t cMaxCommentByteCount = 0xFFFF;
+
+const uint16_t cMethodStored    = 0;
+const uint16_t cMethodDeflated  = 8;
+
+struct ZipEntry
+{
+    uint16_t    method;
+    uint32_t    compressedByteCount;
+    uint32_t    byteCount;
+    uint32_t    localHeaderOffset;
+};
+
+// /////////////////////
+// Helpers
+// /////////////////////
+static uint16_t Read16(const uint8_t* bytes)
+{
+    return static_cast<uint16_t>(bytes[0] | (bytes[1] << 8));
+}
+
+static uint32_t Read32(const uint8_t* bytes)
+{
+    return
+        static_cast<uint32_t>(bytes[0]) |
+        (static_cast<uint32_t>(bytes[1]) << 8) |
+        (static_cast<uint32_t>(bytes[2]) << 16) |
+        (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+static bool ReadAt(FILE* file, long offset, void* data, std::size_t byteCount)
+{
+    return
+        (fseek(file, offset, SEEK_SET) == 0) &&
+        (fread(data, 1, byteCount, file) == byteCount);
+}
+
+// Zip paths always use '/', but people type whatever.
+static bool SamePath(const char* zipPath, std::size_t length, const std::string& path)
+{
+    if (length != path.size())
+    {
+        return false;
+    }
+
+    for (std::size_t i = 0; i < length; ++i)
+    {
+        auto a = std::tolower(static_cast<unsigned char>(zipPath[i]));
+        auto b = std::tolower(static_cast<unsigned char>(path[i]));
+
+        if (b == '\\')
+        {
+            b = '/';
+        }
+
+        if (a != b)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Reads just the end record and the central directory.
+static bool FindEntry(FILE* file, const std::string& entryPath, ZipEntry& entry)
+{
+    if (fseek(file, 0, SEEK_END))
+    {
+        return false;
+    }
+
+    const long fileByteCount = ftell(file);
+
+    if  (
+            (fileByteCount < 0) ||
+            (static_cast<std::size_t>(fileByteCount) < cEndOfCentralDirectoryByteCount)
+        )
+    {
+        return false;
+    }
+
+    // The end record is somewhere in the last 64k + 22 bytes.
+    const auto tailByteCount = std::min(
+        static_cast<std::size_t>(fileByteCount),
+        cEndOfCentralDirectoryByteCount + cMaxCommentByteCount);
+
+    std::vector<uint8_t> tail(tailByteCount);
+
+    if (!ReadAt(file, fileByteCount - static_cast<long>(tailByteCount), tail.data(), tail.size()))
+    {
+        return false;
+    }
+
+    const uint8_t* end = nullptr;
+
+    for (auto i = tail.size() - cEndOfCentralDirectoryByteCount + 1; i-- > 0;)
+    {
+        if (Read32(&tail[i]) == cEndOfCentralDirectorySignature)
+        {
+            end = &tail[i];
+            break;
+        }
+    }
+
+    if (!end)
+    {
+        return false;
+    }
+
+    const auto entryCount           = Read16(end + 10);
+    const auto directoryByteCount   = Read32(end + 12);
+    const auto directoryOffset      = Read32(end + 16);
+
+    if  (
+            static_cast<uint64_t>(directoryOffset) + directoryByteCount >
+            static_cast<uint64_t>(fileByteCount)
+        )
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> directory(directoryByteCount);
+
+    if  (
+            (!directory.empty()) &&
+            (!ReadAt(file, static_cast<long>(directoryOffset), directory.data(), directory.size()))
+        )
+    {
+        return false;
+    }
+
+    std::size_t offset = 0;
+
+    for (unsigned i = 0; i < entryCount; ++i)
+    {
+        if  (
+                (offset + cCentralDirectoryByteCount > directory.size()) ||
+                (Read32(&directory[offset]) != cCentralDirectorySignature)
+            )
+        {
+            return false;
+        }
+
+        const auto* record = &directory[offset];
+
+        const auto nameLength       = Read16(record + 28);
+        const auto extraLength      = Read16(record + 30);
+        const auto commentLength    = Read16(record + 32);
+        const auto* name            = reinterpret_cast<const char*>(record + cCentralDirectoryByteCount);
+
+        if (offset + cCentralDirectoryByteCount + nameLength > directory.size())
+        {
+            return false;
+        }
+
+        if (SamePath(name, nameLength, entryPath))
+        {
+            entry.method                = Read16(record + 10);
+            entry.compressedByteCount   = Read32(record + 20);
+            entry.byteCount             = Read32(record + 24);
+            entry.localHeaderOffset     = Read32(record + 42);
+
+            return true;
+        }
+
+        offset +=
+            cCentralDirectoryByteCount +
+            nameLength +
+            extraLength +
+            commentLength;
+    }
+
+    return false;
+}
+
+// Reads an entry front to back, inflating as it goes. Can only skip
+// forwards, which is all loading lumps in file order needs.
+class EntryReader
+{
+public:
+    ~EntryReader()
+    {
+        if (m_inflating)
+        {
+            inflateEnd(&m_stream);
+        }
+    }
+
+    bool Open(FILE* file, const ZipEntry& entry)
+    {
+        uint8_t local[cLocalHeaderByteCount];
+
+        if  (
+                (!ReadAt(file, static_cast<long>(entry.localHeaderOffset), local, sizeof(local))) ||
+                (Read32(local) != cLocalHeaderSignature)
+            )
+        {
+            return false;
+        }
+
+        // The local name and extra field can differ from the central ones.
+        const long dataOffset =
+            static_cast<long>(entry.localHeaderOffset) +
+            static_cast<long>(cLocalHeaderByteCount) +
+            Read16(local + 26) +
+            Read16(local + 28);
+
+        if (fseek(file, dataOffset, SEEK_SET))
+        {
+            return false;
+        }
+
+        m_file                  = file;
+        m_method                = entry.method;
+        m_compressedRemaining   = entry.compressedByteCount;
+        m_byteCount             = entry.byteCount;
+
+        if (m_method == cMethodStored)
+        {
+            return m_compressedRemaining == m_byteCount;
+        }
+
+        if (m_method != cMethodDeflated)
+        {
+            return false;
+        }
+
+        // Negative window bits == raw deflate, no zlib header.
+        memset(&m_stream, 0, sizeof(m_stream));
+        m_inflating = (inflateInit2(&m_stream, -MAX_WBITS) == Z_OK);
+
+        return m_inflating;
+    }
+
+    std::size_t Position() const { return m_position; }
+    std::size_t ByteCount() const { return m_byteCount; }
+
+    bool Read(void* data, std::size_t byteCount)
+    {
+        if (byteCount > m_byteCount - m_position)
+        {
+            return false;
+        }
+
+        m_position += byteCount;
+
+        if (m_method == cMethodStored)
+        {
+            return fread(data, 1, byteCount, m_file) == byteCount;
+        }
+
+        m_stream.next_out = static_cast<Bytef*>(data);
+
+        while (byteCount)
+        {
+            // zlib counts in uInt.
+            const auto chunk = static_cast<uInt>(
+                std::min<std::size_t>(byteCount, 1u << 30));
+
+            m_stream.avail_out = chunk;
+
+            while (m_stream.avail_out)
+            {
+                if (!m_stream.avail_in && !Refill())
+                {
+                    return false;
+                }
+
+                const auto result = inflate(&m_stream, Z_NO_FLUSH);
+
+                if  (
+                        (result != Z_OK) &&
+                        !((result == Z_STREAM_END) && (!m_stream.avail_out))
+                    )
+                {
+                    return false;
+                }
+            }
+
+            byteCount -= chunk;
+        }
+
+        return true;
+    }
+
+    bool Skip(std::size_t byteCount)
+    {
+        if (m_method == cMethodStored)
+        {
+            if  (
+                    (byteCount > m_byteCount - m_position) ||
+                    (fseek(m_file, static_cast<long>(byteCount), SEEK_CUR))
+                )
+            {
+                return false;
+            }
+
+            m_position += byteCount;
+
+            return true;
+        }
+
+        uint8_t discard[16 * 1024];
+
+        while (byteCount)
+        {
+            const auto chunk = std::min(byteCount, sizeof(discard));
+
+            if (!Read(discard, chunk))
+            {
+                return false;
+            }
+
+            byteCount -= chunk;
+        }
+
+        return true;
+    }
+
+private:
+    bool Refill()
+    {
+        const auto chunk = std::min<std::size_t>(
+            m_compressedRemaining,
+            sizeof(m_input));
+
+        if  (
+                (!chunk) ||
+                (fread(m_input, 1, chunk, m_file) != chunk)
+            )
+        {
+            return false;
+        }
+
+        m_compressedRemaining -= chunk;
+
+        m_stream.next_in    = m_input;
+        m_stream.avail_in   = static_cast<uInt>(chunk);
+
+        return true;
+    }
+
+    FILE*       m_file                  = nullptr;
+    uint16_t    m_method                = cMethodStored;
+    std::size_t m_compressedRemaining   = 0;
+    std::size_t m_byteCount             = 0;
+    std::size_t m_position              = 0;
+
+    z_stream    m_stream;
+    bool        m_inflating             = false;
+    uint8_t     m_input[64 * 1024];
+};
+
+// Where one lump ends up.
+struct LumpTarget
+{
+    Lumps   lump;
+    void*   data;
+    std::size_t byteCount;
+};
+
+// /////////////////////
+// Loading
+// /////////////////////
+bool GetCollisionBspFromPk3(
+        const std::string& pk3FilePath,
+        const std::string& entryPath,
+        CollisionBsp& bsp,
+        const LoadOptions& options)
+{
+    bsp = CollisionBsp{};
+
+    StageTimer timer(options.timings);
+
+    auto fileHandle = fopen(pk3FilePath.c_str(), "rb");
+
+    if (!fileHandle)
+    {
+        return false;
+    }
+
+    bool loaded = false;
+
+    // Using do once + continue in leiu of scoped_exit
+    do
+    {
+        ZipEntry entry;
+
+        if (!FindEntry(fileHandle, entryPath, entry))
+        {
+            continue;
+        }
+
+        timer.Stage("Read pk3 directory");
+
+        // Too big for the reader's buffer to live on the stack.
+        auto reader = std::make_unique<EntryReader>();
+
+        if  (
+                (!reader->Open(fileHandle, entry)) ||
+                (!reader->Read(&bsp.header, sizeof(Header))) ||
+                (!HeaderIsValid(bsp.header)) ||
+                (!LumpsFitInFile(bsp.header, reader->ByteCount()))
+            )
+        {
+            continue;
+        }
+
+        auto& storage = bsp.storage;
+        std::vector<LumpTarget> targets;
+
+        auto addTypes = [&] (Lumps lumpEnum, auto& vector)
+        {
+            const auto typeSize = sizeof(vector[0]);
+
+            vector.resize(bsp.header.lumps[lumpEnum].byteCount / typeSize);
+            targets.push_back({lumpEnum, vector.data(), vector.size() * typeSize});
+        };
+
+        addTypes(Textures,    storage.textures);
+        addTypes(Planes,      storage.planes);
+        addTypes(Nodes,       storage.nodes);
+        addTypes(Leaves,      storage.leaves);
+        addTypes(LeafBrushes, storage.leafBrushes);
+        addTypes(Brushes,     storage.brushes);
+        addTypes(BrushSides,  storage.brushSides);
+
+        const auto extraLumpMask = options.extraLumpMask & cExtraLumps;
+
+        if (extraLumpMask)
+        {
+            auto extra = std::make_unique<ExtraLumps>();
+
+            extra->mask     = extraLumpMask;
+            extra->header   = bsp.header;
+
+            for (unsigned i = 0; i < Lumps::Count; ++i)
+            {
+                if (extraLumpMask & LumpBit(static_cast<Lumps>(i)))
+                {
+                    addTypes(static_cast<Lumps>(i), extra->copies[i]);
+                }
+            }
+
+            storage.extraLumps = std::move(extra);
+        }
+
+        // The entry can only be read forwards, so read the lumps in the
+        // order they're in the file.
+        std::sort(
+            targets.begin(),
+            targets.end(),
+            [&bsp] (const LumpTarget& a, const LumpTarget& b)
+            {
+                return
+                    bsp.header.lumps[a.lump].offsetInBytesFromStartOfFile <
+                    bsp.header.lumps[b.lump].offsetInBytesFromStartOfFile;
+            });
+
+        bool readAll = true;
+
+        for (const auto& target : targets)
+        {
+            if (!target.byteCount)
+            {
+                continue;
+            }
+
+            const auto offset = static_cast<std::size_t>(
+                bsp.header.lumps[target.lump].offsetInBytesFromStartOfFile);
+
+            // Overlapping lumps would need the entry reading twice.
+            if  (
+                    (offset < reader->Position()) ||
+                    (!reader->Skip(offset - reader->Position())) ||
+                    (!reader->Read(target.data, target.byteCount))
+                )
+            {
+                readAll = false;
+                break;
+            }
+        }
+
+        if (!readAll)
+        {
+            continue;
+        }
+
+        timer.Stage("Inflate lumps");
+
+        bsp.textures    = storage.textures;
+        bsp.planes      = storage.planes;
+        bsp.nodes       = storage.nodes;
+        bsp.leaves      = storage.leaves;
+        bsp.leafBrushes = storage.leafBrushes;
+        bsp.brushes     = storage.brushes;
+        bsp.brushSides  = storage.brushSides;
+
+        std::string error;
+
+        if (!ValidateCollisionBsp(bsp, error))
+        {
+            fprintf(stderr, "Invalid bsp in pk3: %s\n", error.c_str());
+            continue;
+        }
+
+        timer.Stage("Validate");
+
+        BuildTraceData(bsp, options);
+
+        // Already read, so just point the views at the copies.
+        if (auto* extra = storage.extraLumps.get())
+        {
+            for (unsigned i = 0; i < Lumps::Count; ++i)
+            {
+                if (extra->mask & LumpBit(static_cast<Lumps>(i)))
+                {
+                    std::call_once(extra->loaded[i], [extra, i] ()
+                    {
+                        extra->views[i] = extra->copies[i];
+                    });
+                }
+            }
+        }
+
+        loaded = true;
+
+    } while(!fileHandle);
+
+    fclose(fileHandle);
+
+    if (!loaded)
+    {
+        bsp = CollisionBsp{};
+    }
+
+    return loaded;
+}
+
+} // namespace
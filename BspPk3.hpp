@@ -0,0 +1,40 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "Bsp.hpp"
+
+#include <string>
+
+// Loading maps straight out of pk3 files (zip archives, as shipped with
+// Quake3) without extracting them first.
+
+namespace Bsp {
+
+/// Same as GetCollisionBsp(), but for the bsp at entryPath inside the pk3
+/// (eg "maps/q3dm17.bsp", case doesn't matter). Only the zip's central
+/// directory and that entry are read, and the entry is inflated as it's
+/// read, straight into the lump storage. Decompression stops after the
+/// last lump that's needed, so extra lumps (options.extraLumpMask) are
+/// read up front rather than when first asked for.
+bool GetCollisionBspFromPk3(
+        const std::string& pk3FilePath,
+        const std::string& entryPath,
+        CollisionBsp& bsp,
+        const LoadOptions& options = {});
+
+} // namespace
@@ -0,0 +1,324 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "BspRegistry.hpp"
+#include "BspCooked.hpp"
+
+#include <sys/stat.h>
+
+#include <utility>
+
+namespace Bsp {
+
+// /////////////////////
+// Helpers
+// /////////////////////
+
+// Cheap enough to do on every acquire, unlike hashing the file again.
+// Down to the nanosecond where there is one, as a map can be rewritten
+// with the same size within a second.
+struct SourceStamp
+{
+    uint64_t    byteCount           = 0;
+    int64_t     modifiedTime        = 0;
+    int64_t     modifiedNanoseconds = 0;
+};
+
+static bool GetSourceStamp(const std::string& bspFilePath, SourceStamp& stamp)
+{
+    struct stat status;
+
+    if (stat(bspFilePath.c_str(), &status) != 0)
+    {
+        return false;
+    }
+
+    stamp.byteCount     = static_cast<uint64_t>(status.st_size);
+    stamp.modifiedTime  = static_cast<int64_t>(status.st_mtime);
+
+#ifdef _WIN32
+    stamp.modifiedNanoseconds = 0;
+#else
+    stamp.modifiedNanoseconds = static_cast<int64_t>(status.st_mtim.tv_nsec);
+#endif
+
+    return true;
+}
+
+static bool SameStamp(const SourceStamp& lhs, const SourceStamp& rhs)
+{
+    return
+        (lhs.byteCount == rhs.byteCount) &&
+        (lhs.modifiedTime == rhs.modifiedTime) &&
+        (lhs.modifiedNanoseconds == rhs.modifiedNanoseconds);
+}
+
+static bool SourceUnchanged(
+        const std::string& bspFilePath,
+        uint64_t byteCount,
+        int64_t modifiedTime,
+        int64_t modifiedNanoseconds)
+{
+    SourceStamp stamp;
+
+    return
+        (GetSourceStamp(bspFilePath, stamp)) &&
+        (SameStamp(stamp, {byteCount, modifiedTime, modifiedNanoseconds}));
+}
+
+// The file is read twice, once for the map and once for its hash, so it's
+// tried again if it changes in between.
+static const unsigned cLoadAttempts = 3;
+
+static LoadOptions WithoutTimings(LoadOptions options)
+{
+    // Loads can run at the same time, so they can't share one.
+    options.timings = nullptr;
+
+    return options;
+}
+
+// /////////////////////
+// MapRegistry
+// /////////////////////
+MapRegistry::MapRegistry(
+        std::size_t byteBudget,
+        const LoadOptions& options)
+    : m_options(WithoutTimings(options))
+    , m_byteBudget(byteBudget)
+{
+}
+
+MapHandle MapRegistry::Acquire(const std::string& bspFilePath)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    auto& entry = m_entries[bspFilePath];
+
+    if (entry.loading)
+    {
+        // Someone else is already loading it, use whatever they get.
+        m_loaded.wait(lock, [&entry] { return !entry.loading; });
+
+        auto handle = entry.alive.lock();
+
+        if (handle)
+        {
+            ++m_stats.hitCount;
+            Touch(entry, handle);
+        }
+
+        return handle;
+    }
+
+    auto handle = entry.alive.lock();
+
+    if  (
+            (handle) &&
+            (SourceUnchanged(
+                bspFilePath,
+                entry.sourceByteCount,
+                entry.sourceModifiedTime,
+                entry.sourceModifiedNanoseconds))
+        )
+    {
+        ++m_stats.hitCount;
+        Touch(entry, handle);
+
+        return handle;
+    }
+
+    entry.loading = true;
+
+    lock.unlock();
+    handle = Load(bspFilePath, entry);
+    lock.lock();
+
+    entry.loading = false;
+    m_loaded.notify_all();
+
+    return handle;
+}
+
+MapHandle MapRegistry::AcquireByHash(uint64_t sourceHash)
+{
+    std::string bspFilePath;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto found = m_pathsByHash.find(sourceHash);
+
+        if (found == m_pathsByHash.end())
+        {
+            return {};
+        }
+
+        bspFilePath = found->second;
+    }
+
+    auto handle = Acquire(bspFilePath);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The file might have been replaced with a different map.
+    if (m_entries[bspFilePath].sourceHash != sourceHash)
+    {
+        return {};
+    }
+
+    return handle;
+}
+
+void MapRegistry::SetByteBudget(std::size_t byteBudget)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_byteBudget = byteBudget;
+    Evict();
+}
+
+std::size_t MapRegistry::ResidentByteCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_residentByteCount;
+}
+
+MapRegistry::Stats MapRegistry::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_stats;
+}
+
+// Called without m_mutex held, entry.loading stops anyone else touching
+// entry until it's done.
+MapHandle MapRegistry::Load(const std::string& bspFilePath, Entry& entry)
+{
+    // Not mapped, as a mapping shares the file's pages. Overwriting the
+    // file would then change (or SIGBUS) maps that old handles still hold.
+    auto bsp = std::make_shared<CollisionBsp>();
+    CookedSource source;
+    SourceStamp stamp;
+
+    bool loaded = false;
+
+    for (unsigned attempt = 0; (attempt < cLoadAttempts) && (!loaded); ++attempt)
+    {
+        SourceStamp before;
+        MappedFile file;
+
+        loaded =
+            (GetSourceStamp(bspFilePath, before)) &&
+            (GetCollisionBsp(bspFilePath, *bsp, m_options));
+
+        if (!loaded)
+        {
+            break;
+        }
+
+        ReadExtraLumps(*bsp);
+
+        loaded =
+            (file.Open(bspFilePath)) &&
+            (GetCookedSource(bspFilePath, file.Data(), file.ByteCount(), source)) &&
+            (GetSourceStamp(bspFilePath, stamp)) &&
+            (SameStamp(before, stamp));
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Whatever was loaded before is out of date either way.
+    if (entry.resident)
+    {
+        m_residentByteCount -= entry.byteCount;
+        entry.resident.reset();
+    }
+
+    entry.alive.reset();
+
+    if (!loaded)
+    {
+        return {};
+    }
+
+    MapHandle handle = std::move(bsp);
+
+    entry.alive                 = handle;
+    entry.sourceHash            = source.hash;
+    entry.sourceByteCount       = stamp.byteCount;
+    entry.sourceModifiedTime    = stamp.modifiedTime;
+    entry.sourceModifiedNanoseconds = stamp.modifiedNanoseconds;
+    entry.byteCount             = CollisionBspByteCount(*handle);
+
+    m_pathsByHash[source.hash] = bspFilePath;
+
+    ++m_stats.loadCount;
+    Touch(entry, handle);
+
+    return handle;
+}
+
+// m_mutex must be held.
+void MapRegistry::Touch(Entry& entry, const MapHandle& handle)
+{
+    entry.lastUsed = ++m_useCount;
+
+    // Might have been evicted while someone was still using it.
+    if (!entry.resident)
+    {
+        entry.resident = handle;
+        m_residentByteCount += entry.byteCount;
+    }
+
+    Evict();
+}
+
+// m_mutex must be held. Only a handful of maps, so a linear search for the
+// least recently used one is fine.
+void MapRegistry::Evict()
+{
+    while (m_residentByteCount > m_byteBudget)
+    {
+        Entry* oldest = nullptr;
+
+        for (auto& keyValue : m_entries)
+        {
+            auto& entry = keyValue.second;
+
+            if  (
+                    (entry.resident) &&
+                    ((!oldest) || (entry.lastUsed < oldest->lastUsed))
+                )
+            {
+                oldest = &entry;
+            }
+        }
+
+        if (!oldest)
+        {
+            return;
+        }
+
+        m_residentByteCount -= oldest->byteCount;
+        oldest->resident.reset();
+
+        ++m_stats.evictionCount;
+    }
+}
+
+} // namespace
@@ -0,0 +1,124 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "Bsp.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Keeps several maps loaded at once for servers that rotate between them.
+// Maps are handed out as shared, immutable handles, so a map stays valid
+// for as long as anyone is using it, even after the registry evicts it.
+
+namespace Bsp {
+
+using MapHandle = std::shared_ptr<const CollisionBsp>;
+
+class MapRegistry
+{
+public:
+    struct Stats
+    {
+        /// Acquires that found the map already loaded.
+        uint64_t    hitCount        = 0;
+
+        /// Maps actually loaded from disk.
+        uint64_t    loadCount       = 0;
+
+        /// Maps dropped to stay under the byte budget.
+        uint64_t    evictionCount   = 0;
+    };
+
+    /// The registry keeps recently used maps loaded until they add up to
+    /// more than byteBudget (see CollisionBspByteCount()). options are
+    /// used for every load, apart from timings.
+    explicit MapRegistry(
+            std::size_t byteBudget,
+            const LoadOptions& options = {});
+
+    MapRegistry(const MapRegistry&) = delete;
+    MapRegistry& operator=(const MapRegistry&) = delete;
+
+    /// Returns the map, loading it if needed, or nullptr if it won't load.
+    /// If several threads ask for the same map at once it's only loaded
+    /// once. A map is reloaded if the file's size or modification time has
+    /// changed since it was loaded, anyone still holding the old handle
+    /// keeps the old map. Maps are private copies (GetCollisionBsp() and
+    /// ReadExtraLumps()), so that holds even if the file is overwritten in
+    /// place.
+    MapHandle Acquire(const std::string& bspFilePath);
+
+    /// Same as Acquire(), but by the hash of the bsp file (see HashBytes()).
+    /// Only finds maps that have been acquired by path at some point.
+    MapHandle AcquireByHash(uint64_t sourceHash);
+
+    /// Evicts least recently used maps until under the new budget.
+    void SetByteBudget(std::size_t byteBudget);
+
+    /// Bytes of the maps the registry is keeping loaded. Maps that have
+    /// been evicted but are still held by someone don't count.
+    std::size_t ResidentByteCount() const;
+
+    Stats GetStats() const;
+
+private:
+    struct Entry
+    {
+        // Set while a load is in flight, everyone else waits on m_loaded.
+        bool        loading         = false;
+
+        // Keeps the map loaded until it's evicted.
+        MapHandle   resident;
+
+        // Still valid while anyone holds a handle, even if evicted.
+        std::weak_ptr<const CollisionBsp> alive;
+
+        uint64_t    sourceHash      = 0;
+        uint64_t    sourceByteCount = 0;
+        int64_t     sourceModifiedTime = 0;
+        int64_t     sourceModifiedNanoseconds = 0;
+        std::size_t byteCount       = 0;
+        uint64_t    lastUsed        = 0;
+    };
+
+    MapHandle Load(const std::string& bspFilePath, Entry& entry);
+    void Touch(Entry& entry, const MapHandle& handle);
+    void Evict();
+
+    const LoadOptions           m_options;
+
+    mutable std::mutex          m_mutex;
+    std::condition_variable     m_loaded;
+
+    std::size_t                 m_byteBudget;
+    std::size_t                 m_residentByteCount = 0;
+    uint64_t                    m_useCount          = 0;
+    Stats                       m_stats;
+
+    // Keyed by path. Never erased, so AcquireByHash() can reload evicted
+    // maps and rotating back to a map doesn't need to look for it.
+    std::unordered_map<std::string, Entry>          m_entries;
+    std::unordered_map<uint64_t, std::string>       m_pathsByHash;
+};
+
+} // namespace
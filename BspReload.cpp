@@ -0,0 +1,147 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "BspReload.hpp"
+
+#include <utility>
+
+namespace Bsp {
+
+LiveCollisionBsp::LiveCollisionBsp(MapHandle bsp)
+{
+    Publish(std::move(bsp));
+}
+
+LiveCollisionBsp::~LiveCollisionBsp()
+{
+    WaitForReload();
+}
+
+void LiveCollisionBsp::Publish(MapHandle bsp)
+{
+    std::lock_guard<std::mutex> lock(m_publishMutex);
+
+    m_current.store(bsp.get());
+    m_version.fetch_add(1);
+
+    WaitForReaders();
+
+    // Nobody can be reading the old one any more.
+    m_owner = std::move(bsp);
+}
+
+bool LiveCollisionBsp::Reload(
+        const std::string& bspFilePath,
+        const LoadOptions& options)
+{
+    // Not mapped, as a mapping shares the file's pages. Overwriting the
+    // file would then change (or SIGBUS) versions still being traced.
+    auto bsp = std::make_shared<CollisionBsp>();
+
+    if (!GetCollisionBsp(bspFilePath, *bsp, options))
+    {
+        return false;
+    }
+
+    // The extra lumps would otherwise be read from the file when first
+    // asked for, by which time it could be a different map.
+    ReadExtraLumps(*bsp);
+
+    Publish(std::move(bsp));
+
+    return true;
+}
+
+void LiveCollisionBsp::ReloadInBackground(
+        const std::string& bspFilePath,
+        const LoadOptions& options,
+        std::function<void(bool reloaded)> onDone)
+{
+    std::lock_guard<std::mutex> lock(m_reloadMutex);
+
+    JoinReloadThread();
+
+    m_reloadThread = std::thread([this, bspFilePath, options, onDone] ()
+    {
+        bool reloaded = Reload(bspFilePath, options);
+
+        if (onDone)
+        {
+            onDone(reloaded);
+        }
+    });
+}
+
+void LiveCollisionBsp::WaitForReload()
+{
+    std::lock_guard<std::mutex> lock(m_reloadMutex);
+
+    JoinReloadThread();
+}
+
+uint64_t LiveCollisionBsp::Version() const
+{
+    return m_version.load();
+}
+
+// m_reloadMutex must be held. Called from onDone, the reload thread would
+// be joining itself, which std::terminate()s. Its reload is already done
+// by then and it returns as soon as onDone does, so it's let go instead.
+void LiveCollisionBsp::JoinReloadThread()
+{
+    if (!m_reloadThread.joinable())
+    {
+        return;
+    }
+
+    if (m_reloadThread.get_id() == std::this_thread::get_id())
+    {
+        m_reloadThread.detach();
+    }
+    else
+    {
+        m_reloadThread.join();
+    }
+}
+
+unsigned LiveCollisionBsp::StripeIndex()
+{
+    static std::atomic<unsigned> nextIndex{0};
+    static thread_local unsigned index = nextIndex.fetch_add(1) % cStripeCount;
+
+    return index;
+}
+
+// A reader that saw the old version bumped its counter before reading the
+// pointer, so it has to show up in one of the two phases. Readers are
+// usually only a trace or two long, so spinning is fine.
+void LiveCollisionBsp::WaitForReaders()
+{
+    for (unsigned flip = 0; flip < 2; ++flip)
+    {
+        unsigned phase = m_phase.fetch_add(1) & 1;
+
+        for (const auto& stripe : m_stripes)
+        {
+            while (stripe.count[phase].load() != 0)
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
+
+} // namespace
@@ -0,0 +1,165 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "Bsp.hpp"
+#include "BspRegistry.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Lets a map be swapped for a new version while traces are running.
+//
+// RCU style: readers take a Reader, which bumps a counter and reads the
+// current version. Publishing a new version is an atomic pointer swap, then
+// waiting until every reader that could have seen the old version has
+// finished (a grace period) before letting it go. Readers never wait.
+//
+// The counters come in two sets, and the writer flips which set new readers
+// use. Waiting for both sets to drain in turn covers readers that read the
+// flag just before a flip. Each set is striped across cache lines so reader
+// threads don't all fight over one.
+
+namespace Bsp {
+
+class LiveCollisionBsp
+{
+    static const unsigned cStripeCount = 16;
+
+    struct alignas(64) ReaderStripe
+    {
+        std::atomic<uint32_t> count[2];
+    };
+
+public:
+    /// Pins the version that was current when it was made. Hold one across
+    /// a batch of traces rather than one per trace if you can, and don't
+    /// hold one forever, as old versions can't be freed until it's gone.
+    /// A thread holding one mustn't call Publish(), Reload() or
+    /// WaitForReload(), as they'd wait for it to go, forever.
+    class Reader
+    {
+    public:
+        explicit Reader(const LiveCollisionBsp& live)
+            : m_stripe(&live.m_stripes[StripeIndex()])
+            , m_phase(live.m_phase.load() & 1)
+        {
+            m_stripe->count[m_phase].fetch_add(1);
+            m_bsp = live.m_current.load();
+        }
+
+        ~Reader()
+        {
+            if (m_stripe)
+            {
+                m_stripe->count[m_phase].fetch_sub(1);
+            }
+        }
+
+        Reader(Reader&& other)
+            : m_stripe(other.m_stripe)
+            , m_phase(other.m_phase)
+            , m_bsp(other.m_bsp)
+        {
+            other.m_stripe = nullptr;
+        }
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+        Reader& operator=(Reader&&) = delete;
+
+        /// nullptr if nothing has been published yet.
+        const CollisionBsp* Get() const { return m_bsp; }
+
+        const CollisionBsp& operator*() const { return *m_bsp; }
+        const CollisionBsp* operator->() const { return m_bsp; }
+
+    private:
+        ReaderStripe*           m_stripe;
+        unsigned                m_phase;
+        const CollisionBsp*     m_bsp;
+    };
+
+    LiveCollisionBsp() = default;
+    explicit LiveCollisionBsp(MapHandle bsp);
+
+    /// Waits for any background reload to finish.
+    ~LiveCollisionBsp();
+
+    LiveCollisionBsp(const LiveCollisionBsp&) = delete;
+    LiveCollisionBsp& operator=(const LiveCollisionBsp&) = delete;
+
+    Reader Read() const
+    {
+        return Reader(*this);
+    }
+
+    /// Makes bsp the current version, then waits for readers of the
+    /// previous version to finish before letting it go. Only the caller
+    /// waits, readers carry on as normal. Never call it while holding a
+    /// Reader.
+    void Publish(MapHandle bsp);
+
+    /// Loads a private copy of bspFilePath with GetCollisionBsp() and
+    /// publishes it. Any extra lumps in options are read straight away too,
+    /// so no version ever goes back to the file. That way the file can be
+    /// patched in place (cp new.bsp map.bsp) while older versions are still
+    /// being traced. If it won't load the current version is kept and this
+    /// returns false.
+    bool Reload(
+            const std::string& bspFilePath,
+            const LoadOptions& options = {});
+
+    /// Reload() on a background thread. onDone (if set) is called from that
+    /// thread with the result. Waits for the previous one to finish first.
+    /// onDone can call ReloadInBackground() or WaitForReload() itself, as
+    /// neither waits for the thread they're called from.
+    void ReloadInBackground(
+            const std::string& bspFilePath,
+            const LoadOptions& options = {},
+            std::function<void(bool reloaded)> onDone = {});
+
+    void WaitForReload();
+
+    /// Goes up by one every time a new version is published.
+    uint64_t Version() const;
+
+private:
+    static unsigned StripeIndex();
+
+    void WaitForReaders();
+    void JoinReloadThread();
+
+    mutable ReaderStripe            m_stripes[cStripeCount] = {};
+    std::atomic<unsigned>           m_phase{0};
+    std::atomic<const CollisionBsp*> m_current{nullptr};
+
+    // Only touched by Publish().
+    std::mutex                      m_publishMutex;
+    MapHandle                       m_owner;
+    std::atomic<uint64_t>           m_version{0};
+
+    std::mutex                      m_reloadMutex;
+    std::thread                     m_reloadThread;
+};
+
+} // namespace
@@ -0,0 +1,453 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "BspShared.hpp"
+#include "BspCooked.hpp"
+
+#ifndef _WIN32
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <utility>
+
+namespace Bsp {
+
+#ifdef _WIN32
+
+// RAM: TODO: Named file mappings would do the same job on windows.
+bool AttachSharedCollisionBsp(
+        const std::string&,
+        const std::string& bspFilePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options)
+{
+    return MapCollisionBsp(bspFilePath, bsp, options);
+}
+
+bool UnlinkSharedCollisionBsp(const std::string&)
+{
+    return false;
+}
+
+#else
+
+// /////////////////////
+// Helpers
+// /////////////////////
+
+// Whoever publishes holds an exclusive flock() on the shared memory object
+// until it's done. The lock goes with the process, so an unpublished object
+// that nobody has locked was abandoned by a publisher that died.
+static bool IsPublished(int fileDescriptor)
+{
+    struct stat status;
+
+    if  (
+            (fstat(fileDescriptor, &status) != 0) ||
+            (status.st_size < static_cast<off_t>(sizeof(CookedHeader)))
+        )
+    {
+        return false;
+    }
+
+    auto header = mmap(
+                nullptr,
+                sizeof(CookedHeader),
+                PROT_READ,
+                MAP_SHARED,
+                fileDescriptor,
+                0);
+
+    if (header == MAP_FAILED)
+    {
+        return false;
+    }
+
+    auto published =
+        CookedImageIsPublished(*static_cast<const CookedHeader*>(header));
+
+    munmap(header, sizeof(CookedHeader));
+
+    return published;
+}
+
+// Unlinks sharedName if it still names fileDescriptor's object. Only call
+// it with the object locked, so two processes can't both retire the same
+// object and have the second unlink the first's replacement.
+static void UnlinkIfCurrent(int fileDescriptor, const std::string& sharedName)
+{
+    auto current = shm_open(sharedName.c_str(), O_RDONLY, 0);
+
+    if (current < 0)
+    {
+        return;
+    }
+
+    struct stat ours;
+    struct stat theirs;
+
+    if  (
+            (fstat(fileDescriptor, &ours) == 0) &&
+            (fstat(current, &theirs) == 0) &&
+            (ours.st_dev == theirs.st_dev) &&
+            (ours.st_ino == theirs.st_ino)
+        )
+    {
+        shm_unlink(sharedName.c_str());
+    }
+
+    close(current);
+}
+
+// Called with the object locked. Fills it with the cooked image, only
+// marking it as published once it's all written. Rewrites whatever an
+// abandoned publisher left behind; nobody maps an unpublished image for
+// longer than it takes to see that it is.
+static bool Publish(
+        int fileDescriptor,
+        const std::string& bspFilePath,
+        const LoadOptions& options)
+{
+    // Someone else got the lock first (between our create and our lock).
+    if (IsPublished(fileDescriptor))
+    {
+        return true;
+    }
+
+    // Always published with the default options, whatever the caller's
+    // are, as every process shares it. See ApplyOptions().
+    LoadOptions sourceOptions;
+    sourceOptions.threadPool = options.threadPool;
+
+    CollisionBsp source;
+
+    if (!MapCollisionBsp(bspFilePath, source, sourceOptions))
+    {
+        return false;
+    }
+
+    CookedSource cookedSource;
+
+    if (!GetCookedSource(
+            bspFilePath,
+            source.storage.file.Data(),
+            source.storage.file.ByteCount(),
+            cookedSource))
+    {
+        return false;
+    }
+
+    const auto byteCount = CookedByteCount(source);
+
+    if (ftruncate(fileDescriptor, static_cast<off_t>(byteCount)) != 0)
+    {
+        return false;
+    }
+
+    auto image = mmap(
+                nullptr,
+                byteCount,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED,
+                fileDescriptor,
+                0);
+
+    if (image == MAP_FAILED)
+    {
+        return false;
+    }
+
+    WriteCookedImage(source, cookedSource, image);
+    PublishCookedImage(image);
+
+    munmap(image, byteCount);
+
+    return true;
+}
+
+// Only succeeds once the publisher has finished. unusable is set if it
+// has, but the image won't load (eg. it's from an older cooked version).
+static bool TryAttach(
+        const std::string& sharedName,
+        CollisionBsp& bsp,
+        bool& unusable)
+{
+    MappedFile image;
+
+    // Fails while it's still zero sized.
+    if (!image.OpenSharedMemory(sharedName))
+    {
+        return false;
+    }
+
+    if  (
+            (image.ByteCount() < sizeof(CookedHeader)) ||
+            (!CookedImageIsPublished(
+                *reinterpret_cast<const CookedHeader*>(image.Data())))
+        )
+    {
+        return false;
+    }
+
+    unusable = !AdoptCookedCollisionBsp(std::move(image), bsp);
+
+    return !unusable;
+}
+
+// The image has the default node layout and only the solid leaf brush
+// lists, so anything else options asks for is built for this process
+// alone, the same as MapCollisionBsp() would have.
+static void ApplyOptions(
+        CollisionBsp& bsp,
+        const std::string& bspFilePath,
+        const LoadOptions& options,
+        StageTimer& timer)
+{
+    if (options.nodeLayout != LoadOptions{}.nodeLayout)
+    {
+        BuildTraceNodes(bsp, options.threadPool, options.nodeLayout);
+        timer.Stage("Trace nodes");
+    }
+
+    for (auto mask : options.contentsMasks)
+    {
+        if (FindLeafBrushMask(bsp, mask) < 0)
+        {
+            BuildLeafBrushLists(bsp, options.contentsMasks, options.threadPool);
+            timer.Stage("Leaf brush lists");
+            break;
+        }
+    }
+
+    // After the leaf brush lists, as it's built from them.
+    if (options.traceBackend == TraceBackend::BrushBvh)
+    {
+        if (bsp.bvhNodes.empty())
+        {
+            BuildBrushBvh(bsp, options.threadPool);
+            timer.Stage("Brush BVH");
+        }
+    }
+    else
+    {
+        ClearBrushBvh(bsp);
+    }
+
+    SetExtraLumpFile(bsp, options.extraLumpMask, bspFilePath);
+}
+
+// Publishes sharedName if it's there but nobody is publishing it. Returns
+// false if someone is, or it's gone (so the caller creates it again).
+static bool TryReclaim(
+        const std::string& sharedName,
+        const std::string& bspFilePath,
+        const LoadOptions& options,
+        bool& failed)
+{
+    auto fileDescriptor = shm_open(sharedName.c_str(), O_RDWR, 0);
+
+    if (fileDescriptor < 0)
+    {
+        return false;
+    }
+
+    bool published = false;
+
+    if (flock(fileDescriptor, LOCK_EX | LOCK_NB) == 0)
+    {
+        published = Publish(fileDescriptor, bspFilePath, options);
+
+        if (!published)
+        {
+            UnlinkIfCurrent(fileDescriptor, sharedName);
+            failed = true;
+        }
+    }
+
+    // Closing it drops the lock.
+    close(fileDescriptor);
+
+    return published;
+}
+
+// Unlinks sharedName if it's still unusable or an image of an older
+// bspFilePath, so the next attach publishes it again. Processes already attached to the
+// old image keep their mapping.
+static void RetireStale(
+        const std::string& sharedName,
+        const std::string& bspFilePath)
+{
+    auto fileDescriptor = shm_open(sharedName.c_str(), O_RDONLY, 0);
+
+    if (fileDescriptor < 0)
+    {
+        return;
+    }
+
+    if (flock(fileDescriptor, LOCK_EX) == 0)
+    {
+        CollisionBsp current;
+        bool unusable = false;
+
+        // Someone else may have replaced it while we waited for the lock.
+        auto stale = TryAttach(sharedName, current, unusable) ?
+            !CookedSourceMatches(
+                *reinterpret_cast<const CookedHeader*>(
+                    current.storage.file.Data()),
+                bspFilePath) :
+            unusable;
+
+        if (stale)
+        {
+            UnlinkIfCurrent(fileDescriptor, sharedName);
+        }
+    }
+
+    close(fileDescriptor);
+}
+
+// /////////////////////
+// Sharing
+// /////////////////////
+bool AttachSharedCollisionBsp(
+        const std::string& sharedName,
+        const std::string& bspFilePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options)
+{
+    bsp = CollisionBsp{};
+
+    StageTimer timer(options.timings);
+
+    const auto giveUpTime =
+        std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(cSharedPublishTimeoutInMilliseconds);
+
+    bool retired = false;
+
+    for (;;)
+    {
+        // First one in publishes.
+        auto fileDescriptor =
+            shm_open(sharedName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+        if (fileDescriptor >= 0)
+        {
+            // Held until it's published, see IsPublished().
+            flock(fileDescriptor, LOCK_EX);
+
+            auto published = Publish(fileDescriptor, bspFilePath, options);
+
+            if (!published)
+            {
+                // Don't leave everyone else waiting for it.
+                UnlinkIfCurrent(fileDescriptor, sharedName);
+            }
+
+            close(fileDescriptor);
+
+            if (!published)
+            {
+                break;
+            }
+
+            timer.Stage("Publish shared");
+        }
+        else if (errno != EEXIST)
+        {
+            // No shared memory to be had.
+            break;
+        }
+
+        bool unusable = false;
+
+        if (TryAttach(sharedName, bsp, unusable))
+        {
+            timer.Stage("Attach shared");
+
+            if (CookedSourceMatches(
+                    *reinterpret_cast<const CookedHeader*>(
+                        bsp.storage.file.Data()),
+                    bspFilePath))
+            {
+                timer.Stage("Check source");
+
+                ApplyOptions(bsp, bspFilePath, options, timer);
+
+                return true;
+            }
+
+            // Out of date is as good as unusable.
+            bsp = CollisionBsp{};
+            unusable = true;
+        }
+
+        if (unusable)
+        {
+            // Replace it once. If what we publish is out of date too, the
+            // source is changing under us.
+            if (retired)
+            {
+                break;
+            }
+
+            RetireStale(sharedName, bspFilePath);
+            retired = true;
+
+            timer.Stage("Retire stale");
+            continue;
+        }
+
+        // Whoever created it may have died before publishing it.
+        bool failed = false;
+
+        if (TryReclaim(sharedName, bspFilePath, options, failed))
+        {
+            timer.Stage("Reclaim shared");
+            continue;
+        }
+
+        if  (
+                (failed) ||
+                (std::chrono::steady_clock::now() > giveUpTime)
+            )
+        {
+            break;
+        }
+
+        // Someone else is still publishing it.
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Load it ourselves then.
+    return MapCollisionBsp(bspFilePath, bsp, options);
+}
+
+bool UnlinkSharedCollisionBsp(const std::string& sharedName)
+{
+    return shm_unlink(sharedName.c_str()) == 0;
+}
+
+#endif
+
+} // namespace
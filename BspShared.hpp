@@ -0,0 +1,61 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "Bsp.hpp"
+
+#include <string>
+
+// Cross process map sharing. The map is published once as its cooked image
+// (see BspCooked.hpp) in a POSIX shared memory object. The image is offset
+// based, so every process maps the same pages read only and only the
+// CollisionBsp views are per process.
+
+namespace Bsp {
+
+/// How long to wait for another process to finish publishing a map
+/// before giving up and loading it privately.
+const unsigned cSharedPublishTimeoutInMilliseconds = 10000;
+
+/// Attaches to the map shared as sharedName (a shm_open() name such as
+/// "/messybsp-q3dm17"), loading and publishing bspFilePath first if no
+/// other process has.
+///
+/// The publisher holds a lock until it's done, so a publish abandoned by a
+/// process that died is picked up and finished, and an image that's out of
+/// date with bspFilePath is unlinked and published again.
+///
+/// All of options is honoured, the same as MapCollisionBsp(). The image is
+/// always published with the default options, so each process builds its
+/// own trace nodes for another nodeLayout, leaf brush lists for
+/// contentsMasks, and BVH for TraceBackend::BrushBvh after attaching.
+/// extraLumpMask lumps are read from bspFilePath when first asked for.
+///
+/// Falls back to MapCollisionBsp() if shared memory isn't supported, a live
+/// publisher never finishes, or the image is still out of date after it's
+/// been replaced.
+bool AttachSharedCollisionBsp(
+        const std::string& sharedName,
+        const std::string& bspFilePath,
+        CollisionBsp& bsp,
+        const LoadOptions& options = {});
+
+/// Removes sharedName so the next attach publishes it again. Processes
+/// already attached keep using their mapping until they let it go.
+bool UnlinkSharedCollisionBsp(const std::string& sharedName);
+
+} // namespace
@@ -0,0 +1,371 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "BspStats.hpp"
+
+#include <algorithm>
+
+namespace Bsp {
+
+// /////////////////////
+// Helpers
+// /////////////////////
+static unsigned BucketIndex(uint32_t value)
+{
+    unsigned index = 0;
+
+    while (value)
+    {
+        value >>= 1;
+        ++index;
+    }
+
+    return index;
+}
+
+static Histogram MakeHistogram(const std::vector<uint32_t>& values)
+{
+    Histogram histogram;
+
+    if (values.empty())
+    {
+        return histogram;
+    }
+
+    histogram.min = values[0];
+
+    uint64_t total = 0;
+
+    for (auto value : values)
+    {
+        histogram.min = std::min(histogram.min, value);
+        histogram.max = std::max(histogram.max, value);
+        total += value;
+
+        auto index = BucketIndex(value);
+
+        if (index >= histogram.buckets.size())
+        {
+            histogram.buckets.resize(index + 1, 0);
+        }
+
+        ++histogram.buckets[index];
+    }
+
+    histogram.mean = static_cast<double>(total) / values.size();
+
+    return histogram;
+}
+
+static void PrintHistogram(
+        FILE* file,
+        const char* name,
+        const Histogram& histogram)
+{
+    fprintf(
+        file,
+        "%s: min %u, max %u, mean %.2f\n",
+        name,
+        histogram.min,
+        histogram.max,
+        histogram.mean);
+
+    uint32_t biggest = 0;
+
+    for (auto count : histogram.buckets)
+    {
+        biggest = std::max(biggest, count);
+    }
+
+    for (unsigned i = 0; i < histogram.buckets.size(); ++i)
+    {
+        const auto low  = i ? (1u << (i - 1)) : 0u;
+        const auto high = i ? ((1u << i) - 1) : 0u;
+        const auto count = histogram.buckets[i];
+
+        // 40 characters for the biggest bucket.
+        const auto barLength = biggest ? (count * 40 + biggest - 1) / biggest : 0;
+
+        fprintf(
+            file,
+            "  %6u - %-6u %8u %.*s\n",
+            low,
+            high,
+            count,
+            static_cast<int>(barLength),
+            "########################################");
+    }
+}
+
+static double Percent(std::size_t part, std::size_t whole)
+{
+    return whole ? (100.0 * part) / whole : 0.0;
+}
+
+// /////////////////////
+// Stats
+// /////////////////////
+CollisionBspStats GetCollisionBspStats(const CollisionBsp& bsp)
+{
+    CollisionBspStats stats;
+
+    // In Lumps order.
+    static const struct
+    {
+        const char* name;
+        std::size_t typeSize;
+    }
+    lumpTypes[Lumps::Count] =
+    {
+        { "Entities",       sizeof(char)        },
+        { "Textures",       sizeof(Texture)     },
+        { "Planes",         sizeof(::Plane)     },
+        { "Nodes",          sizeof(Node)        },
+        { "Leaves",         sizeof(Leaf)        },
+        { "LeafFaces",      sizeof(LeafFace)    },
+        { "LeafBrushes",    sizeof(LeafBrush)   },
+        { "Models",         sizeof(Model)       },
+        { "Brushes",        sizeof(Brush)       },
+        { "BrushSides",     sizeof(BrushSide)   },
+        { "Vertexes",       sizeof(Vertex)      },
+        { "Meshverts",      sizeof(Meshvert)    },
+        { "Effects",        sizeof(Effect)      },
+        { "Faces",          sizeof(Face)        },
+        { "Lightmaps",      sizeof(Lightmap)    },
+        { "Lightvols",      sizeof(Lightvol)    },
+        { "Visdata",        sizeof(uint8_t)     },
+    };
+
+    if (const auto* extra = bsp.storage.extraLumps.get())
+    {
+        stats.extraLumpMask = extra->mask;
+    }
+
+    for (unsigned i = 0; i < Lumps::Count; ++i)
+    {
+        const auto byteCount = static_cast<std::size_t>(
+            std::max(bsp.header.lumps[i].byteCount, 0));
+
+        stats.lumps.push_back(
+        {
+            lumpTypes[i].name,
+            byteCount / lumpTypes[i].typeSize,
+            byteCount
+        });
+
+        if (stats.extraLumpMask & LumpBit(static_cast<Lumps>(i)))
+        {
+            stats.extraByteCount += byteCount;
+        }
+    }
+
+    auto addDerived = [&stats] (const char* name, const auto& span)
+    {
+        stats.derived.push_back({name, span.size(), span.size() * sizeof(span[0])});
+    };
+
+    addDerived("Brush AABBs",           bsp.brushAabbs);
+    addDerived("Plane types",           bsp.planeTypes);
+    addDerived("Brush plane ranges",    bsp.brushPlaneRanges);
+    addDerived("Brush plane floats",    bsp.brushPlaneData);
+    addDerived("Brush plane types",     bsp.brushPlaneTypes);
+    addDerived("Trace nodes",           bsp.traceNodes);
+    addDerived("Trace node sources",    bsp.traceNodeSources);
+    addDerived("Leaf brush masks",      bsp.leafBrushMasks);
+    addDerived("Leaf brush ranges",     bsp.leafBrushRanges);
+    addDerived("Leaf brush entries",    bsp.leafBrushEntries);
+    addDerived("BVH nodes",             bsp.bvhNodes);
+    addDerived("BVH brushes",           bsp.bvhBrushes);
+
+    stats.collisionByteCount = CollisionBspByteCount(bsp);
+
+    // Shape
+    std::vector<uint32_t> values;
+
+    for (const auto& brush : bsp.brushes)
+    {
+        values.push_back(static_cast<uint32_t>(std::max(brush.sideCount, 0)));
+
+        if  (
+                (brush.sideCount <= 0) ||
+                (!(bsp.textures[brush.textureIndex].contentFlags & cContentsSolid))
+            )
+        {
+            ++stats.nonSolidBrushCount;
+        }
+    }
+
+    stats.sidesPerBrush = MakeHistogram(values);
+
+    for (const auto& brushAabb : bsp.brushAabbs)
+    {
+        if (BrushIsDegenerate(brushAabb))
+        {
+            ++stats.degenerateBrushCount;
+        }
+    }
+
+    values.clear();
+
+    std::vector<uint32_t> leavesPerBrush(bsp.brushes.size(), 0);
+
+    for (const auto& leaf : bsp.leaves)
+    {
+        values.push_back(static_cast<uint32_t>(std::max(leaf.leafBrushCount, 0)));
+
+        for (int i = 0; i < leaf.leafBrushCount; ++i)
+        {
+            ++leavesPerBrush[bsp.leafBrushes[leaf.firstLeafBrushIndex + i].brushIndex];
+        }
+
+        stats.leafBrushCount += static_cast<std::size_t>(std::max(leaf.leafBrushCount, 0));
+    }
+
+    stats.brushesPerLeaf = MakeHistogram(values);
+    stats.leavesPerBrush = MakeHistogram(leavesPerBrush);
+
+    // The solid lists are the first ones.
+    std::size_t solidLeafBrushCount = 0;
+
+    for (std::size_t i = 0; i < bsp.leaves.size() && i < bsp.leafBrushRanges.size(); ++i)
+    {
+        solidLeafBrushCount += static_cast<std::size_t>(bsp.leafBrushRanges[i].count);
+    }
+
+    stats.skippedLeafBrushCount = stats.leafBrushCount - solidLeafBrushCount;
+
+    // Leaf depths. Bounded by the node count in case the tree isn't one.
+    if (!bsp.nodes.empty())
+    {
+        struct Visit
+        {
+            int32_t     index;
+            uint32_t    depth;
+        };
+
+        std::vector<Visit> stack = {{0, 0}};
+
+        uint64_t depthTotal = 0;
+        std::size_t leafCount = 0;
+        std::size_t visitsLeft = bsp.nodes.size() + bsp.leaves.size();
+
+        while (!stack.empty() && visitsLeft--)
+        {
+            const auto visit = stack.back();
+            stack.pop_back();
+
+            if (visit.index < 0)
+            {
+                stats.maxLeafDepth = std::max(stats.maxLeafDepth, visit.depth);
+                depthTotal += visit.depth;
+                ++leafCount;
+
+                continue;
+            }
+
+            for (auto child : bsp.nodes[visit.index].childIndex)
+            {
+                stack.push_back({child, visit.depth + 1});
+            }
+        }
+
+        stats.meanLeafDepth = leafCount
+            ? static_cast<double>(depthTotal) / leafCount
+            : 0.0;
+    }
+
+    return stats;
+}
+
+void PrintCollisionBspStats(const CollisionBspStats& stats, FILE* file)
+{
+    fprintf(file, "Lumps (in file):\n");
+
+    for (unsigned i = 0; i < stats.lumps.size(); ++i)
+    {
+        const auto& lump = stats.lumps[i];
+        const auto bit = LumpBit(static_cast<Lumps>(i));
+
+        const char* use =
+            (bit & cCollisionLumps) ? "collision" :
+            (bit & stats.extraLumpMask) ? "extra" :
+            "unused";
+
+        fprintf(
+            file,
+            "  %-24s %8zu %10zu bytes  %s\n",
+            lump.name,
+            lump.count,
+            lump.byteCount,
+            use);
+    }
+
+    fprintf(file, "\nDerived:\n");
+
+    for (const auto& part : stats.derived)
+    {
+        fprintf(
+            file,
+            "  %-24s %8zu %10zu bytes\n",
+            part.name,
+            part.count,
+            part.byteCount);
+    }
+
+    fprintf(file, "\nMemory:\n");
+    fprintf(file, "  %-33s %10zu bytes\n", "Collision (lumps + derived)", stats.collisionByteCount);
+    fprintf(file, "  %-33s %10zu bytes\n", "Extra lumps (when read)", stats.extraByteCount);
+
+    fprintf(file, "\n");
+    PrintHistogram(file, "Sides per brush", stats.sidesPerBrush);
+    fprintf(file, "\n");
+    PrintHistogram(file, "Brushes per leaf", stats.brushesPerLeaf);
+    fprintf(file, "\n");
+    PrintHistogram(file, "Leaves per brush", stats.leavesPerBrush);
+
+    const auto brushCount = stats.lumps[Brushes].count;
+
+    fprintf(file, "\nTrace:\n");
+
+    fprintf(
+        file,
+        "  Non solid brushes:      %zu of %zu (%.1f%%)\n",
+        stats.nonSolidBrushCount,
+        brushCount,
+        Percent(stats.nonSolidBrushCount, brushCount));
+
+    fprintf(
+        file,
+        "  Degenerate brushes:     %zu of %zu (%.1f%%), never hit\n",
+        stats.degenerateBrushCount,
+        brushCount,
+        Percent(stats.degenerateBrushCount, brushCount));
+
+    fprintf(
+        file,
+        "  Skipped leaf brushes:   %zu of %zu (%.1f%%), filtered at load\n",
+        stats.skippedLeafBrushCount,
+        stats.leafBrushCount,
+        Percent(stats.skippedLeafBrushCount, stats.leafBrushCount));
+
+    fprintf(
+        file,
+        "  Leaf depth:             max %u, mean %.2f\n",
+        stats.maxLeafDepth,
+        stats.meanLeafDepth);
+}
+
+} // namespace
@@ -0,0 +1,89 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "Bsp.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// What a loaded map costs in memory, and what shape it is. Mainly for
+// budgeting server memory per map, and spotting maps that will be slow to
+// trace before anyone has to play on them.
+
+namespace Bsp {
+
+/// Power of two buckets: bucket 0 counts 0, bucket 1 counts 1, bucket 2
+/// counts 2-3, bucket 3 counts 4-7, etc.
+struct Histogram
+{
+    uint32_t                min     = 0;
+    uint32_t                max     = 0;
+    double                  mean    = 0.0;
+    std::vector<uint32_t>   buckets;
+};
+
+struct CollisionBspStats
+{
+    struct Part
+    {
+        const char* name;
+        std::size_t count;
+        std::size_t byteCount;
+    };
+
+    /// Every lump in the file, as the header has them, in Lumps order.
+    std::vector<Part>   lumps;
+
+    /// The arrays BuildTraceData() makes.
+    std::vector<Part>   derived;
+
+    /// Same as CollisionBspByteCount().
+    std::size_t         collisionByteCount  = 0;
+
+    /// The extra lumps asked for when loading, and their size. They might
+    /// not have been read yet.
+    uint32_t            extraLumpMask       = 0;
+    std::size_t         extraByteCount      = 0;
+
+    Histogram           sidesPerBrush;
+    Histogram           brushesPerLeaf;
+    Histogram           leavesPerBrush;
+
+    /// Leaf brushes that aren't solid, have no sides, or are degenerate.
+    /// Trace() used to have to skip these in every leaf it visited, now
+    /// they're filtered out at load (see leafBrushEntries).
+    std::size_t         leafBrushCount          = 0;
+    std::size_t         skippedLeafBrushCount   = 0;
+
+    std::size_t         nonSolidBrushCount      = 0;
+
+    /// See BrushIsDegenerate().
+    std::size_t         degenerateBrushCount    = 0;
+
+    /// Deepest leaf, and the average over all leaves, counting nodes from
+    /// the root.
+    uint32_t            maxLeafDepth    = 0;
+    double              meanLeafDepth   = 0.0;
+};
+
+CollisionBspStats GetCollisionBspStats(const CollisionBsp& bsp);
+
+void PrintCollisionBspStats(const CollisionBspStats& stats, FILE* file = stdout);
+
+} // namespace
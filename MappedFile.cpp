@@ -0,0 +1,197 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <utility>
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+MappedFile::MappedFile(MappedFile&& other)
+{
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other)
+{
+    if (this != &other)
+    {
+        Close();
+
+        std::swap(m_data, other.m_data);
+        std::swap(m_byteCount, other.m_byteCount);
+
+#ifdef _WIN32
+        std::swap(m_file, other.m_file);
+        std::swap(m_mapping, other.m_mapping);
+#endif
+    }
+
+    return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::string& filePath)
+{
+    Close();
+
+    auto file = CreateFileA(
+                filePath.c_str(),
+                GENERIC_READ,
+                FILE_SHARE_READ,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || (size.QuadPart == 0))
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    auto mapping = CreateFileMappingA(
+                file,
+                nullptr,
+                PAGE_READONLY,
+                0,
+                0,
+                nullptr);
+
+    if (!mapping)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (!view)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    m_file      = file;
+    m_mapping   = mapping;
+    m_data      = static_cast<const uint8_t*>(view);
+    m_byteCount = static_cast<std::size_t>(size.QuadPart);
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_data)
+    {
+        UnmapViewOfFile(m_data);
+        CloseHandle(m_mapping);
+        CloseHandle(m_file);
+    }
+
+    m_data      = nullptr;
+    m_byteCount = 0;
+    m_file      = nullptr;
+    m_mapping   = nullptr;
+}
+
+#else
+
+bool MappedFile::Open(const std::string& filePath)
+{
+    Close();
+
+    return MapDescriptor(open(filePath.c_str(), O_RDONLY));
+}
+
+bool MappedFile::OpenSharedMemory(const std::string& sharedName)
+{
+    Close();
+
+    return MapDescriptor(shm_open(sharedName.c_str(), O_RDONLY, 0));
+}
+
+bool MappedFile::MapDescriptor(int fileDescriptor)
+{
+    if (fileDescriptor < 0)
+    {
+        return false;
+    }
+
+    struct stat status;
+    if ((fstat(fileDescriptor, &status) != 0) || (status.st_size <= 0))
+    {
+        close(fileDescriptor);
+        return false;
+    }
+
+    auto byteCount = static_cast<std::size_t>(status.st_size);
+
+    auto view = mmap(
+                nullptr,
+                byteCount,
+                PROT_READ,
+                MAP_SHARED,
+                fileDescriptor,
+                0);
+
+    // The mapping keeps its own reference to the file.
+    close(fileDescriptor);
+
+    if (view == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_data      = static_cast<const uint8_t*>(view);
+    m_byteCount = byteCount;
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_data)
+    {
+        munmap(const_cast<uint8_t*>(m_data), m_byteCount);
+    }
+
+    m_data      = nullptr;
+    m_byteCount = 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// Read only memory mapping of a whole file. The mapping lives until
+// Close() or the destructor, so anything pointing into Data() has to
+// go before then. Move only.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(MappedFile&& other);
+    MappedFile& operator=(MappedFile&& other);
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false if the file cannot be opened or mapped.
+    bool Open(const std::string& filePath);
+
+#ifndef _WIN32
+    // Same as Open(), but for a POSIX shared memory object (shm_open()).
+    bool OpenSharedMemory(const std::string& sharedName);
+#endif
+
+    void Close();
+
+    const uint8_t*  Data()      const { return m_data; }
+    std::size_t     ByteCount() const { return m_byteCount; }
+    bool            IsOpen()    const { return m_data != nullptr; }
+
+private:
+#ifndef _WIN32
+    bool MapDescriptor(int fileDescriptor);
+#endif
+
+    const uint8_t*  m_data      = nullptr;
+    std::size_t     m_byteCount = 0;
+
+#ifdef _WIN32
+    void*           m_file      = nullptr;
+    void*           m_mapping   = nullptr;
+#endif
+};
@@ -0,0 +1,64 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Poor man's std::span (which is C++20, and I'm sticking to C++14).
+// Doesn't own anything, so whatever it points to has to outlive it.
+template<typename T>
+struct Span
+{
+    T*          first = nullptr;
+    std::size_t count = 0;
+
+    constexpr Span() = default;
+
+    constexpr Span(T* data, std::size_t size)
+        : first(data)
+        , count(size)
+    {
+    }
+
+    // Allows Span<const T> from a std::vector<T>.
+    template<typename U>
+    Span(std::vector<U>& vector)
+        : first(vector.data())
+        , count(vector.size())
+    {
+    }
+
+    template<typename U>
+    Span(const std::vector<U>& vector)
+        : first(vector.data())
+        , count(vector.size())
+    {
+    }
+
+    constexpr T*          data()  const { return first; }
+    constexpr std::size_t size()  const { return count; }
+    constexpr bool        empty() const { return count == 0; }
+
+    constexpr T* begin() const { return first; }
+    constexpr T* end()   const { return first + count; }
+
+    constexpr T& operator[](std::size_t index) const
+    {
+        return first[index];
+    }
+};
@@ -0,0 +1,223 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(unsigned threadCount)
+{
+    if (!threadCount)
+    {
+        threadCount = std::thread::hardware_concurrency();
+    }
+
+    std::vector<WorkRange>(threadCount).swap(m_ranges);
+
+    for (unsigned i = 1; i < threadCount; ++i)
+    {
+        m_workers.emplace_back([this, i] { WorkerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+
+    m_wake.notify_all();
+
+    for (auto& worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+unsigned ThreadPool::ThreadCount() const
+{
+    return static_cast<unsigned>(m_workers.size()) + 1;
+}
+
+void ThreadPool::ParallelFor(
+        std::size_t count,
+        std::size_t chunkSize,
+        const Task& task)
+{
+    if (!count)
+    {
+        return;
+    }
+
+    chunkSize = chunkSize ? chunkSize : 1;
+
+    // Not worth waking anyone up.
+    if (m_workers.empty() || (count <= chunkSize))
+    {
+        task(0, count);
+        return;
+    }
+
+    std::lock_guard<std::mutex> job(m_jobMutex);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_task      = &task;
+        m_count     = count;
+        m_chunkSize = chunkSize;
+        m_pending   = static_cast<unsigned>(m_workers.size());
+
+        // Everyone gets an even share to start with.
+        const uint64_t chunkCount   = (count + chunkSize - 1) / chunkSize;
+        const uint64_t threadCount  = m_ranges.size();
+
+        for (uint64_t i = 0; i < threadCount; ++i)
+        {
+            const auto first    = (chunkCount * i) / threadCount;
+            const auto last     = (chunkCount * (i + 1)) / threadCount;
+
+            m_ranges[i].chunks.store((first << 32) | last, std::memory_order_relaxed);
+        }
+
+        ++m_generation;
+    }
+
+    m_wake.notify_all();
+
+    RunChunks(0);
+
+    // Every worker has to check in, even if there was nothing left for it,
+    // so that none of them sees this job's task after we return.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_pending == 0; });
+
+    m_task = nullptr;
+}
+
+void ThreadPool::RunChunks(unsigned thread)
+{
+    for (;;)
+    {
+        uint64_t chunk;
+
+        if (!TakeChunk(thread, chunk) && !StealChunk(thread, chunk))
+        {
+            return;
+        }
+
+        auto first  = chunk * m_chunkSize;
+        auto last   = first + m_chunkSize;
+
+        (*m_task)(first, last < m_count ? last : m_count);
+    }
+}
+
+bool ThreadPool::TakeChunk(unsigned thread, uint64_t& chunk)
+{
+    auto& chunks = m_ranges[thread].chunks;
+    auto range = chunks.load(std::memory_order_acquire);
+
+    for (;;)
+    {
+        const auto first    = range >> 32;
+        const auto last     = range & 0xffffffff;
+
+        if (first >= last)
+        {
+            return false;
+        }
+
+        // Only fails if someone's just stolen from us.
+        if (chunks.compare_exchange_weak(range, ((first + 1) << 32) | last))
+        {
+            chunk = first;
+            return true;
+        }
+    }
+}
+
+bool ThreadPool::StealChunk(unsigned thread, uint64_t& chunk)
+{
+    const auto threadCount = static_cast<unsigned>(m_ranges.size());
+
+    for (unsigned i = 1; i < threadCount; ++i)
+    {
+        auto& chunks = m_ranges[(thread + i) % threadCount].chunks;
+        auto range = chunks.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            const auto first    = range >> 32;
+            const auto last     = range & 0xffffffff;
+
+            if (first >= last)
+            {
+                break;
+            }
+
+            // Leave them the front half, as they're working from the front.
+            const auto middle = first + (last - first) / 2;
+
+            if (chunks.compare_exchange_weak(range, (first << 32) | middle))
+            {
+                // Nobody steals from an empty share, so this is still ours.
+                m_ranges[thread].chunks.store(
+                            ((middle + 1) << 32) | last,
+                            std::memory_order_release);
+
+                chunk = middle;
+                return true;
+            }
+        }
+    }
+
+    // Everyone's out. Some might still be running their last chunk, but
+    // there's nothing left to start.
+    return false;
+}
+
+void ThreadPool::WorkerLoop(unsigned thread)
+{
+    uint64_t seenGeneration = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            m_wake.wait(lock, [&]
+            {
+                return m_quit || (m_generation != seenGeneration);
+            });
+
+            if (m_quit)
+            {
+                return;
+            }
+
+            seenGeneration = m_generation;
+        }
+
+        RunChunks(thread);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_pending;
+        }
+
+        m_done.notify_one();
+    }
+}
@@ -0,0 +1,107 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for splitting up big loops. The thread that
+// calls ParallelFor() works too, so a pool of 1 thread has no workers and
+// just runs everything inline.
+//
+// Each thread starts with an even share of the chunks, and takes them off
+// the front of its own share. One that runs out steals the back half of
+// someone else's, so threads only touch each other's state when the work
+// is uneven, not for every chunk.
+class ThreadPool
+{
+public:
+    // first and last are a half open range: [first, last).
+    using Task = std::function<void(std::size_t first, std::size_t last)>;
+
+    // 0 == one thread per hardware thread.
+    explicit ThreadPool(unsigned threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Including the calling thread.
+    unsigned ThreadCount() const;
+
+    // Calls task over [0, count) in chunks of at most chunkSize and waits
+    // for them all to finish. Which thread runs which chunk isn't fixed, so
+    // tasks should only write to their own range for repeatable results.
+    // Don't call from inside a task.
+    void ParallelFor(std::size_t count, std::size_t chunkSize, const Task& task);
+
+private:
+    // A thread's share of the chunks, [first, last) as first << 32 | last.
+    // Padded out so the threads' shares aren't on the same cache line.
+    struct WorkRange
+    {
+        std::atomic<uint64_t>   chunks{0};
+        char                    padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    void WorkerLoop(unsigned thread);
+    void RunChunks(unsigned thread);
+    bool TakeChunk(unsigned thread, uint64_t& chunk);
+    bool StealChunk(unsigned thread, uint64_t& chunk);
+
+    std::vector<std::thread>    m_workers;
+
+    // Only one ParallelFor() at a time.
+    std::mutex                  m_jobMutex;
+
+    std::mutex                  m_mutex;
+    std::condition_variable     m_wake;
+    std::condition_variable     m_done;
+    uint64_t                    m_generation    = 0;
+    unsigned                    m_pending       = 0;
+    bool                        m_quit          = false;
+
+    const Task*                 m_task          = nullptr;
+    std::size_t                 m_count         = 0;
+    std::size_t                 m_chunkSize     = 1;
+
+    // One per thread, the calling thread's first.
+    std::vector<WorkRange>      m_ranges;
+};
+
+// Runs task over [0, count) on pool, or inline if there isn't one.
+inline void ParallelFor(
+        ThreadPool* pool,
+        std::size_t count,
+        std::size_t chunkSize,
+        const ThreadPool::Task& task)
+{
+    if (pool)
+    {
+        pool->ParallelFor(count, chunkSize, task);
+    }
+    else if (count)
+    {
+        task(0, count);
+    }
+}
@@ -27,9 +27,26 @@
 #include "Bsp.hpp"
 #include "rAssert.hpp"
 #include "VectorMaths3.hpp"
+#include "ThreadPool.hpp"
 
 // for std::abs(float)
 #include <cmath>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC 12's AVX-512 intrinsics warn about their own _mm512_undefined_*()
+// placeholders when inlined, which -Werror turns into a failed build.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#else
+#include <immintrin.h>
+#endif
+#endif
 
 
 // /////////////////////
@@ -41,14 +58,91 @@
 // and to avoid various numeric issues
 static const float EPSILON = 0.125f;
 
+// Added to how far the trace can reach past a BVH node's AABB, for
+// rounding. See CheckBvh().
+static const float cBvhSlack = 1.0f;
+
 // /////////////////////
 // Structs
 // /////////////////////
+
+// A stamp per brush, so a brush that's in more than one leaf along the
+// trace is only tested once (Q3's checkcount). One per thread, so traces
+// on different threads don't get in each other's way. A packet of rays
+// shares a stamp, so the bottom 16 bits have a bit per ray for the ones
+// that have tested the brush, and the stamp is in the top 16.
+struct TraceMailbox
+{
+    std::vector<uint32_t>   stamps;
+    uint32_t                stamp = 0;
+    TraceCounters           counters;
+
+    // TraceBatch()'s sort keys, kept so it doesn't allocate every batch.
+    std::vector<uint64_t>   batchOrder;
+    std::vector<uint64_t>   batchSorted;
+    std::vector<Bounds>     batchBounds;
+    std::vector<TraceResult> batchResults;
+};
+
+static thread_local TraceMailbox t_mailbox;
+
+// Which parts of Bounds a trace uses. Trace() works it out once, then the
+// kernels are compiled per shape so a ray doesn't pay for the sphere
+// radius or the box corners at every node and brush side. Scalar traces
+// test brush planes one at a time even when the build has SIMD versions,
+// for TraceScalar().
+template<bool HasRadius, bool HasBox, bool Scalar = false>
+struct Shape
+{
+    static const bool cHasRadius    = HasRadius;
+    static const bool cHasBox       = HasBox;
+    static const bool cScalar       = Scalar;
+};
+
+using RayShape          = Shape<false, false>;
+using SphereShape       = Shape<true, false>;
+using BoxShape          = Shape<false, true>;
+
+// Bounds allows both, so Trace() still has to handle it.
+using RoundedBoxShape   = Shape<true, true>;
+
+enum class ShapeType : uint32_t
+{
+    Ray,
+    Sphere,
+    Box,
+    RoundedBox
+};
+
 struct TraceBounds
 {
     Bounds  bounds;
     Vec3    aabbMin;
     Vec3    aabbMax;
+
+    // The box corner nearest to a plane, indexed by the plane's sign bits.
+    Vec3    corners[8];
+
+    // The leaf brush lists for contentsMask, one range per leaf. nullptr
+    // if the bsp doesn't have any, in which case the leaves are filtered
+    // as they're visited.
+    const Bsp::LeafBrushRange*  leafBrushRanges;
+    int32_t                     contentsMask;
+
+    TraceMailbox*               mailbox;
+
+    // This trace's bit in the mailbox, 1 unless it's part of a packet.
+    uint32_t                    laneBit;
+};
+
+// Where CheckNodes() is up to: a piece of the trace, and the node it's in.
+struct TraceStackEntry
+{
+    Vec3    start;
+    Vec3    end;
+    int32_t nodeIndex;
+    float   startFraction;
+    float   endFraction;
 };
 
 // /////////////////////
@@ -75,20 +169,530 @@ bool inline AabbDontIntersect(
 
 }
 
+inline unsigned LowestLane(uint32_t lanes)
+{
+#if defined(_MSC_VER)
+    unsigned long lane;
+    _BitScanForward(&lane, lanes);
+    return lane;
+#else
+    return __builtin_ctz(lanes);
+#endif
+}
+
+inline unsigned LaneCount(uint32_t lanes)
+{
+#if defined(_MSC_VER)
+    return __popcnt(lanes);
+#else
+    return __builtin_popcount(lanes);
+#endif
+}
+
+inline bool IsZero(const Vec3& v)
+{
+    return (v.data[0] == 0.0f) && (v.data[1] == 0.0f) && (v.data[2] == 0.0f);
+}
+
+inline ShapeType GetShapeType(const Bounds& bounds)
+{
+    const bool hasRadius    = bounds.sphereRadius != 0.0f;
+    const bool hasBox       = !IsZero(bounds.boxMin) || !IsZero(bounds.boxMax);
+
+    if (hasBox)
+    {
+        return hasRadius ? ShapeType::RoundedBox : ShapeType::Box;
+    }
+
+    return hasRadius ? ShapeType::Sphere : ShapeType::Ray;
+}
+
+// Spreads the bottom 10 bits out to every third bit, for Morton codes.
+inline uint32_t SpreadBits(uint32_t value)
+{
+    value &= 0x3ff;
+    value = (value | (value << 16)) & 0x030000ff;
+    value = (value | (value << 8))  & 0x0300f00f;
+    value = (value | (value << 4))  & 0x030c30c3;
+    value = (value | (value << 2))  & 0x09249249;
+
+    return value;
+}
+
+// False if the brush has already been tested this trace.
+bool inline FirstTest(TraceMailbox& mailbox, int32_t brushIndex, uint32_t laneBit)
+{
+    auto& stamp = mailbox.stamps[brushIndex];
+
+    if ((stamp >> 16) != mailbox.stamp)
+    {
+        stamp = mailbox.stamp << 16;
+    }
+
+    if (stamp & laneBit)
+    {
+        ++mailbox.counters.repeatBrushCount;
+        return false;
+    }
+
+    stamp |= laneBit;
+    ++mailbox.counters.brushTestCount;
+
+    return true;
+}
+
+// New stamp for a trace or packet. Start again from a clean slate every
+// 64k, or the stamps would match ones from 64k traces ago.
+void inline NewStamp(TraceMailbox& mailbox, const Bsp::CollisionBsp& bsp)
+{
+    if (mailbox.stamps.size() < bsp.brushes.size())
+    {
+        mailbox.stamps.resize(bsp.brushes.size(), mailbox.stamp << 16);
+    }
+
+    if (++mailbox.stamp == 0x10000)
+    {
+        std::fill(mailbox.stamps.begin(), mailbox.stamps.end(), 0);
+        mailbox.stamp = 1;
+    }
+}
+
 // /////////////////////
 // Trace Functions
 // /////////////////////
-TraceResult CheckBrush(
+// What the planes of a brush make of the trace, for CheckBrush().
+struct BrushPlaneHits
+{
+    float   startFraction   = -1.0f;
+    float   endFraction     = 1.0f;
+    int     collisionSide   = -1;
+    bool    startsOut       = false;
+    bool    endsOut         = false;
+};
+
+// DotF(), but always rounded the way GCC fuses it when it has FMA. The
+// SIMD versions of CheckBrushPlanes() do the same, so the scalar loop
+// gets the same distances whatever the compiler makes of DotF().
+inline float BrushDotF(const Vec3& lhs, const Vec3& rhs)
+{
+#if defined(__FMA__)
+    return std::fma(
+                lhs.data[2],
+                rhs.data[2],
+                std::fma(lhs.data[0], rhs.data[0], lhs.data[1] * rhs.data[1]));
+#else
+    return DotF(lhs, rhs);
+#endif
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+inline float HorizontalMax(__m256 v)
+{
+    v = _mm256_max_ps(v, _mm256_permute2f128_ps(v, v, 1));
+    v = _mm256_max_ps(v, _mm256_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm256_max_ps(v, _mm256_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm256_cvtss_f32(v);
+}
+
+inline float HorizontalMin(__m256 v)
+{
+    v = _mm256_min_ps(v, _mm256_permute2f128_ps(v, v, 1));
+    v = _mm256_min_ps(v, _mm256_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm256_min_ps(v, _mm256_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm256_cvtss_f32(v);
+}
+
+inline int32_t HorizontalMin(__m256i v)
+{
+    v = _mm256_min_epi32(v, _mm256_permute2x128_si256(v, v, 1));
+    v = _mm256_min_epi32(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm256_min_epi32(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm256_cvtsi256_si32(v);
+}
+
+#endif
+
+#if defined(__AVX512F__)
+
+// Folds the top half onto the bottom, so the rest can be done as __m256.
+inline __m256 HorizontalMax(__m512 v)
+{
+    v = _mm512_max_ps(v, _mm512_shuffle_f32x4(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    return _mm512_castps512_ps256(v);
+}
+
+inline __m256 HorizontalMin(__m512 v)
+{
+    v = _mm512_min_ps(v, _mm512_shuffle_f32x4(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    return _mm512_castps512_ps256(v);
+}
+
+inline __m256i HorizontalMin(__m512i v)
+{
+    v = _mm512_min_epi32(v, _mm512_shuffle_i32x4(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    return _mm512_castsi512_si256(v);
+}
+
+// Sixteen planes at a time, one per lane, doing the same maths per plane
+// as the scalar loop at the bottom but without its branches. stride is
+// only a multiple of 8, so the last step can be half empty. The padding
+// planes (see CopyBrushPlanes()) have everything behind them, so they
+// never count, the same as the masked off lanes.
+template<typename S>
+bool CheckBrushPlanesSimd(
         const Bsp::CollisionBsp& bsp,
-        const Bsp::Brush& brush,
-        const Bounds& bounds,
-        const TraceResult& currentResult)
+        int32_t brushIndex,
+        const TraceBounds& boundsAabb,
+        BrushPlaneHits& hits)
+{
+    const auto& planes  = bsp.brushPlaneRanges[brushIndex];
+    const float* x      = &bsp.brushPlaneData[planes.first];
+    const float* y      = x + planes.stride;
+    const float* z      = y + planes.stride;
+    const float* d      = z + planes.stride;
+
+    const auto& bounds  = boundsAabb.bounds;
+
+    const __m512 startX     = _mm512_set1_ps(bounds.start.data[0]);
+    const __m512 startY     = _mm512_set1_ps(bounds.start.data[1]);
+    const __m512 startZ     = _mm512_set1_ps(bounds.start.data[2]);
+    const __m512 endX       = _mm512_set1_ps(bounds.end.data[0]);
+    const __m512 endY       = _mm512_set1_ps(bounds.end.data[1]);
+    const __m512 endZ       = _mm512_set1_ps(bounds.end.data[2]);
+    const __m512 boxMinX    = _mm512_set1_ps(bounds.boxMin.data[0]);
+    const __m512 boxMinY    = _mm512_set1_ps(bounds.boxMin.data[1]);
+    const __m512 boxMinZ    = _mm512_set1_ps(bounds.boxMin.data[2]);
+    const __m512 boxMaxX    = _mm512_set1_ps(bounds.boxMax.data[0]);
+    const __m512 boxMaxY    = _mm512_set1_ps(bounds.boxMax.data[1]);
+    const __m512 boxMaxZ    = _mm512_set1_ps(bounds.boxMax.data[2]);
+    const __m512 radius     = _mm512_set1_ps(bounds.sphereRadius);
+    const __m512 epsilon    = _mm512_set1_ps(EPSILON);
+    const __m512 zero       = _mm512_setzero_ps();
+
+    const __m512i laneSides =
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    // Best per lane, the lanes are only compared at the end.
+    __m512  startFraction   = _mm512_set1_ps(-1.0f);
+    __m512  endFraction     = _mm512_set1_ps(1.0f);
+    __m512i collisionSide   = _mm512_set1_epi32(-1);
+
+    __mmask16 startsOut = 0;
+    __mmask16 endsOut   = 0;
+
+    for (int32_t i = 0; i < planes.stride; i += 16)
+    {
+        const __mmask16 lanes = (planes.stride - i >= 16) ? 0xffff : 0x00ff;
+
+        const __m512 normalX    = _mm512_maskz_loadu_ps(lanes, x + i);
+        const __m512 normalY    = _mm512_maskz_loadu_ps(lanes, y + i);
+        const __m512 normalZ    = _mm512_maskz_loadu_ps(lanes, z + i);
+        const __m512 distance   = _mm512_maskz_loadu_ps(lanes, d + i);
+
+        const __m512 planeDistance =
+            S::cHasRadius ? _mm512_add_ps(radius, distance) : distance;
+
+        __m512 sX = startX;
+        __m512 sY = startY;
+        __m512 sZ = startZ;
+        __m512 eX = endX;
+        __m512 eY = endY;
+        __m512 eZ = endZ;
+
+        if (S::cHasBox)
+        {
+            // The corner TraceBounds::corners would pick for each plane.
+            const __m512 offsetX = _mm512_mask_blend_ps(
+                        _mm512_cmp_ps_mask(normalX, zero, _CMP_LT_OQ), boxMinX, boxMaxX);
+            const __m512 offsetY = _mm512_mask_blend_ps(
+                        _mm512_cmp_ps_mask(normalY, zero, _CMP_LT_OQ), boxMinY, boxMaxY);
+            const __m512 offsetZ = _mm512_mask_blend_ps(
+                        _mm512_cmp_ps_mask(normalZ, zero, _CMP_LT_OQ), boxMinZ, boxMaxZ);
+
+            sX = _mm512_add_ps(sX, offsetX);
+            sY = _mm512_add_ps(sY, offsetY);
+            sZ = _mm512_add_ps(sZ, offsetZ);
+            eX = _mm512_add_ps(eX, offsetX);
+            eY = _mm512_add_ps(eY, offsetY);
+            eZ = _mm512_add_ps(eZ, offsetZ);
+        }
+
+        // Same order as BrushDotF(), so the distances come out the same
+        // as the scalar loop's.
+        const __m512 startDistance = _mm512_sub_ps(
+                    _mm512_fmadd_ps(sZ, normalZ,
+                        _mm512_fmadd_ps(sX, normalX,
+                            _mm512_mul_ps(sY, normalY))),
+                    planeDistance);
+
+        const __m512 endDistance = _mm512_sub_ps(
+                    _mm512_fmadd_ps(eZ, normalZ,
+                        _mm512_fmadd_ps(eX, normalX,
+                            _mm512_mul_ps(eY, normalY))),
+                    planeDistance);
+
+        const __mmask16 startOut =
+            _mm512_mask_cmp_ps_mask(lanes, startDistance, zero, _CMP_GT_OQ);
+        const __mmask16 endOut =
+            _mm512_mask_cmp_ps_mask(lanes, endDistance, zero, _CMP_GT_OQ);
+
+        if (startOut & endOut)
+        {
+            // both are in front of a plane, its outside of this brush.
+            return false;
+        }
+
+        startsOut   |= startOut;
+        endsOut     |= endOut;
+
+        // The rest are behind their planes, and get clipped by others.
+        const __mmask16 crosses = startOut | endOut;
+
+        if (!crosses)
+        {
+            continue;
+        }
+
+        const __mmask16 entering =
+            _mm512_mask_cmp_ps_mask(crosses, startDistance, endDistance, _CMP_GT_OQ);
+        const __mmask16 leaving = crosses & ~entering;
+
+        const __m512 length = _mm512_sub_ps(startDistance, endDistance);
+
+        const __m512 enterFraction =
+            _mm512_div_ps(_mm512_sub_ps(startDistance, epsilon), length);
+        const __m512 leaveFraction =
+            _mm512_div_ps(_mm512_add_ps(startDistance, epsilon), length);
+
+        const __mmask16 later =
+            _mm512_mask_cmp_ps_mask(entering, enterFraction, startFraction, _CMP_GT_OQ);
+        const __mmask16 sooner =
+            _mm512_mask_cmp_ps_mask(leaving, leaveFraction, endFraction, _CMP_LT_OQ);
+
+        startFraction   = _mm512_mask_blend_ps(later, startFraction, enterFraction);
+        endFraction     = _mm512_mask_blend_ps(sooner, endFraction, leaveFraction);
+        collisionSide   = _mm512_mask_blend_epi32(
+                    later,
+                    collisionSide,
+                    _mm512_add_epi32(_mm512_set1_epi32(i), laneSides));
+    }
+
+    hits.startsOut  = startsOut != 0;
+    hits.endsOut    = endsOut != 0;
+
+    // The scalar loop keeps the first side on a tie, so the lowest.
+    hits.startFraction  = HorizontalMax(HorizontalMax(startFraction));
+    hits.endFraction    = HorizontalMin(HorizontalMin(endFraction));
+
+    const __mmask16 furthest = _mm512_cmp_ps_mask(
+                startFraction,
+                _mm512_set1_ps(hits.startFraction),
+                _CMP_EQ_OQ);
+
+    hits.collisionSide = HorizontalMin(HorizontalMin(_mm512_mask_blend_epi32(
+                furthest,
+                _mm512_set1_epi32(INT32_MAX),
+                collisionSide)));
+
+    return true;
+}
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+// Eight planes at a time, one per lane, doing the same maths per plane
+// as the scalar loop at the bottom but without its branches. stride is
+// a multiple of 8, and the padding planes (see CopyBrushPlanes()) have
+// everything behind them, so they never count.
+template<typename S>
+bool CheckBrushPlanesSimd(
+        const Bsp::CollisionBsp& bsp,
+        int32_t brushIndex,
+        const TraceBounds& boundsAabb,
+        BrushPlaneHits& hits)
+{
+    const auto& planes  = bsp.brushPlaneRanges[brushIndex];
+    const float* x      = &bsp.brushPlaneData[planes.first];
+    const float* y      = x + planes.stride;
+    const float* z      = y + planes.stride;
+    const float* d      = z + planes.stride;
+
+    const auto& bounds  = boundsAabb.bounds;
+
+    const __m256 startX     = _mm256_set1_ps(bounds.start.data[0]);
+    const __m256 startY     = _mm256_set1_ps(bounds.start.data[1]);
+    const __m256 startZ     = _mm256_set1_ps(bounds.start.data[2]);
+    const __m256 endX       = _mm256_set1_ps(bounds.end.data[0]);
+    const __m256 endY       = _mm256_set1_ps(bounds.end.data[1]);
+    const __m256 endZ       = _mm256_set1_ps(bounds.end.data[2]);
+    const __m256 boxMinX    = _mm256_set1_ps(bounds.boxMin.data[0]);
+    const __m256 boxMinY    = _mm256_set1_ps(bounds.boxMin.data[1]);
+    const __m256 boxMinZ    = _mm256_set1_ps(bounds.boxMin.data[2]);
+    const __m256 boxMaxX    = _mm256_set1_ps(bounds.boxMax.data[0]);
+    const __m256 boxMaxY    = _mm256_set1_ps(bounds.boxMax.data[1]);
+    const __m256 boxMaxZ    = _mm256_set1_ps(bounds.boxMax.data[2]);
+    const __m256 radius     = _mm256_set1_ps(bounds.sphereRadius);
+    const __m256 epsilon    = _mm256_set1_ps(EPSILON);
+    const __m256 zero       = _mm256_setzero_ps();
+
+    const __m256i laneSides = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    // Best per lane, the lanes are only compared at the end.
+    __m256  startFraction   = _mm256_set1_ps(-1.0f);
+    __m256  endFraction     = _mm256_set1_ps(1.0f);
+    __m256i collisionSide   = _mm256_set1_epi32(-1);
+
+    int startsOut   = 0;
+    int endsOut     = 0;
+
+    for (int32_t i = 0; i < planes.stride; i += 8)
+    {
+        const __m256 normalX    = _mm256_loadu_ps(x + i);
+        const __m256 normalY    = _mm256_loadu_ps(y + i);
+        const __m256 normalZ    = _mm256_loadu_ps(z + i);
+        const __m256 distance   = _mm256_loadu_ps(d + i);
+
+        const __m256 planeDistance =
+            S::cHasRadius ? _mm256_add_ps(radius, distance) : distance;
+
+        __m256 sX = startX;
+        __m256 sY = startY;
+        __m256 sZ = startZ;
+        __m256 eX = endX;
+        __m256 eY = endY;
+        __m256 eZ = endZ;
+
+        if (S::cHasBox)
+        {
+            // The corner TraceBounds::corners would pick for each plane.
+            const __m256 offsetX = _mm256_blendv_ps(
+                        boxMinX, boxMaxX, _mm256_cmp_ps(normalX, zero, _CMP_LT_OQ));
+            const __m256 offsetY = _mm256_blendv_ps(
+                        boxMinY, boxMaxY, _mm256_cmp_ps(normalY, zero, _CMP_LT_OQ));
+            const __m256 offsetZ = _mm256_blendv_ps(
+                        boxMinZ, boxMaxZ, _mm256_cmp_ps(normalZ, zero, _CMP_LT_OQ));
+
+            sX = _mm256_add_ps(sX, offsetX);
+            sY = _mm256_add_ps(sY, offsetY);
+            sZ = _mm256_add_ps(sZ, offsetZ);
+            eX = _mm256_add_ps(eX, offsetX);
+            eY = _mm256_add_ps(eY, offsetY);
+            eZ = _mm256_add_ps(eZ, offsetZ);
+        }
+
+        // Same order as BrushDotF(), so the distances come out the same
+        // as the scalar loop's.
+        const __m256 startDistance = _mm256_sub_ps(
+                    _mm256_fmadd_ps(sZ, normalZ,
+                        _mm256_fmadd_ps(sX, normalX,
+                            _mm256_mul_ps(sY, normalY))),
+                    planeDistance);
+
+        const __m256 endDistance = _mm256_sub_ps(
+                    _mm256_fmadd_ps(eZ, normalZ,
+                        _mm256_fmadd_ps(eX, normalX,
+                            _mm256_mul_ps(eY, normalY))),
+                    planeDistance);
+
+        const __m256 startOut   = _mm256_cmp_ps(startDistance, zero, _CMP_GT_OQ);
+        const __m256 endOut     = _mm256_cmp_ps(endDistance, zero, _CMP_GT_OQ);
+
+        const int startOutBits  = _mm256_movemask_ps(startOut);
+        const int endOutBits    = _mm256_movemask_ps(endOut);
+
+        if (startOutBits & endOutBits)
+        {
+            // both are in front of a plane, its outside of this brush.
+            return false;
+        }
+
+        startsOut   |= startOutBits;
+        endsOut     |= endOutBits;
+
+        // The rest are behind their planes, and get clipped by others.
+        if (!(startOutBits | endOutBits))
+        {
+            continue;
+        }
+
+        const __m256 crosses = _mm256_or_ps(startOut, endOut);
+
+        const __m256 entering = _mm256_and_ps(
+                    crosses,
+                    _mm256_cmp_ps(startDistance, endDistance, _CMP_GT_OQ));
+        const __m256 leaving = _mm256_andnot_ps(entering, crosses);
+
+        const __m256 length = _mm256_sub_ps(startDistance, endDistance);
+
+        const __m256 enterFraction =
+            _mm256_div_ps(_mm256_sub_ps(startDistance, epsilon), length);
+        const __m256 leaveFraction =
+            _mm256_div_ps(_mm256_add_ps(startDistance, epsilon), length);
+
+        const __m256 later = _mm256_and_ps(
+                    entering,
+                    _mm256_cmp_ps(enterFraction, startFraction, _CMP_GT_OQ));
+        const __m256 sooner = _mm256_and_ps(
+                    leaving,
+                    _mm256_cmp_ps(leaveFraction, endFraction, _CMP_LT_OQ));
+
+        startFraction   = _mm256_blendv_ps(startFraction, enterFraction, later);
+        endFraction     = _mm256_blendv_ps(endFraction, leaveFraction, sooner);
+        collisionSide   = _mm256_castps_si256(_mm256_blendv_ps(
+                    _mm256_castsi256_ps(collisionSide),
+                    _mm256_castsi256_ps(
+                        _mm256_add_epi32(_mm256_set1_epi32(i), laneSides)),
+                    later));
+    }
+
+    hits.startsOut  = startsOut != 0;
+    hits.endsOut    = endsOut != 0;
+
+    // The scalar loop keeps the first side on a tie, so the lowest.
+    hits.startFraction  = HorizontalMax(startFraction);
+    hits.endFraction    = HorizontalMin(endFraction);
+
+    const __m256 furthest = _mm256_cmp_ps(
+                startFraction,
+                _mm256_set1_ps(hits.startFraction),
+                _CMP_EQ_OQ);
+
+    hits.collisionSide = HorizontalMin(_mm256_castps_si256(_mm256_blendv_ps(
+                _mm256_castsi256_ps(_mm256_set1_epi32(INT32_MAX)),
+                _mm256_castsi256_ps(collisionSide),
+                furthest)));
+
+    return true;
+}
+
+#endif
+
+// One plane at a time. The versions above have to match it, which
+// TraceScalar() is there to check.
+template<typename S>
+bool CheckBrushPlanesScalar(
+        const Bsp::CollisionBsp& bsp,
+        int32_t brushIndex,
+        const TraceBounds& boundsAabb,
+        BrushPlaneHits& hits)
 {
-    float startFraction         = -1.0f;
-    float endFraction           = 1.0f;
-    bool startsOut              = false;
-    bool endsOut                = false;
-    const Plane* collisionPlane = nullptr;
+    const auto& brush = bsp.brushes[brushIndex];
+
+    // The planes, in order, one array per component. See CopyBrushPlanes().
+    const auto& planes  = bsp.brushPlaneRanges[brushIndex];
+    const float* x      = &bsp.brushPlaneData[planes.first];
+    const float* y      = x + planes.stride;
+    const float* z      = y + planes.stride;
+    const float* d      = z + planes.stride;
+    const auto* types   = &bsp.brushPlaneTypes[planes.first / 4];
+
+    const auto& bounds  = boundsAabb.bounds;
 
     // NOTE: In Q3 CM_TestBoundingBoxInCapsule
     // Seems to skip the first 6 sides of a brush
@@ -96,35 +700,68 @@ TraceResult CheckBrush(
     // they could do that.
     for (int i = 0; i < brush.sideCount; ++i)
     {
-        const auto& brushSide   = bsp.brushSides[brush.firstBrushSideIndex + i];
-        const auto& plane       = bsp.planes[brushSide.planeIndex];
-
-        Vec3 offset =
-        {
-            plane.normal.data[0] < 0 ? bounds.boxMax.data[0] : bounds.boxMin.data[0],
-            plane.normal.data[1] < 0 ? bounds.boxMax.data[1] : bounds.boxMin.data[1],
-            plane.normal.data[2] < 0 ? bounds.boxMax.data[2] : bounds.boxMin.data[2],
-        };
+        const auto type         = types[i];
+        const float distance    = d[i];
 
         // Ray is just a Sphere with a sphereRadius of 0, and a box offset of 0.
         // A sphere has a box offset of 0 as well.
         // A box just has a sphereRadius, like the ray, of 0.
-        float startDistance =
-                DotF(bounds.start + offset, plane.normal) -
-                (bounds.sphereRadius + plane.distance);
+        // So only add the parts the shape has.
+        const float planeDistance =
+                S::cHasRadius ? bounds.sphereRadius + distance : distance;
+
+        float startDistance;
+        float endDistance;
+
+        if (type.axis < Bsp::NonAxial)
+        {
+            // Only one component of the normal isn't 0 (and is +-1), so
+            // the dot product is just that component. Same result. The
+            // y and z arrays follow x, stride apart.
+            const auto axis     = type.axis;
+            const float normal  = x[axis * planes.stride + i];
+
+            float start = bounds.start.data[axis];
+            float end   = bounds.end.data[axis];
+
+            if (S::cHasBox)
+            {
+                const float offset = boundsAabb.corners[type.signBits].data[axis];
+
+                start   += offset;
+                end     += offset;
+            }
+
+            startDistance   = start * normal - planeDistance;
+            endDistance     = end * normal - planeDistance;
+        }
+        else
+        {
+            const Vec3 normal = {x[i], y[i], z[i]};
+
+            Vec3 start  = bounds.start;
+            Vec3 end    = bounds.end;
 
-        float endDistance =
-                DotF(bounds.end + offset, plane.normal) -
-                (bounds.sphereRadius + plane.distance);
+            if (S::cHasBox)
+            {
+                const auto& offset = boundsAabb.corners[type.signBits];
+
+                start   = start + offset;
+                end     = end + offset;
+            }
+
+            startDistance   = BrushDotF(start, normal) - planeDistance;
+            endDistance     = BrushDotF(end, normal) - planeDistance;
+        }
 
         if (startDistance > 0)
         {
-            startsOut = true;
+            hits.startsOut = true;
         }
 
         if (endDistance > 0)
         {
-            endsOut = true;
+            hits.endsOut = true;
         }
 
         // make sure the trace isn't completely on one side of the brush
@@ -132,13 +769,8 @@ TraceResult CheckBrush(
         // if (d1 > 0 && ( d2 >= SURFACE_CLIP_EPSILON || d2 >= d1 )  )
         if (startDistance > 0 && endDistance > 0)
         {
-            // both are in front of the plane, its outside of this brush
-            return
-            {
-                nullptr,
-                1.0f,
-                PathInfo::OutsideSolid
-            };
+            // both are in front of the plane, its outside of this brush.
+            return false;
         }
 
         if (startDistance <= 0 && endDistance <= 0)
@@ -153,10 +785,10 @@ TraceResult CheckBrush(
             float fraction =
                 (startDistance - EPSILON) / (startDistance - endDistance);
 
-            if (fraction > startFraction)
+            if (fraction > hits.startFraction)
             {
-                startFraction = fraction;
-                collisionPlane = &plane;
+                hits.startFraction = fraction;
+                hits.collisionSide = i;
             }
         }
         else
@@ -165,34 +797,82 @@ TraceResult CheckBrush(
             float fraction =
                 (startDistance + EPSILON) / (startDistance - endDistance);
 
-            if (fraction < endFraction)
+            if (fraction < hits.endFraction)
             {
-                endFraction = fraction;
+                hits.endFraction = fraction;
             }
         }
     }
 
-    if (startsOut == false)
+
+    return true;
+}
+
+template<typename S>
+bool CheckBrushPlanes(
+        const Bsp::CollisionBsp& bsp,
+        int32_t brushIndex,
+        const TraceBounds& boundsAabb,
+        BrushPlaneHits& hits)
+{
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+    if (!S::cScalar)
+    {
+        return CheckBrushPlanesSimd<S>(bsp, brushIndex, boundsAabb, hits);
+    }
+#endif
+
+    return CheckBrushPlanesScalar<S>(bsp, brushIndex, boundsAabb, hits);
+}
+
+template<typename S>
+TraceResult CheckBrush(
+        const Bsp::CollisionBsp& bsp,
+        int32_t brushIndex,
+        const TraceBounds& boundsAabb,
+        const TraceResult& currentResult)
+{
+    BrushPlaneHits hits;
+
+    if (!CheckBrushPlanes<S>(bsp, brushIndex, boundsAabb, hits))
+    {
+        // Outside one of the planes, so outside of this brush.
+        // Keep whatever earlier brushes hit, as Q3 does.
+        return currentResult;
+    }
+
+    if (hits.startsOut == false)
     {
+        const auto info =
+            hits.endsOut ?
+                PathInfo::StartsInsideEndsOutsideSolid :
+                PathInfo::InsideSolid;
+
+        // Like Q3's startsolid and allsolid, once set it stays set, so it
+        // doesn't matter what order the brushes are tested in.
         return
         {
             currentResult.collisionPlane,
             currentResult.pathFraction,
-            endsOut ?
-                PathInfo::StartsInsideEndsOutsideSolid :
-                PathInfo::InsideSolid
+            info > currentResult.info ? info : currentResult.info
         };
     }
 
-    if (startFraction < endFraction)
+    if (hits.startFraction < hits.endFraction)
     {
-        if (startFraction > -1 && startFraction < currentResult.pathFraction)
+        if (hits.startFraction > -1 && hits.startFraction < currentResult.pathFraction)
         {
+            // Only now go looking for the plane, as it's a scattered load.
+            const auto& brushSide =
+                bsp.brushSides[
+                    bsp.brushes[brushIndex].firstBrushSideIndex +
+                    hits.collisionSide];
+
             return
             {
-                collisionPlane,
-                Clamp0To1(startFraction),
-                PathInfo::OutsideSolid
+                &bsp.planes[brushSide.planeIndex],
+                Clamp0To1(hits.startFraction),
+                currentResult.info
             };
         }
     }
@@ -201,119 +881,145 @@ TraceResult CheckBrush(
     return currentResult;
 }
 
-TraceResult CheckNode(
-    int nodeIndex,
-    float startFraction,
-    float endFraction,
-
-    const Vec3& start,
-    const Vec3& end,
-    const Vec3& extents,
+template<typename S>
+void CheckLeaf(
+    int32_t leafIndex,
     const TraceBounds& boundsAabb,
-
-    TraceResult result,
+    TraceResult& result,
     const Bsp::CollisionBsp& bsp)
 {
-    if (result.pathFraction <= startFraction)
-    {
-        // already hit something nearer
-        return result;
-    }
-
-    if (nodeIndex < 0)
+    if (boundsAabb.leafBrushRanges)
     {
-        // this is a leaf
-        const auto& leaf = bsp.leaves[-(nodeIndex + 1)];
+        // Only has the brushes that can be hit,
+        // see Bsp::BuildLeafBrushLists().
+        const auto& range = boundsAabb.leafBrushRanges[leafIndex];
 
-        for (int i = 0; i < leaf.leafBrushCount; i++)
+        for (int i = 0; i < range.count; i++)
         {
-            const auto& brush =
-                    bsp.brushes[bsp.leafBrushes[leaf.firstLeafBrushIndex + i].brushIndex];
-
-            // Don't even bother if there are no brush sides.
-            if (brush.brush.sideCount <= 0)
-            {
-                continue;
-            }
-
-            // Only test solid brushes
-            // 1 == CONTENTS_SOLID
-            if (!(bsp.textures[brush.brush.textureIndex].contentFlags & 1))
-            {
-                continue;
-            }
+            const auto& entry = bsp.leafBrushEntries[range.first + i];
 
             // Early exit if the AABB doesn't collide.
             if (AabbDontIntersect(
                         boundsAabb.aabbMin,
                         boundsAabb.aabbMax,
-                        brush.aabbMin,
-                        brush.aabbMax))
+                        entry.aabb.aabbMin,
+                        entry.aabb.aabbMax))
+            {
+                continue;
+            }
+
+            if (!FirstTest(*boundsAabb.mailbox, entry.brushIndex, boundsAabb.laneBit))
             {
                 continue;
             }
 
-            result = CheckBrush(bsp, brush.brush, boundsAabb.bounds, result);
+            result = CheckBrush<S>(bsp, entry.brushIndex, boundsAabb, result);
         }
 
-        // don't have to do anything else for leaves
-        return result;
+        return;
     }
 
-    // this is a node
-    const auto& node = bsp.nodes[nodeIndex];
-    const auto& plane = bsp.planes[node.planeIndex];
+    // No list for this mask, so do it the slow way.
+    const auto& leaf = bsp.leaves[leafIndex];
 
-    float startDistance = DotF(start, plane.normal) - plane.distance;
-    float endDistance   = DotF(end, plane.normal) - plane.distance;
+    for (int i = 0; i < leaf.leafBrushCount; i++)
+    {
+        const auto brushIndex =
+                bsp.leafBrushes[leaf.firstLeafBrushIndex + i].brushIndex;
 
-    // Offset used for non-ray tests.
-    const auto& bounds = boundsAabb.bounds;
-    float offset = bounds.sphereRadius;
-
-    // extents are zero for ray or sphere tests.
-    offset +=
-        std::abs(extents.data[0] * plane.normal.data[0]) +
-        std::abs(extents.data[1] * plane.normal.data[1]) +
-        std::abs(extents.data[2] * plane.normal.data[2]);
-
-    if (startDistance >= offset && endDistance >= offset)
-    {
-        // both points are in front of the plane
-        // so check the front child
-        return CheckNode(
-            node.childIndex[0],
-            startFraction,
-            endFraction,
-            start,
-            end,
-            extents,
-            boundsAabb,
-            result,
-            bsp);
-    }
-
-    if (startDistance < -offset && endDistance < -offset)
-    {
-        // both points are behind the plane
-        // so check the back child
-        return CheckNode(
-            node.childIndex[1],
-            startFraction,
-            endFraction,
-            start,
-            end,
-            extents,
-            boundsAabb,
-            result,
-            bsp);
-    }
-
-    // the line spans the splitting plane
-    // Default values assume startDistance == endDistance.
+        const auto& brush = bsp.brushes[brushIndex];
+
+        if  (
+                (brush.sideCount <= 0) ||
+                (!(bsp.textures[brush.textureIndex].contentFlags & boundsAabb.contentsMask))
+            )
+        {
+            continue;
+        }
+
+        const auto& brushAabb = bsp.brushAabbs[brushIndex];
+
+        if (AabbDontIntersect(
+                    boundsAabb.aabbMin,
+                    boundsAabb.aabbMax,
+                    brushAabb.aabbMin,
+                    brushAabb.aabbMax))
+        {
+            continue;
+        }
+
+        if (!FirstTest(*boundsAabb.mailbox, brushIndex, boundsAabb.laneBit))
+        {
+            continue;
+        }
+
+        result = CheckBrush<S>(bsp, brushIndex, boundsAabb, result);
+    }
+}
+
+// How far start and end are in front of the node's plane, returning how
+// far the shape reaches either side of it.
+template<typename S>
+inline float NodeDistances(
+    const Bsp::TraceNode& node,
+    const Vec3& start,
+    const Vec3& end,
+    const Vec3& extents,
+    const Bounds& bounds,
+    float& startDistance,
+    float& endDistance)
+{
+    const auto& plane = node.plane;
+
+    // Offset used for non-ray tests.
+    float offset = S::cHasRadius ? bounds.sphereRadius : 0.0f;
+
+    if (node.type.axis < Bsp::NonAxial)
+    {
+        // Axial, so the same as the full version below
+        // but with only one component that isn't 0.
+        const auto axis = node.type.axis;
+
+        startDistance   = start.data[axis] * plane.normal.data[axis] - plane.distance;
+        endDistance     = end.data[axis] * plane.normal.data[axis] - plane.distance;
+
+        if (S::cHasBox)
+        {
+            offset += extents.data[axis];
+        }
+    }
+    else
+    {
+        startDistance   = DotF(start, plane.normal) - plane.distance;
+        endDistance     = DotF(end, plane.normal) - plane.distance;
+
+        // extents are zero for ray or sphere tests.
+        if (S::cHasBox)
+        {
+            offset +=
+                std::abs(extents.data[0] * plane.normal.data[0]) +
+                std::abs(extents.data[1] * plane.normal.data[1]) +
+                std::abs(extents.data[2] * plane.normal.data[2]);
+        }
+    }
+
+    return offset;
+}
+
+// Where to split a trace that spans a node's plane. Returns the side to
+// check first, with the first side ending at fraction1 and the second
+// starting at fraction2 (they overlap by EPSILON).
+inline int SplitFractions(
+    float startDistance,
+    float endDistance,
+    float offset,
+    float& fraction1,
+    float& fraction2)
+{
+    // Default values assume startDistance == endDistance.
     int side = 0;
-    float fraction1 = 1.0f;
-    float fraction2 = 0.0f;
+    fraction1 = 1.0f;
+    fraction2 = 0.0f;
 
     // split the segment into two
     if (startDistance < endDistance)
@@ -337,60 +1043,273 @@ TraceResult CheckNode(
     fraction1 = Clamp0To1(fraction1);
     fraction2 = Clamp0To1(fraction2);
 
-    // calculate the middle point for the first side
+    return side;
+}
+
+// Walks the tree front to back from current without recursing. The near
+// side of a split is followed straight away and the far side is pushed,
+// so by the time the far side is popped, anything hit on the near side
+// can rule it out. Validation makes sure the tree fits in the stack.
+template<typename S>
+void CheckNodes(
+    TraceStackEntry current,
+    const Vec3& extents,
+    const TraceBounds& boundsAabb,
+    TraceResult& bestResult,
+    const Bsp::CollisionBsp& bsp)
+{
+    TraceStackEntry stack[Bsp::cMaxTraceDepth];
+    unsigned stackCount = 0;
+
+    // Kept local so it can stay in registers.
+    auto result = bestResult;
+
+    while (true)
     {
-        auto middleFraction =
-                startFraction + (endFraction - startFraction) * fraction1;
+        if (current.nodeIndex < 0)
+        {
+            // this is a leaf
+            CheckLeaf<S>(-(current.nodeIndex + 1), boundsAabb, result, bsp);
+
+            // Find the next far side that could still be hit.
+            bool found = false;
+
+            while (stackCount > 0)
+            {
+                current = stack[--stackCount];
+
+                if (result.pathFraction > current.startFraction)
+                {
+                    found = true;
+                    break;
+                }
+
+                // already hit something nearer
+            }
+
+            if (!found)
+            {
+                bestResult = result;
+                return;
+            }
 
-        auto middle = Lerp(start, end, fraction1);
+            continue;
+        }
+
+        // this is a node
+        const auto& node = bsp.traceNodes[current.nodeIndex];
+
+        float startDistance;
+        float endDistance;
+
+        const float offset = NodeDistances<S>(
+                    node,
+                    current.start,
+                    current.end,
+                    extents,
+                    boundsAabb.bounds,
+                    startDistance,
+                    endDistance);
+
+        if (startDistance >= offset && endDistance >= offset)
+        {
+            // both points are in front of the plane
+            // so check the front child
+            current.nodeIndex = node.childIndex[0];
+            continue;
+        }
+
+        if (startDistance < -offset && endDistance < -offset)
+        {
+            // both points are behind the plane
+            // so check the back child
+            current.nodeIndex = node.childIndex[1];
+            continue;
+        }
+
+        // the line spans the splitting plane
+        float fraction1;
+        float fraction2;
+
+        const int side = SplitFractions(
+                    startDistance,
+                    endDistance,
+                    offset,
+                    fraction1,
+                    fraction2);
 
-        // check the first side
-        result = CheckNode(
-            node.childIndex[side],
-            startFraction,
-            middleFraction,
-            start,
-            middle,
-            extents,
-            boundsAabb,
-            result,
-            bsp);
+        const auto fractionLength = current.endFraction - current.startFraction;
+
+        // push the second side for later
+        stack[stackCount++] =
+        {
+            Lerp(current.start, current.end, fraction2),
+            current.end,
+            node.childIndex[!side],
+            current.startFraction + fractionLength * fraction2,
+            current.endFraction
+        };
+
+        // and check the first side now
+        current.end = Lerp(current.start, current.end, fraction1);
+        current.nodeIndex = node.childIndex[side];
+        current.endFraction = current.startFraction + fractionLength * fraction1;
     }
+}
+
+// Walks the brush BVH nearest child first. A node is skipped if the trace's
+// AABB misses it, if the path misses it, or if the path only gets to it
+// after something it's already hit. Validation makes sure the BVH fits in
+// the stack.
+//
+// CheckBrush() pushes each plane out by the radius, the box and EPSILON,
+// which past a sharp edge reaches a lot further than the brush's AABB
+// grown by the same. The node's spread says how much further.
+template<typename S>
+void CheckBvh(
+    const Vec3& extents,
+    const TraceBounds& boundsAabb,
+    TraceResult& bestResult,
+    const Bsp::CollisionBsp& bsp)
+{
+    const auto& bounds = boundsAabb.bounds;
+    const auto delta = bounds.end - bounds.start;
+    const float radius = S::cHasRadius ? bounds.sphereRadius : 0.0f;
+
+    // With axial planes all round, only those limit how far the brushes
+    // reach, and those are only pushed out by the box along their axis.
+    const auto bevelledReach = extents + (radius + EPSILON + cBvhSlack);
+
+    // Otherwise any plane can, and be pushed out up to this far.
+    const float planeOffset =
+        radius + EPSILON + (S::cHasBox ? std::sqrt(DotF(extents, extents)) : 0.0f);
 
-    // calculate the middle point for the second side
+    // Axes the path doesn't move along are left to the AABB test.
+    float inverse[3];
+
+    for (unsigned axis = 0; axis < 3; ++axis)
     {
-        auto middleFraction =
-                startFraction + (endFraction - startFraction) * fraction2;
+        inverse[axis] = delta.data[axis] != 0.0f ? 1.0f / delta.data[axis] : 0.0f;
+    }
 
-        auto middle = Lerp(start, end, fraction2);
+    int32_t stack[Bsp::cMaxTraceDepth];
+    unsigned stackCount = 0;
+    int32_t nodeIndex = 0;
 
-        // check the second side
-        result = CheckNode(
-            node.childIndex[!side],
-            middleFraction,
-            endFraction,
-            middle,
-            end,
-            extents,
-            boundsAabb,
-            result,
-            bsp);
+    // Kept local so it can stay in registers.
+    auto result = bestResult;
+
+    while (true)
+    {
+        const auto& node = bsp.bvhNodes[nodeIndex];
+
+        auto reach = bevelledReach;
+
+        if (node.spread != Bsp::cBvhSpreadOne)
+        {
+            const float spreadReach =
+                node.spread * (1.0f / Bsp::cBvhSpreadOne) * planeOffset + cBvhSlack;
+
+            reach = {spreadReach, spreadReach, spreadReach};
+        }
+
+        // Fractions of the path inside the node, per axis.
+        float enter = 0.0f;
+        float exit  = 1.0f;
+
+        for (unsigned axis = 0; axis < 3; ++axis)
+        {
+            if  (
+                    (inverse[axis] == 0.0f) ||
+                    (node.spread == Bsp::cBvhSpreadUnknown)
+                )
+            {
+                continue;
+            }
+
+            const auto low  = node.aabb.aabbMin.data[axis] - reach.data[axis];
+            const auto high = node.aabb.aabbMax.data[axis] + reach.data[axis];
+            const auto lowFraction  = (low - bounds.start.data[axis]) * inverse[axis];
+            const auto highFraction = (high - bounds.start.data[axis]) * inverse[axis];
+
+            enter   = std::max(enter, std::min(lowFraction, highFraction));
+            exit    = std::min(exit, std::max(lowFraction, highFraction));
+        }
+
+        if  (
+                (enter <= exit) &&
+                (enter <= result.pathFraction) &&
+                (!AabbDontIntersect(
+                    boundsAabb.aabbMin,
+                    boundsAabb.aabbMax,
+                    node.aabb.aabbMin,
+                    node.aabb.aabbMax))
+            )
+        {
+            if (node.brushCount == 0)
+            {
+                // Nearer child now, the other one later.
+                const int32_t children[2] = {nodeIndex + 1, node.index};
+                const bool backwards = delta.data[node.axis] < 0.0f;
+
+                stack[stackCount++] = children[!backwards];
+                nodeIndex = children[backwards];
+
+                continue;
+            }
+
+            for (unsigned i = 0; i < node.brushCount; ++i)
+            {
+                const auto& entry = bsp.bvhBrushes[node.index + i];
+
+                if  (
+                        (!(entry.contentFlags & boundsAabb.contentsMask)) ||
+                        (AabbDontIntersect(
+                            boundsAabb.aabbMin,
+                            boundsAabb.aabbMax,
+                            entry.aabb.aabbMin,
+                            entry.aabb.aabbMax))
+                    )
+                {
+                    continue;
+                }
+
+                // Every brush is in the BVH once, so no mailbox.
+                ++boundsAabb.mailbox->counters.brushTestCount;
+
+                result = CheckBrush<S>(bsp, entry.brushIndex, boundsAabb, result);
+            }
+        }
+
+        if (stackCount == 0)
+        {
+            bestResult = result;
+            return;
+        }
+
+        nodeIndex = stack[--stackCount];
     }
+}
 
-    return result;
+// True if Trace() walks the BVH rather than the node tree, which it does
+// if there is one, and it has the brushes for contentsMask.
+inline bool UsesBrushBvh(const Bsp::CollisionBsp& bsp, int32_t contentsMask)
+{
+    return
+        (!bsp.bvhNodes.empty()) &&
+        (Bsp::FindLeafBrushMask(bsp, contentsMask) >= 0);
 }
 
-// /////////////////////
-// Trace
-// /////////////////////
-TraceResult Trace(
-        const Bsp::CollisionBsp &bsp,
-        const Bounds &bounds)
+// Find the maximum distance per axis from the bounds.
+template<typename S>
+Vec3 GetExtents(const Bounds& bounds)
 {
-    // TODO: Deal with point tests (ray with length of 0).
+    if (!S::cHasBox)
+    {
+        return {0, 0, 0};
+    }
 
-    // Find the maximum distance per axis from the bounds.
-    Vec3 extents =
+    return
     {
         std::abs(bounds.boxMin.data[0]) > std::abs(bounds.boxMax.data[0]) ?
         std::abs(bounds.boxMin.data[0]) :
@@ -403,8 +1322,16 @@ TraceResult Trace(
         std::abs(bounds.boxMin.data[2]) > std::abs(bounds.boxMax.data[2]) ?
         std::abs(bounds.boxMin.data[2]) :
         std::abs(bounds.boxMax.data[2]),
-    };    
+    };
+}
 
+template<typename S>
+TraceBounds GetTraceBounds(
+        const Bsp::CollisionBsp &bsp,
+        const Bounds &bounds,
+        const Vec3& extents,
+        int32_t contentsMask)
+{
     // Create an Axis Aligned Bounding Box (AABB)
     // along the path of the trace, taking into
     // consideration the sphere radius and the
@@ -417,22 +1344,844 @@ TraceResult Trace(
     aabbMax = aabbMax + bounds.sphereRadius;
     aabbMax = aabbMax + extents;
 
-    return CheckNode(
-                0,
-                0.0f,
-                1.0f,
-                bounds.start,
-                bounds.end,
-                extents,
-                {
-                    bounds,
-                    aabbMin,
-                    aabbMax,
-                },
+    TraceBounds boundsAabb =
+    {
+        bounds,
+        aabbMin,
+        aabbMax,
+        {},
+        nullptr,
+        contentsMask,
+        &t_mailbox,
+        1,
+    };
+
+    // Bit n set picks boxMax for axis n, as the plane faces down it.
+    if (S::cHasBox)
+    {
+        for (unsigned signBits = 0; signBits < 8; ++signBits)
+        {
+            for (unsigned axis = 0; axis < 3; ++axis)
+            {
+                boundsAabb.corners[signBits].data[axis] =
+                    (signBits & (1u << axis)) ?
+                        bounds.boxMax.data[axis] :
+                        bounds.boxMin.data[axis];
+            }
+        }
+    }
+
+    const auto maskIndex = Bsp::FindLeafBrushMask(bsp, contentsMask);
+
+    if (maskIndex >= 0)
+    {
+        boundsAabb.leafBrushRanges =
+            &bsp.leafBrushRanges[maskIndex * bsp.leaves.size()];
+    }
+
+    return boundsAabb;
+}
+
+template<typename S>
+TraceResult TraceShape(
+        const Bsp::CollisionBsp &bsp,
+        const Bounds &bounds,
+        int32_t contentsMask)
+{
+    // TODO: Deal with point tests (ray with length of 0).
+    const auto extents = GetExtents<S>(bounds);
+    const auto boundsAabb = GetTraceBounds<S>(bsp, bounds, extents, contentsMask);
+
+    ++t_mailbox.counters.traceCount;
+
+    TraceResult result =
+    {
+        nullptr,
+        1.0f,
+        PathInfo::OutsideSolid
+    };
+
+    // The BVH has the brushes for every mask with leaf brush lists.
+    if (!bsp.bvhNodes.empty() && boundsAabb.leafBrushRanges)
+    {
+        CheckBvh<S>(extents, boundsAabb, result, bsp);
+
+        return result;
+    }
+
+    NewStamp(t_mailbox, bsp);
+
+    CheckNodes<S>(
                 {
-                    nullptr,
-                    1.0f,
-                    PathInfo::OutsideSolid
+                    bounds.start,
+                    bounds.end,
+                    0,
+                    0.0f,
+                    1.0f
                 },
+                extents,
+                boundsAabb,
+                result,
                 bsp);
+
+    return result;
+}
+
+// /////////////////////
+// Packets
+// /////////////////////
+
+// A TraceStackEntry per lane. Only the lanes in lanes are going this way.
+template<unsigned N>
+struct PacketStackEntry
+{
+    float       start[3][N];
+    float       end[3][N];
+    float       startFraction[N];
+    float       endFraction[N];
+    int32_t     nodeIndex;
+    uint32_t    lanes;
+
+    // The lanes that were split to get here, as opposed to ones that only
+    // had to wait their turn. CheckNodes() only prunes split ones.
+    uint32_t    splitLanes;
+};
+
+template<unsigned N>
+struct RayPacket
+{
+    TraceBounds     bounds[N];
+    TraceResult     results[N];
+
+    // Copies of bounds[].aabbMin and aabbMax, a lane per element, so the
+    // AABB tests go a brush at a time for all the lanes.
+    float           aabbMin[3][N];
+    float           aabbMax[3][N];
+};
+
+// CheckPacketNodes()'s stack holds cMaxTraceDepth whole packet entries,
+// which at 16 lanes is over 100KB. Too much for a job system or fiber
+// stack, so it and the packet live on the heap instead, one per thread
+// and packet size, allocated the first time they're used.
+template<unsigned N>
+struct PacketScratch
+{
+    RayPacket<N>        packet;
+    PacketStackEntry<N> stack[Bsp::cMaxTraceDepth];
+};
+
+template<unsigned N>
+PacketScratch<N>& GetPacketScratch()
+{
+    static thread_local std::unique_ptr<PacketScratch<N>> scratch;
+
+    if (!scratch)
+    {
+        scratch = std::make_unique<PacketScratch<N>>();
+    }
+
+    return *scratch;
+}
+
+template<unsigned N>
+TraceStackEntry GetLaneEntry(const PacketStackEntry<N>& entry, unsigned lane)
+{
+    return
+    {
+        {entry.start[0][lane], entry.start[1][lane], entry.start[2][lane]},
+        {entry.end[0][lane], entry.end[1][lane], entry.end[2][lane]},
+        entry.nodeIndex,
+        entry.startFraction[lane],
+        entry.endFraction[lane]
+    };
+}
+
+template<unsigned N>
+void SetLaneEntry(PacketStackEntry<N>& entry, unsigned lane, const TraceStackEntry& laneEntry)
+{
+    for (unsigned axis = 0; axis < 3; ++axis)
+    {
+        entry.start[axis][lane] = laneEntry.start.data[axis];
+        entry.end[axis][lane]   = laneEntry.end.data[axis];
+    }
+
+    entry.startFraction[lane]   = laneEntry.startFraction;
+    entry.endFraction[lane]     = laneEntry.endFraction;
+}
+
+// Finishes these lanes one at a time from where the packet is up to.
+template<unsigned N>
+void CheckLanesAlone(
+    const PacketStackEntry<N>& entry,
+    uint32_t lanes,
+    RayPacket<N>& packet,
+    const Bsp::CollisionBsp& bsp)
+{
+    const Vec3 extents = {0, 0, 0};
+
+    for (; lanes; lanes &= lanes - 1)
+    {
+        const auto lane = LowestLane(lanes);
+
+        CheckNodes<RayShape>(
+                    GetLaneEntry(entry, lane),
+                    extents,
+                    packet.bounds[lane],
+                    packet.results[lane],
+                    bsp);
+    }
+}
+
+// CheckLeaf() for all the lanes, a brush at a time.
+template<unsigned N>
+void CheckPacketLeaf(
+    int32_t leafIndex,
+    uint32_t lanes,
+    RayPacket<N>& packet,
+    const Bsp::CollisionBsp& bsp)
+{
+    // All the lanes have the same contentsMask.
+    const auto* leafBrushRanges = packet.bounds[0].leafBrushRanges;
+
+    if (!leafBrushRanges)
+    {
+        for (; lanes; lanes &= lanes - 1)
+        {
+            const auto lane = LowestLane(lanes);
+
+            CheckLeaf<RayShape>(
+                        leafIndex,
+                        packet.bounds[lane],
+                        packet.results[lane],
+                        bsp);
+        }
+
+        return;
+    }
+
+    const auto& range = leafBrushRanges[leafIndex];
+    auto& mailbox = t_mailbox;
+
+    for (int i = 0; i < range.count; i++)
+    {
+        const auto& entry = bsp.leafBrushEntries[range.first + i];
+        const auto& brushMin = entry.aabb.aabbMin.data;
+        const auto& brushMax = entry.aabb.aabbMax.data;
+
+        // AabbDontIntersect(), a lane at a time.
+        uint32_t hitLanes = 0;
+
+        for (unsigned lane = 0; lane < N; ++lane)
+        {
+            const bool miss =
+                (packet.aabbMin[0][lane] > (brushMax[0] + EPSILON)) |
+                (packet.aabbMin[1][lane] > (brushMax[1] + EPSILON)) |
+                (packet.aabbMin[2][lane] > (brushMax[2] + EPSILON)) |
+                (packet.aabbMax[0][lane] < (brushMin[0] - EPSILON)) |
+                (packet.aabbMax[1][lane] < (brushMin[1] - EPSILON)) |
+                (packet.aabbMax[2][lane] < (brushMin[2] - EPSILON));
+
+            hitLanes |= static_cast<uint32_t>(!miss) << lane;
+        }
+
+        for (hitLanes &= lanes; hitLanes; hitLanes &= hitLanes - 1)
+        {
+            const auto lane = LowestLane(hitLanes);
+
+            if (!FirstTest(mailbox, entry.brushIndex, 1u << lane))
+            {
+                continue;
+            }
+
+            packet.results[lane] = CheckBrush<RayShape>(
+                        bsp,
+                        entry.brushIndex,
+                        packet.bounds[lane],
+                        packet.results[lane]);
+        }
+    }
+}
+
+// CheckNodes() for a packet of rays. Lanes going the same way share the
+// walk; lanes that want a node's children in the other order to the rest
+// are finished off on their own, as is the last lane left. Each lane sees
+// the same nodes and brushes in the same order as it would on its own, so
+// the results are the same as TraceRay()'s.
+template<unsigned N>
+void CheckPacketNodes(
+    uint32_t lanes,
+    PacketScratch<N>& scratch,
+    const Bsp::CollisionBsp& bsp)
+{
+    auto& packet = scratch.packet;
+    auto* stack = scratch.stack;
+    unsigned stackCount = 0;
+
+    PacketStackEntry<N> current;
+
+    for (unsigned lane = 0; lane < N; ++lane)
+    {
+        const auto& bounds = packet.bounds[lane].bounds;
+
+        SetLaneEntry(current, lane, {bounds.start, bounds.end, 0, 0.0f, 1.0f});
+    }
+
+    current.nodeIndex   = 0;
+    current.lanes       = lanes;
+    current.splitLanes  = 0;
+
+    while (true)
+    {
+        if (current.nodeIndex >= 0)
+        {
+            if (LaneCount(current.lanes) > 1)
+            {
+                // this is a node
+                const auto& node = bsp.traceNodes[current.nodeIndex];
+
+                // NodeDistances<RayShape>() for all the lanes at once.
+                const auto& plane = node.plane;
+
+                float startDistance[N];
+                float endDistance[N];
+
+                if (node.type.axis < Bsp::NonAxial)
+                {
+                    const auto axis = node.type.axis;
+                    const float normal = plane.normal.data[axis];
+
+                    for (unsigned lane = 0; lane < N; ++lane)
+                    {
+                        startDistance[lane] = current.start[axis][lane] * normal - plane.distance;
+                        endDistance[lane]   = current.end[axis][lane] * normal - plane.distance;
+                    }
+                }
+                else
+                {
+                    for (unsigned lane = 0; lane < N; ++lane)
+                    {
+                        startDistance[lane] = DotF(
+                            {
+                                current.start[0][lane],
+                                current.start[1][lane],
+                                current.start[2][lane]
+                            },
+                            plane.normal) - plane.distance;
+
+                        endDistance[lane] = DotF(
+                            {
+                                current.end[0][lane],
+                                current.end[1][lane],
+                                current.end[2][lane]
+                            },
+                            plane.normal) - plane.distance;
+                    }
+                }
+
+                // A ray's offset is always 0.
+                uint32_t front      = 0;
+                uint32_t back       = 0;
+                uint32_t backFirst  = 0;
+
+                for (unsigned lane = 0; lane < N; ++lane)
+                {
+                    const float start   = startDistance[lane];
+                    const float end     = endDistance[lane];
+
+                    front       |= static_cast<uint32_t>((start >= 0.0f) & (end >= 0.0f)) << lane;
+                    back        |= static_cast<uint32_t>((start < 0.0f) & (end < 0.0f)) << lane;
+                    backFirst   |= static_cast<uint32_t>(start < end) << lane;
+                }
+
+                front &= current.lanes;
+                back &= current.lanes;
+
+                uint32_t spans = current.lanes & ~(front | back);
+                backFirst &= spans;
+
+                if (backFirst && (spans & ~backFirst))
+                {
+                    // The packet's lost its way. Take the smaller lot out.
+                    auto alone = backFirst;
+
+                    if (LaneCount(alone) * 2 > LaneCount(spans))
+                    {
+                        alone = spans & ~backFirst;
+                    }
+
+                    CheckLanesAlone(current, alone, packet, bsp);
+
+                    current.lanes &= ~alone;
+                    spans &= ~alone;
+                    backFirst &= spans;
+                }
+
+                if (!spans)
+                {
+                    // Nothing to split, each lane only goes one way.
+                    if (front && back)
+                    {
+                        stack[stackCount] = current;
+                        stack[stackCount].nodeIndex = node.childIndex[1];
+                        stack[stackCount].lanes = back;
+                        stack[stackCount].splitLanes = 0;
+                        ++stackCount;
+                    }
+
+                    current.nodeIndex   = node.childIndex[front ? 0 : 1];
+                    current.lanes       = front ? front : back;
+                    current.splitLanes  = 0;
+
+                    continue;
+                }
+
+                const int side = backFirst ? 1 : 0;
+
+                // push the second side for later
+                auto& far = stack[stackCount++];
+
+                far = current;
+                far.nodeIndex   = node.childIndex[!side];
+                far.lanes       = spans | (side ? front : back);
+                far.splitLanes  = spans;
+
+                for (auto split = spans; split; split &= split - 1)
+                {
+                    const auto lane = LowestLane(split);
+                    const auto entry = GetLaneEntry(current, lane);
+
+                    float fraction1;
+                    float fraction2;
+
+                    SplitFractions(
+                        startDistance[lane],
+                        endDistance[lane],
+                        0.0f,
+                        fraction1,
+                        fraction2);
+
+                    const auto fractionLength =
+                            entry.endFraction - entry.startFraction;
+
+                    SetLaneEntry(far, lane,
+                    {
+                        Lerp(entry.start, entry.end, fraction2),
+                        entry.end,
+                        far.nodeIndex,
+                        entry.startFraction + fractionLength * fraction2,
+                        entry.endFraction
+                    });
+
+                    // and check the first side now
+                    SetLaneEntry(current, lane,
+                    {
+                        entry.start,
+                        Lerp(entry.start, entry.end, fraction1),
+                        current.nodeIndex,
+                        entry.startFraction,
+                        entry.startFraction + fractionLength * fraction1
+                    });
+                }
+
+                current.nodeIndex   = node.childIndex[side];
+                current.lanes       = spans | (side ? back : front);
+                current.splitLanes  = 0;
+
+                continue;
+            }
+
+            // Not worth a packet for one lane.
+            CheckLanesAlone(current, current.lanes, packet, bsp);
+        }
+        else
+        {
+            // this is a leaf
+            CheckPacketLeaf(-(current.nodeIndex + 1), current.lanes, packet, bsp);
+        }
+
+        // Find the next far side that could still be hit.
+        bool found = false;
+
+        while (stackCount > 0)
+        {
+            current = stack[--stackCount];
+
+            for (auto split = current.splitLanes & current.lanes; split; split &= split - 1)
+            {
+                const auto lane = LowestLane(split);
+
+                if (packet.results[lane].pathFraction <= current.startFraction[lane])
+                {
+                    // already hit something nearer
+                    current.lanes &= ~(1u << lane);
+                }
+            }
+
+            if (current.lanes)
+            {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+        {
+            return;
+        }
+    }
+}
+
+template<unsigned N>
+void TracePacket(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3* starts,
+        const Vec3* ends,
+        unsigned count,
+        TraceResult* results,
+        int32_t contentsMask)
+{
+    auto& scratch = GetPacketScratch<N>();
+    auto& packet = scratch.packet;
+
+    const Vec3 extents = {0, 0, 0};
+
+    for (unsigned lane = 0; lane < N; ++lane)
+    {
+        // Spare lanes copy the first, but are never used.
+        const auto ray = lane < count ? lane : 0;
+
+        auto& bounds = packet.bounds[lane];
+
+        bounds = GetTraceBounds<RayShape>(
+                    bsp,
+                    {starts[ray], ends[ray], {0, 0, 0}, {0, 0, 0}, 0.0f},
+                    extents,
+                    contentsMask);
+
+        bounds.laneBit = 1u << lane;
+
+        packet.results[lane] = {nullptr, 1.0f, PathInfo::OutsideSolid};
+
+        for (unsigned axis = 0; axis < 3; ++axis)
+        {
+            packet.aabbMin[axis][lane] = bounds.aabbMin.data[axis];
+            packet.aabbMax[axis][lane] = bounds.aabbMax.data[axis];
+        }
+    }
+
+    NewStamp(t_mailbox, bsp);
+    t_mailbox.counters.traceCount += count;
+
+    CheckPacketNodes((1u << count) - 1, scratch, bsp);
+
+    std::copy(packet.results, packet.results + count, results);
+}
+
+// /////////////////////
+// Trace
+// /////////////////////
+TraceResult Trace(
+        const Bsp::CollisionBsp &bsp,
+        const Bounds &bounds)
+{
+    return Trace(bsp, bounds, Bsp::cContentsSolid);
+}
+
+TraceResult Trace(
+        const Bsp::CollisionBsp &bsp,
+        const Bounds &bounds,
+        int32_t contentsMask)
+{
+    switch (GetShapeType(bounds))
+    {
+        case ShapeType::Ray:
+            return TraceShape<RayShape>(bsp, bounds, contentsMask);
+
+        case ShapeType::Sphere:
+            return TraceShape<SphereShape>(bsp, bounds, contentsMask);
+
+        case ShapeType::Box:
+            return TraceShape<BoxShape>(bsp, bounds, contentsMask);
+
+        case ShapeType::RoundedBox:
+        default:
+            return TraceShape<RoundedBoxShape>(bsp, bounds, contentsMask);
+    }
+}
+
+TraceResult TraceRay(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3& start,
+        const Vec3& end,
+        int32_t contentsMask)
+{
+    return TraceShape<RayShape>(
+                bsp,
+                {start, end, {0, 0, 0}, {0, 0, 0}, 0.0f},
+                contentsMask);
+}
+
+TraceResult TraceSphere(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3& start,
+        const Vec3& end,
+        float radius,
+        int32_t contentsMask)
+{
+    return TraceShape<SphereShape>(
+                bsp,
+                {start, end, {0, 0, 0}, {0, 0, 0}, radius},
+                contentsMask);
+}
+
+TraceResult TraceBox(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3& start,
+        const Vec3& end,
+        const Vec3& boxMin,
+        const Vec3& boxMax,
+        int32_t contentsMask)
+{
+    return TraceShape<BoxShape>(
+                bsp,
+                {start, end, boxMin, boxMax, 0.0f},
+                contentsMask);
+}
+
+TraceResult TraceScalar(
+        const Bsp::CollisionBsp& bsp,
+        const Bounds& bounds,
+        int32_t contentsMask)
+{
+    switch (GetShapeType(bounds))
+    {
+        case ShapeType::Ray:
+            return TraceShape<Shape<false, false, true>>(bsp, bounds, contentsMask);
+
+        case ShapeType::Sphere:
+            return TraceShape<Shape<true, false, true>>(bsp, bounds, contentsMask);
+
+        case ShapeType::Box:
+            return TraceShape<Shape<false, true, true>>(bsp, bounds, contentsMask);
+
+        case ShapeType::RoundedBox:
+        default:
+            return TraceShape<Shape<true, true, true>>(bsp, bounds, contentsMask);
+    }
+}
+
+void TraceRays(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3* starts,
+        const Vec3* ends,
+        unsigned count,
+        TraceResult* results,
+        int32_t contentsMask)
+{
+    // Packets share a walk down traceNodes, so with the BVH they're traced
+    // one at a time.
+    if (UsesBrushBvh(bsp, contentsMask))
+    {
+        for (unsigned i = 0; i < count; ++i)
+        {
+            results[i] = TraceRay(bsp, starts[i], ends[i], contentsMask);
+        }
+
+        return;
+    }
+
+    while (count)
+    {
+        const auto packetCount = std::min(count, cMaxRayPacket);
+
+        if (packetCount > 8)
+        {
+            TracePacket<16>(bsp, starts, ends, packetCount, results, contentsMask);
+        }
+        else if (packetCount > 4)
+        {
+            TracePacket<8>(bsp, starts, ends, packetCount, results, contentsMask);
+        }
+        else if (packetCount > 1)
+        {
+            TracePacket<4>(bsp, starts, ends, packetCount, results, contentsMask);
+        }
+        else
+        {
+            *results = TraceRay(bsp, *starts, *ends, contentsMask);
+        }
+
+        starts  += packetCount;
+        ends    += packetCount;
+        results += packetCount;
+        count   -= packetCount;
+    }
+}
+
+// Sorted traces per ParallelFor() chunk. Enough that a thread stays in one
+// part of the map for a while, few enough that the last chunks even out.
+static const std::size_t cBatchChunkSize = 256;
+
+void TraceBatch(
+        const Bsp::CollisionBsp& bsp,
+        Span<const Bounds> bounds,
+        Span<TraceResult> results,
+        int32_t contentsMask,
+        ThreadPool* pool)
+{
+    rAssert(results.size() >= bounds.size());
+
+    if (bounds.empty())
+    {
+        return;
+    }
+
+    // Where the starts are, so the Morton codes use all 10 bits per axis.
+    auto startMin = bounds[0].start;
+    auto startMax = bounds[0].start;
+
+    for (const auto& trace : bounds)
+    {
+        startMin = Min(startMin, trace.start);
+        startMax = Max(startMax, trace.start);
+    }
+
+    float scale[3];
+
+    for (unsigned axis = 0; axis < 3; ++axis)
+    {
+        const float size = startMax.data[axis] - startMin.data[axis];
+
+        scale[axis] = size > 0.0f ? 1023.0f / size : 0.0f;
+    }
+
+    // Shape in the top 2 bits, then the Morton code of the start, then the
+    // index, so sorting groups the shapes and keeps the sort stable.
+    // The pool's threads only use the caller's batch vectors, each writing
+    // its own part, and trace with their own mailboxes.
+    auto& order = t_mailbox.batchOrder;
+
+    order.resize(bounds.size());
+
+    ParallelFor(pool, bounds.size(), cBatchChunkSize, [&] (auto first, auto last)
+    {
+        for (auto i = first; i < last; ++i)
+        {
+            const auto& start = bounds[i].start.data;
+
+            uint32_t key = static_cast<uint32_t>(GetShapeType(bounds[i])) << 30;
+
+            for (unsigned axis = 0; axis < 3; ++axis)
+            {
+                const float scaled = (start[axis] - startMin.data[axis]) * scale[axis];
+
+                // Clamped before the cast, which is undefined for NaN or
+                // anything out of range. Starts like that get cell 0 (or
+                // 1023), they're still traced, just in a worse order.
+                const auto cell =
+                        (scaled > 0.0f) ?
+                            static_cast<uint32_t>(std::min(scaled, 1023.0f)) :
+                            0u;
+
+                key |= SpreadBits(cell) << axis;
+            }
+
+            order[i] = (static_cast<uint64_t>(key) << 32) | i;
+        }
+    });
+
+    // Radix sort on the key, 11 bits at a time. Each pass keeps the order
+    // of the last for equal digits, so equal keys stay in index order.
+    auto& sorted = t_mailbox.batchSorted;
+
+    sorted.resize(order.size());
+
+    for (unsigned shift = 32; shift < 64; shift += 11)
+    {
+        uint32_t offsets[1 << 11] = {};
+
+        for (const auto entry : order)
+        {
+            ++offsets[(entry >> shift) & 0x7ff];
+        }
+
+        uint32_t total = 0;
+
+        for (auto& offset : offsets)
+        {
+            const auto count = offset;
+
+            offset = total;
+            total += count;
+        }
+
+        for (const auto entry : order)
+        {
+            sorted[offsets[(entry >> shift) & 0x7ff]++] = entry;
+        }
+
+        std::swap(order, sorted);
+    }
+
+    // Copy the bounds into the sorted order first, and the results back
+    // out after. Otherwise every trace waits on a cache miss for its
+    // bounds, where this way they're all in flight at once.
+    auto& sortedBounds  = t_mailbox.batchBounds;
+    auto& sortedResults = t_mailbox.batchResults;
+
+    sortedBounds.resize(order.size());
+    sortedResults.resize(order.size());
+
+    ParallelFor(pool, order.size(), cBatchChunkSize, [&] (auto first, auto last)
+    {
+        for (auto i = first; i < last; ++i)
+        {
+            sortedBounds[i] = bounds[static_cast<uint32_t>(order[i])];
+        }
+
+        for (auto i = first; i < last; ++i)
+        {
+            const auto shape = static_cast<ShapeType>(order[i] >> 62);
+            const auto& trace = sortedBounds[i];
+            auto& result = sortedResults[i];
+
+            switch (shape)
+            {
+                case ShapeType::Ray:
+                    result = TraceShape<RayShape>(bsp, trace, contentsMask);
+                    break;
+
+                case ShapeType::Sphere:
+                    result = TraceShape<SphereShape>(bsp, trace, contentsMask);
+                    break;
+
+                case ShapeType::Box:
+                    result = TraceShape<BoxShape>(bsp, trace, contentsMask);
+                    break;
+
+                case ShapeType::RoundedBox:
+                default:
+                    result = TraceShape<RoundedBoxShape>(bsp, trace, contentsMask);
+                    break;
+            }
+        }
+
+        for (auto i = first; i < last; ++i)
+        {
+            results[static_cast<uint32_t>(order[i])] = sortedResults[i];
+        }
+    });
+}
+
+// /////////////////////
+// Counters
+// /////////////////////
+TraceCounters GetTraceCounters()
+{
+    return t_mailbox.counters;
+}
+
+void ResetTraceCounters()
+{
+    t_mailbox.counters = {};
 }
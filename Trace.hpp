@@ -17,10 +17,15 @@
 #pragma once
 
 #include "Geometry.hpp"
+#include "Span.hpp"
+
+#include <cstdint>
 
 // /////////////////////
 // Forward Declarations
 // /////////////////////
+class ThreadPool;
+
 namespace Bsp
 {
     struct CollisionBsp;
@@ -72,3 +77,106 @@ struct TraceResult
 TraceResult Trace(
         const Bsp::CollisionBsp& bsp,
         const Bounds& bounds);
+
+// Only collides with brushes with any of contentsMask's contents. The
+// other version uses CONTENTS_SOLID. Fastest with the masks given to
+// LoadOptions::contentsMasks when the bsp was loaded.
+TraceResult Trace(
+        const Bsp::CollisionBsp& bsp,
+        const Bounds& bounds,
+        int32_t contentsMask);
+
+// For callers that already know their shape. Same as Trace() with the
+// matching Bounds, but skip working out the shape, and the maths for the
+// shapes they aren't. contentsMask defaults to CONTENTS_SOLID.
+TraceResult TraceRay(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3& start,
+        const Vec3& end,
+        int32_t contentsMask = 1);
+
+TraceResult TraceSphere(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3& start,
+        const Vec3& end,
+        float radius,
+        int32_t contentsMask = 1);
+
+TraceResult TraceBox(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3& start,
+        const Vec3& end,
+        const Vec3& boxMin,
+        const Vec3& boxMax,
+        int32_t contentsMask = 1);
+
+// Trace(), but testing brush planes one at a time even in builds with the
+// AVX2 or AVX-512 versions, which have to give exactly the same results.
+// For tests; it's only as fast as a build without them.
+TraceResult TraceScalar(
+        const Bsp::CollisionBsp& bsp,
+        const Bounds& bounds,
+        int32_t contentsMask = 1);
+
+// /////////////////////
+// Packets
+// /////////////////////
+
+/// Most rays TraceRays() walks the tree with at once. No more than 16, as
+/// that's all the mailbox has room for.
+const unsigned cMaxRayPacket = 16;
+
+// For groups of rays that start near each other and go roughly the same
+// way, like shotgun spreads, visibility fans, or lightmap texels. They're
+// walked through the tree in packets of up to cMaxRayPacket, sharing the
+// nodes and brushes they have in common; rays that go their own way are
+// finished off on their own. results[i] is the same as TraceRay() for
+// starts[i] to ends[i]. contentsMask defaults to CONTENTS_SOLID.
+void TraceRays(
+        const Bsp::CollisionBsp& bsp,
+        const Vec3* starts,
+        const Vec3* ends,
+        unsigned count,
+        TraceResult* results,
+        int32_t contentsMask = 1);
+
+// /////////////////////
+// Batches
+// /////////////////////
+
+// For lots of unrelated traces at once, like a server tick's worth. They
+// aren't run in the order given, but sorted by shape and then by where
+// they start (Morton order), so traces run one after the other share the
+// nodes and brushes already in cache. results[i] is the same as Trace()
+// for bounds[i], so results has to be at least as big as bounds.
+//
+// With a pool, the sorted traces are split into chunks across its threads.
+// Each thread traces with its own mailbox, so they share nothing but the
+// bsp, and neighbouring traces still run on the same thread. The traces
+// are counted on the thread that ran them, not the caller.
+void TraceBatch(
+        const Bsp::CollisionBsp& bsp,
+        Span<const Bounds> bounds,
+        Span<TraceResult> results,
+        int32_t contentsMask = 1,
+        ThreadPool* pool = nullptr);
+
+// /////////////////////
+// Counters
+// /////////////////////
+
+// Counts for the Trace() calls made on the calling thread.
+struct TraceCounters
+{
+    uint64_t traceCount         = 0;
+
+    /// Brushes actually tested, after their AABBs passed.
+    uint64_t brushTestCount     = 0;
+
+    /// Brushes in more than one leaf along a trace that would have been
+    /// tested again, but weren't as they'd already been tested that trace.
+    uint64_t repeatBrushCount   = 0;
+};
+
+TraceCounters GetTraceCounters();
+void ResetTraceCounters();
@@ -16,16 +16,15 @@
 
 #include "TraceTest.hpp"
 #include "Trace.hpp"
+#include "VectorMaths3.hpp"
 
 #include <iostream>
 #include <vector>
 #include <random>
 
-std::chrono::microseconds TimeBspCollision(
-        const Bsp::CollisionBsp& bsp,
-        unsigned collisionsToTest)
+// The same random traces every time.
+static std::vector<Bounds> GetTestBounds(unsigned collisionsToTest)
 {
-    // First build array of points to test.
     std::vector<Bounds> testArray;
 
     testArray.reserve(collisionsToTest);
@@ -91,6 +90,16 @@ std::chrono::microseconds TimeBspCollision(
         }
     }
 
+    return testArray;
+}
+
+std::chrono::microseconds TimeBspCollision(
+        const Bsp::CollisionBsp& bsp,
+        unsigned collisionsToTest)
+{
+    // First build array of points to test.
+    const auto testArray = GetTestBounds(collisionsToTest);
+
     // Test the array.
     auto start = std::chrono::high_resolution_clock::now();
     for(const auto& bounds : testArray)
@@ -102,3 +111,89 @@ std::chrono::microseconds TimeBspCollision(
 
     return std::chrono::duration_cast<std::chrono::microseconds>(end - start);
 }
+
+std::chrono::microseconds TimeBspCollisionBatch(
+        const Bsp::CollisionBsp& bsp,
+        unsigned collisionsToTest,
+        ThreadPool* pool)
+{
+    const auto testArray = GetTestBounds(collisionsToTest);
+
+    std::vector<TraceResult> results(testArray.size());
+
+    auto start = std::chrono::high_resolution_clock::now();
+    TraceBatch(bsp, testArray, results, 1, pool);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+}
+
+RaySpreadTimes TimeBspRaySpreads(
+        const Bsp::CollisionBsp& bsp,
+        unsigned spreadsToTest,
+        unsigned raysPerSpread)
+{
+    std::vector<Vec3> starts;
+    std::vector<Vec3> ends;
+
+    starts.reserve(spreadsToTest * raysPerSpread);
+    ends.reserve(spreadsToTest * raysPerSpread);
+
+    // build the arrays.
+    {
+        unsigned seed = 1;
+
+        // Same range as TimeBspCollision(), about 2000 units long.
+        auto e = std::default_random_engine{seed};
+        auto d = std::uniform_real_distribution<float>{-1000, 1000};
+        auto spread = std::uniform_real_distribution<float>{-0.05f, 0.05f};
+
+        for (unsigned i = 0; i < spreadsToTest; ++i)
+        {
+            const Vec3 start = {d(e), d(e), d(e)};
+            const Vec3 direction = Normalise(Vec3{d(e), d(e), d(e)});
+
+            for (unsigned j = 0; j < raysPerSpread; ++j)
+            {
+                const Vec3 jitter = {spread(e), spread(e), spread(e)};
+
+                starts.push_back(start);
+                ends.push_back(start + (direction + jitter) * 2000.0f);
+            }
+        }
+    }
+
+    std::vector<TraceResult> results(starts.size());
+
+    RaySpreadTimes times;
+
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (unsigned i = 0; i < starts.size(); ++i)
+        {
+            results[i] = TraceRay(bsp, starts[i], ends[i]);
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+
+        times.single =
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    }
+
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (unsigned i = 0; i < starts.size(); i += raysPerSpread)
+        {
+            TraceRays(bsp, &starts[i], &ends[i], raysPerSpread, &results[i]);
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+
+        times.packets =
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    }
+
+    return times;
+}
@@ -19,6 +19,8 @@
 // /////////////////////
 // Forward Declarations
 // /////////////////////
+class ThreadPool;
+
 namespace Bsp
 {
     struct CollisionBsp;
@@ -30,3 +32,24 @@ namespace Bsp
 std::chrono::microseconds TimeBspCollision(
         const Bsp::CollisionBsp& bsp,
         unsigned collisionsToTest);
+
+// The same traces as TimeBspCollision(), as one TraceBatch(), split
+// across pool's threads if there is one.
+std::chrono::microseconds TimeBspCollisionBatch(
+        const Bsp::CollisionBsp& bsp,
+        unsigned collisionsToTest,
+        ThreadPool* pool = nullptr);
+
+// Spreads of rays, like shotgun blasts: each spread starts at one point
+// and fans out a little around one direction. Timed traced one at a
+// time with TraceRay(), then as packets with TraceRays().
+struct RaySpreadTimes
+{
+    std::chrono::microseconds single;
+    std::chrono::microseconds packets;
+};
+
+RaySpreadTimes TimeBspRaySpreads(
+        const Bsp::CollisionBsp& bsp,
+        unsigned spreadsToTest,
+        unsigned raysPerSpread);
@@ -15,7 +15,13 @@
 */
 
 #include "Bsp.hpp"
+#include "BspCooked.hpp"
+#include "BspPk3.hpp"
+#include "BspStats.hpp"
+#include "BspShared.hpp"
 #include "BspBrushToMesh.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
 #include "TraceTest.hpp"
 #include "VectorMaths3.hpp"
 #include "Matrix4x4Maths.hpp"
@@ -30,6 +36,7 @@
 
 #include <vector>
 #include <memory>
+#include <chrono>
 
 #include <cstdlib>
 #include <cstdio>
@@ -127,6 +134,63 @@ Matrix4x4 g_projection;
 void DoGraphics(const Bsp::CollisionBsp& bsp);
 
 
+void PrintLoadTimings(
+        const Bsp::CollisionBsp& bsp,
+        Bsp::LoadTimings& timings,
+        ThreadPool& threadPool)
+{
+    using namespace std::chrono;
+
+    // Time to first trace.
+    {
+        auto start = steady_clock::now();
+
+        Trace(bsp, Bounds
+        {
+            {0, 0, 0},
+            {1, 1, 1},
+            {0, 0, 0},
+            {0, 0, 0},
+            0.0f
+        });
+
+        timings.stages.push_back(
+        {
+            "First trace",
+            duration_cast<microseconds>(steady_clock::now() - start)
+        });
+    }
+
+    printf("Load stages (%u threads):\n", threadPool.ThreadCount());
+
+    long total = 0;
+
+    for (const auto& stage : timings.stages)
+    {
+        printf("  %-24s %8ld us\n", stage.name, static_cast<long>(stage.time.count()));
+        total += static_cast<long>(stage.time.count());
+    }
+
+    printf("  %-24s %8ld us\n\n", "Time to first trace", total);
+
+    // Not part of a server load, but it's the slow bit for the viewer.
+    {
+        auto start = steady_clock::now();
+
+        auto mesh = Bsp::BrushMeshesAsTriangleListWithNormals(
+                    bsp,
+                    ~0u,
+                    &threadPool);
+
+        auto time = duration_cast<microseconds>(steady_clock::now() - start);
+
+        printf(
+            "  %-24s %8ld us\n",
+            "Brush meshes (viewer)",
+            static_cast<long>(time.count()));
+    }
+}
+
 void PrintHelp()
 {
     printf("\n");
@@ -134,14 +198,41 @@ void PrintHelp()
 
     printf("  Renders or does a collsion detection benchmark on a quake3 bsp.\n\n");
 
-    printf("  MessyBsp [-b] [-h] [-f <path to quake3 bsp>]\n\n");
+    printf("  MessyBsp [-b] [-l] [-s] [-h] [-f <path to quake3 bsp>]\n");
+    printf("           [-c <cooked file to write>] [-k <cooked file to use>]\n");
+    printf("           [-m <shared memory name>] [-p <pk3 file>]\n\n");
 
     printf("  -b:  Benchmark 100,000 random collision tests\n");
-    printf("       Prints the cost in Microseconds. Otherwise\n");
+    printf("       Prints the cost in Microseconds, with the nodes\n");
+    printf("       clustered and in file order, and as one batch,\n");
+    printf("       then with a BVH over the brushes instead.\n");
+    printf("       Then 10,000 spreads of 16 rays, one at a time\n");
+    printf("       and as packets. Then 1,000,000 tests as one batch\n");
+    printf("       on 1 thread up to one per core, with how well it\n");
+    printf("       scales (100%% is twice as fast on twice the\n");
+    printf("       threads). Otherwise\n");
     printf("       Renders all the solid brushes using opengl.\n\n");
 
+    printf("  -l:  Prints how long each stage of loading the bsp takes,\n");
+    printf("       up to and including the first trace, in Microseconds.\n\n");
+
+    printf("  -s:  Prints how much memory the loaded bsp uses, and\n");
+    printf("       stats on its shape (brushes per leaf, etc).\n\n");
+
     printf("  -f:  Quake3 bsp file to use. Defaults to 'final.bsp'.\n\n");
 
+    printf("  -c:  Cooks the bsp into a trace ready cache file, then exits.\n\n");
+
+    printf("  -k:  Loads the cooked cache file instead of the bsp if it's\n");
+    printf("       up to date. Falls back to the bsp otherwise.\n\n");
+
+    printf("  -m:  Shares one read only copy of the map between processes\n");
+    printf("       using this shared memory name (eg '/messybsp-final').\n");
+    printf("       The first process to use the name publishes the map.\n\n");
+
+    printf("  -p:  Loads the bsp straight out of this pk3 file, in which\n");
+    printf("       case -f is the path inside it (eg 'maps/final.bsp').\n\n");
+
     printf("  -h:  This help text.\n");
     printf("\n");
 }
@@ -149,12 +240,18 @@ void PrintHelp()
 int main(int argc, char *argv[])
 {
     bool benchmark = false;
+    bool loadBenchmark = false;
+    bool printStats = false;
     char fileName[1024];
+    char cookFileName[1024] = {};
+    char cookedFileName[1024] = {};
+    char sharedName[1024] = {};
+    char pk3FileName[1024] = {};
 
     strcpy(fileName, "final.bsp");
 
     // Parse options
-    while (auto ch = getopt(argc, argv, "hbf:"))
+    while (auto ch = getopt(argc, argv, "hblsf:c:k:m:p:"))
     {
         if (ch < 0)
         {
@@ -176,19 +273,63 @@ int main(int argc, char *argv[])
             }
         }
 
+        if (ch == 'c')
+        {
+            if (optarg)
+            {
+                strncpy(cookFileName, optarg, sizeof(cookFileName) - 1);
+            }
+        }
+
+        if (ch == 'k')
+        {
+            if (optarg)
+            {
+                strncpy(cookedFileName, optarg, sizeof(cookedFileName) - 1);
+            }
+        }
+
+        if (ch == 'm')
+        {
+            if (optarg)
+            {
+                strncpy(sharedName, optarg, sizeof(sharedName) - 1);
+            }
+        }
+
+        if (ch == 'p')
+        {
+            if (optarg)
+            {
+                strncpy(pk3FileName, optarg, sizeof(pk3FileName) - 1);
+            }
+        }
+
         if (ch == 'b')
         {
             benchmark = true;
         }
+
+        if (ch == 'l')
+        {
+            loadBenchmark = true;
+        }
+
+        if (ch == 's')
+        {
+            printStats = true;
+        }
     }
 
     {
-        auto fileHandleExists = fopen(fileName, "r");
+        const char* fileToOpen = pk3FileName[0] ? pk3FileName : fileName;
+
+        auto fileHandleExists = fopen(fileToOpen, "r");
         if (!fileHandleExists)
         {
             PrintHelp();
             printf("---------------------------\n");
-            printf("File '%s' cannot be opened.\n", fileName);
+            printf("File '%s' cannot be opened.\n", fileToOpen);
             printf("---------------------------\n");
             return -1;
         }
@@ -196,15 +337,136 @@ int main(int argc, char *argv[])
         fclose(fileHandleExists);
     }
 
+    if (cookFileName[0])
+    {
+        if (!Bsp::CookCollisionBsp(fileName, cookFileName))
+        {
+            printf("Cannot cook '%s' into '%s'.\n", fileName, cookFileName);
+            return -1;
+        }
+
+        return 0;
+    }
+
     Bsp::CollisionBsp bsp;
+    Bsp::LoadTimings timings;
+    ThreadPool threadPool;
 
-    Bsp::GetCollisionBsp(fileName, bsp);
+    Bsp::LoadOptions options;
+    options.threadPool = &threadPool;
+    options.timings = loadBenchmark ? &timings : nullptr;
+
+    if (pk3FileName[0])
+    {
+        Bsp::GetCollisionBspFromPk3(pk3FileName, fileName, bsp, options);
+    }
+    else if (sharedName[0])
+    {
+        Bsp::AttachSharedCollisionBsp(sharedName, fileName, bsp, options);
+    }
+    else if (cookedFileName[0])
+    {
+        Bsp::LoadCollisionBsp(fileName, cookedFileName, bsp, options);
+    }
+    else
+    {
+        Bsp::MapCollisionBsp(fileName, bsp, options);
+    }
+
+    if (printStats)
+    {
+        Bsp::PrintCollisionBspStats(Bsp::GetCollisionBspStats(bsp));
+
+        return 0;
+    }
+
+    if (loadBenchmark)
+    {
+        PrintLoadTimings(bsp, timings, threadPool);
+
+        return 0;
+    }
 
     if (benchmark)
     {
+        // Before and after reordering the nodes. Whatever layout the bsp
+        // was loaded with, time both.
+        Bsp::BuildTraceNodes(bsp, &threadPool, Bsp::NodeLayout::FileOrder);
+        auto fileOrder = TimeBspCollision(bsp, 100000);
+
+        Bsp::BuildTraceNodes(bsp, &threadPool, Bsp::NodeLayout::Clustered);
+        ResetTraceCounters();
         auto result = TimeBspCollision(bsp, 100000);
+        auto counters = GetTraceCounters();
 
         printf("Trace Took %ld microseconds\n", result.count());
+        printf("  (%ld with the nodes in file order)\n", fileOrder.count());
+
+        // The same traces again, sorted so they share the cache.
+        auto batch = TimeBspCollisionBatch(bsp, 100000);
+
+        printf("  (%ld as one TraceBatch())\n", static_cast<long>(batch.count()));
+
+        // Repeats are brushes in more than one leaf along a trace,
+        // that mailboxing stopped being tested again.
+        printf(
+            "Brush tests: %llu (%llu without mailboxing, %llu repeats skipped)\n",
+            static_cast<unsigned long long>(counters.brushTestCount),
+            static_cast<unsigned long long>(
+                counters.brushTestCount + counters.repeatBrushCount),
+            static_cast<unsigned long long>(counters.repeatBrushCount));
+
+        // The same traces again with the other backend, which only
+        // tests each brush once so has no repeats to skip.
+        Bsp::BuildBrushBvh(bsp, &threadPool);
+        ResetTraceCounters();
+        auto bvh = TimeBspCollision(bsp, 100000);
+        auto bvhCounters = GetTraceCounters();
+        Bsp::ClearBrushBvh(bsp);
+
+        printf(
+            "Brush BVH: %ld microseconds, %llu brush tests\n",
+            static_cast<long>(bvh.count()),
+            static_cast<unsigned long long>(bvhCounters.brushTestCount));
+
+        // Shotgun style spreads of 16 rays.
+        auto spreads = TimeBspRaySpreads(bsp, 10000, 16);
+
+        printf(
+            "Ray spreads: %ld microseconds one at a time, %ld as packets\n",
+            static_cast<long>(spreads.single.count()),
+            static_cast<long>(spreads.packets.count()));
+
+        // The batch again on more and more threads. Efficiency is how
+        // close it gets to n times faster on n threads.
+        printf("Batch scaling, 1,000,000 traces:\n");
+
+        const auto maxThreads = threadPool.ThreadCount();
+        long oneThread = 0;
+
+        for (unsigned threads = 1; ; threads *= 2)
+        {
+            threads = threads < maxThreads ? threads : maxThreads;
+
+            ThreadPool pool(threads);
+            const auto time = TimeBspCollisionBatch(bsp, 1000000, &pool).count();
+
+            if (threads == 1)
+            {
+                oneThread = time;
+            }
+
+            printf(
+                "  %3u threads: %ld microseconds, %.0f%% efficiency\n",
+                threads,
+                static_cast<long>(time),
+                time ? 100.0 * oneThread / (static_cast<double>(time) * threads) : 0.0);
+
+            if (threads == maxThreads)
+            {
+                break;
+            }
+        }
 
         return 0;
     }
@@ -361,9 +623,12 @@ std::vector<float> MakeTriangles(const Bsp::CollisionBsp& bsp)
 
     if (useBsp)
     {
+        ThreadPool threadPool;
+
         return Bsp::BrushMeshesAsTriangleListWithNormals(
             bsp,
-            maxCount);
+            maxCount,
+            &threadPool);
     }
     else
     {      
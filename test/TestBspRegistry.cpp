@@ -0,0 +1,174 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <Bsp.hpp>
+#include <BspRegistry.hpp>
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Bsp {
+
+// Copies of data/final.bsp under different names, so the registry sees
+// them as different maps. Run from the source directory.
+class TestBspRegistry : public ::testing::Test
+{
+public:
+    virtual void SetUp()
+    {
+        auto* file = std::fopen("data/final.bsp", "rb");
+        ASSERT_NE(file, nullptr);
+
+        std::fseek(file, 0, SEEK_END);
+        bytes.resize(static_cast<std::size_t>(std::ftell(file)));
+        std::fseek(file, 0, SEEK_SET);
+
+        const auto read = std::fread(bytes.data(), 1, bytes.size(), file);
+        std::fclose(file);
+
+        ASSERT_EQ(read, bytes.size());
+
+        for (unsigned i = 0; i < cMapCount; ++i)
+        {
+            paths.push_back(
+                ::testing::TempDir() + "MessyBspRegistry" + std::to_string(i) + ".bsp");
+
+            auto* copy = std::fopen(paths.back().c_str(), "wb");
+            ASSERT_NE(copy, nullptr);
+
+            const auto written = std::fwrite(bytes.data(), 1, bytes.size(), copy);
+            std::fclose(copy);
+
+            ASSERT_EQ(written, bytes.size());
+        }
+
+        CollisionBsp bsp;
+        ASSERT_TRUE(GetCollisionBsp("data/final.bsp", bsp));
+
+        mapByteCount = CollisionBspByteCount(bsp);
+    }
+
+    virtual void TearDown()
+    {
+        for (const auto& path : paths)
+        {
+            std::remove(path.c_str());
+        }
+    }
+
+protected:
+    static const unsigned cMapCount = 3;
+
+    std::vector<char>           bytes;
+    std::vector<std::string>    paths;
+    std::size_t                 mapByteCount = 0;
+};
+
+TEST_F(TestBspRegistry, SameMapIsOnlyLoadedOnce)
+{
+    MapRegistry registry(cMapCount * mapByteCount);
+
+    const auto first = registry.Acquire(paths[0]);
+    ASSERT_TRUE(first);
+
+    EXPECT_EQ(registry.Acquire(paths[0]), first);
+
+    // All at once, while another map is loading.
+    const unsigned cThreadCount = 8;
+
+    std::vector<MapHandle> handles(cThreadCount);
+    std::vector<std::thread> threads;
+
+    for (unsigned i = 0; i < cThreadCount; ++i)
+    {
+        threads.emplace_back([&registry, &handles, this, i]
+        {
+            handles[i] = registry.Acquire(paths[1]);
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    ASSERT_TRUE(handles[0]);
+    EXPECT_NE(handles[0], first);
+
+    for (const auto& handle : handles)
+    {
+        EXPECT_EQ(handle, handles[0]);
+    }
+
+    const auto stats = registry.GetStats();
+
+    EXPECT_EQ(stats.loadCount, 2u);
+    EXPECT_EQ(stats.hitCount, cThreadCount);
+    EXPECT_EQ(stats.evictionCount, 0u);
+    EXPECT_EQ(registry.ResidentByteCount(), 2 * mapByteCount);
+}
+
+TEST_F(TestBspRegistry, EvictsLeastRecentlyUsed)
+{
+    // Room for two.
+    MapRegistry registry(2 * mapByteCount + mapByteCount / 2);
+
+    registry.Acquire(paths[0]);
+    registry.Acquire(paths[1]);
+
+    // Makes paths[1] the least recently used.
+    registry.Acquire(paths[0]);
+
+    // Held across its eviction.
+    auto held = registry.Acquire(paths[1]);
+    registry.Acquire(paths[0]);
+
+    registry.Acquire(paths[2]);
+
+    auto stats = registry.GetStats();
+
+    EXPECT_EQ(stats.loadCount, 3u);
+    EXPECT_EQ(stats.evictionCount, 1u);
+    EXPECT_EQ(registry.ResidentByteCount(), 2 * mapByteCount);
+
+    // Still held, so handed out again rather than reloaded. That makes it
+    // resident again, and evicts paths[0], now the least recently used.
+    EXPECT_EQ(registry.Acquire(paths[1]), held);
+
+    stats = registry.GetStats();
+
+    EXPECT_EQ(stats.loadCount, 3u);
+    EXPECT_EQ(stats.evictionCount, 2u);
+
+    // Shrinking the budget evicts straight away, paths[2] first.
+    held.reset();
+    registry.SetByteBudget(mapByteCount);
+
+    EXPECT_EQ(registry.GetStats().evictionCount, 3u);
+    EXPECT_EQ(registry.ResidentByteCount(), mapByteCount);
+
+    // The registry still holds paths[1], but nothing holds paths[0].
+    registry.Acquire(paths[1]);
+    EXPECT_EQ(registry.GetStats().loadCount, 3u);
+
+    registry.Acquire(paths[0]);
+    EXPECT_EQ(registry.GetStats().loadCount, 4u);
+}
+
+} // namespace
@@ -0,0 +1,159 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <Bsp.hpp>
+#include <BspReload.hpp>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Bsp {
+
+// A copy of data/final.bsp that the tests can overwrite. Run from the
+// source directory.
+class TestBspReload : public ::testing::Test
+{
+public:
+    virtual void SetUp()
+    {
+        auto* file = std::fopen("data/final.bsp", "rb");
+        ASSERT_NE(file, nullptr);
+
+        std::fseek(file, 0, SEEK_END);
+        bytes.resize(static_cast<std::size_t>(std::ftell(file)));
+        std::fseek(file, 0, SEEK_SET);
+
+        const auto read = std::fread(bytes.data(), 1, bytes.size(), file);
+        std::fclose(file);
+
+        ASSERT_EQ(read, bytes.size());
+
+        path = ::testing::TempDir() + "MessyBspReload.bsp";
+
+        ASSERT_TRUE(Overwrite(bytes));
+
+        options.extraLumpMask = LumpBit(Entities);
+    }
+
+    virtual void TearDown()
+    {
+        std::remove(path.c_str());
+    }
+
+protected:
+    // In place, the way cp does it, rather than replacing the file.
+    bool Overwrite(const std::vector<char>& with)
+    {
+        auto* file = std::fopen(path.c_str(), "r+b");
+
+        if (!file)
+        {
+            file = std::fopen(path.c_str(), "wb");
+        }
+
+        if (!file)
+        {
+            return false;
+        }
+
+        const auto written = std::fwrite(with.data(), 1, with.size(), file);
+        std::fclose(file);
+
+        return written == with.size();
+    }
+
+    std::vector<char>   bytes;
+    std::string         path;
+    LoadOptions         options;
+};
+
+TEST_F(TestBspReload, VersionUnchangedWhenFileIsPatchedInPlace)
+{
+    LiveCollisionBsp live;
+
+    ASSERT_TRUE(live.Reload(path, options));
+
+    std::vector<::Plane> planes;
+    std::string entities;
+
+    {
+        auto reader = live.Read();
+
+        planes.assign(reader->planes.begin(), reader->planes.end());
+
+        const auto lump = GetEntities(*reader);
+        entities.assign(lump.begin(), lump.end());
+    }
+
+    ASSERT_FALSE(entities.empty());
+
+    // Same size, so a mapping of the old file would see every byte change.
+    ASSERT_TRUE(Overwrite(std::vector<char>(bytes.size(), 0x55)));
+
+    // Doesn't load, so the current version is kept.
+    EXPECT_FALSE(live.Reload(path, options));
+    EXPECT_EQ(live.Version(), 1u);
+
+    auto reader = live.Read();
+
+    ASSERT_EQ(reader->planes.size(), planes.size());
+    EXPECT_EQ(
+        std::memcmp(reader->planes.data(), planes.data(), planes.size() * sizeof(::Plane)),
+        0);
+
+    const auto lump = GetEntities(*reader);
+    EXPECT_EQ(std::string(lump.begin(), lump.end()), entities);
+}
+
+TEST_F(TestBspReload, OnDoneCanReloadAgain)
+{
+    LiveCollisionBsp live;
+
+    std::atomic<unsigned> doneCount{0};
+    std::function<void(bool)> onDone;
+
+    // Both called from the reload thread, which mustn't wait for itself.
+    onDone = [this, &live, &doneCount, &onDone] (bool reloaded)
+    {
+        EXPECT_TRUE(reloaded);
+
+        live.WaitForReload();
+
+        if (doneCount.fetch_add(1) == 0)
+        {
+            live.ReloadInBackground(path, options, onDone);
+        }
+    };
+
+    live.ReloadInBackground(path, options, onDone);
+
+    while (doneCount.load() < 2)
+    {
+        std::this_thread::yield();
+    }
+
+    live.WaitForReload();
+
+    EXPECT_EQ(live.Version(), 2u);
+}
+
+} // namespace
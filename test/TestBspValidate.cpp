@@ -0,0 +1,170 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <Bsp.hpp>
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+namespace Bsp {
+
+// data/final.bsp, read into memory so tests can break it before loading
+// it with ViewCollisionBsp(). Run from the source directory.
+class TestBspValidate : public ::testing::Test
+{
+public:
+    virtual void SetUp()
+    {
+        auto* file = std::fopen("data/final.bsp", "rb");
+        ASSERT_NE(file, nullptr);
+
+        std::fseek(file, 0, SEEK_END);
+        byteCount = static_cast<std::size_t>(std::ftell(file));
+        std::fseek(file, 0, SEEK_SET);
+
+        // uint32_t, as ViewCollisionBsp() wants it 4 byte aligned.
+        original.resize((byteCount + 3) / 4);
+        const auto read = std::fread(original.data(), 1, byteCount, file);
+        std::fclose(file);
+
+        ASSERT_EQ(read, byteCount);
+    }
+
+protected:
+    using Break = std::function<void(Header&, uint8_t*)>;
+
+    template<typename T>
+    static T* LumpData(const Header& header, uint8_t* file, Lumps lump)
+    {
+        return reinterpret_cast<T*>(
+                    file + header.lumps[lump].offsetInBytesFromStartOfFile);
+    }
+
+    template<typename T>
+    static int32_t LumpCount(const Header& header, Lumps lump)
+    {
+        return header.lumps[lump].byteCount / static_cast<int32_t>(sizeof(T));
+    }
+
+    // Loads a copy of the file after breaking it.
+    bool LoadBroken(const Break& breakFile)
+    {
+        data = original;
+
+        auto* file = reinterpret_cast<uint8_t*>(data.data());
+        breakFile(*reinterpret_cast<Header*>(file), file);
+
+        bsp = CollisionBsp{};
+
+        return ViewCollisionBsp(data.data(), byteCount, bsp);
+    }
+
+    std::size_t             byteCount = 0;
+    std::vector<uint32_t>   original;
+    std::vector<uint32_t>   data;
+
+    Bsp::CollisionBsp bsp;
+};
+
+TEST_F(TestBspValidate, UnbrokenFileLoads)
+{
+    ASSERT_TRUE(LoadBroken([] (Header&, uint8_t*) {}));
+
+    std::string error;
+    EXPECT_TRUE(ValidateCollisionBsp(bsp, error)) << error;
+}
+
+TEST_F(TestBspValidate, OutOfRangeIndicesFail)
+{
+    const Break breaks[] =
+    {
+        [] (Header& h, uint8_t* f)
+        {
+            LumpData<Node>(h, f, Nodes)[0].planeIndex = LumpCount<::Plane>(h, Planes);
+        },
+        [] (Header& h, uint8_t* f)
+        {
+            LumpData<Node>(h, f, Nodes)[0].childIndex[0] = LumpCount<Node>(h, Nodes);
+        },
+        [] (Header& h, uint8_t* f)
+        {
+            LumpData<Node>(h, f, Nodes)[0].childIndex[1] = -(LumpCount<Leaf>(h, Leaves) + 1);
+        },
+        [] (Header& h, uint8_t* f)
+        {
+            auto& leaf = LumpData<Leaf>(h, f, Leaves)[0];
+            leaf.firstLeafBrushIndex = LumpCount<LeafBrush>(h, LeafBrushes) - leaf.leafBrushCount + 1;
+        },
+        [] (Header& h, uint8_t* f)
+        {
+            LumpData<Leaf>(h, f, Leaves)[0].leafBrushCount = -1;
+        },
+        [] (Header& h, uint8_t* f)
+        {
+            LumpData<LeafBrush>(h, f, LeafBrushes)[0].brushIndex = -1;
+        },
+        [] (Header& h, uint8_t* f)
+        {
+            auto& brush = LumpData<Brush>(h, f, Brushes)[0];
+            brush.firstBrushSideIndex = LumpCount<BrushSide>(h, BrushSides) - brush.sideCount + 1;
+        },
+        [] (Header& h, uint8_t* f)
+        {
+            LumpData<Brush>(h, f, Brushes)[0].textureIndex = LumpCount<Texture>(h, Textures);
+        },
+        [] (Header& h, uint8_t* f)
+        {
+            LumpData<BrushSide>(h, f, BrushSides)[0].planeIndex = INT32_MIN;
+        },
+    };
+
+    for (const auto& breakFile : breaks)
+    {
+        EXPECT_FALSE(LoadBroken(breakFile));
+        EXPECT_TRUE(bsp.nodes.empty());
+    }
+}
+
+TEST_F(TestBspValidate, LumpsOutsideTheFileFail)
+{
+    const Break breaks[] =
+    {
+        [] (Header& h, uint8_t*)
+        {
+            h.lumps[Planes].byteCount += 1 << 30;
+        },
+        [] (Header& h, uint8_t*)
+        {
+            h.lumps[Brushes].offsetInBytesFromStartOfFile = -4;
+        },
+        [] (Header& h, uint8_t*)
+        {
+            // Misaligned.
+            h.lumps[Nodes].offsetInBytesFromStartOfFile += 2;
+        },
+    };
+
+    for (const auto& breakFile : breaks)
+    {
+        EXPECT_FALSE(LoadBroken(breakFile));
+        EXPECT_TRUE(bsp.nodes.empty());
+    }
+}
+
+} // namespace
@@ -0,0 +1,482 @@
+/*
+    MessyBsp. BSP collision and loading example code.
+    Copyright (C) 2014 Richard Maxwell <jodi.the.tigger@gmail.com>
+    This file is part of MessyBsp
+    MessyBsp is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <Bsp.hpp>
+#include <ThreadPool.hpp>
+#include <Trace.hpp>
+#include <VectorMaths3.hpp>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace Bsp {
+
+// /////////////////////
+// Hand built maps
+// /////////////////////
+
+// Brushes in one leaf, listed in whatever order the test wants them
+// tested in, so results that depend on test order show up.
+class TestTrace : public ::testing::Test
+{
+public:
+    virtual void SetUp()
+    {
+        Texture solid = {};
+        solid.contentFlags = cContentsSolid;
+
+        textures.push_back(solid);
+
+        // Everything is behind x = 1000, so in leaf 0. Leaf 1 is empty.
+        planes.push_back({{1, 0, 0}, 1000});
+        nodes.push_back({0, {-2, -1}, {-4096, -4096, -4096}, {4096, 4096, 4096}});
+    }
+
+protected:
+    int32_t AddBrush(const std::vector<::Plane>& sides)
+    {
+        brushes.push_back(
+        {
+            static_cast<int32_t>(brushSides.size()),
+            static_cast<int32_t>(sides.size()),
+            0
+        });
+
+        for (const auto& side : sides)
+        {
+            brushSides.push_back({static_cast<int32_t>(planes.size()), 0});
+            planes.push_back(side);
+        }
+
+        return static_cast<int32_t>(brushes.size() - 1);
+    }
+
+    int32_t AddBox(const Vec3& min, const Vec3& max)
+    {
+        return AddBrush(
+        {
+            {{-1,  0,  0}, -min.data[0]},
+            {{ 1,  0,  0},  max.data[0]},
+            {{ 0, -1,  0}, -min.data[1]},
+            {{ 0,  1,  0},  max.data[1]},
+            {{ 0,  0, -1}, -min.data[2]},
+            {{ 0,  0,  1},  max.data[2]},
+        });
+    }
+
+    // The box's plane facing along -x.
+    const ::Plane& MinXPlane(int32_t brushIndex)
+    {
+        const auto& side = bsp.brushSides[brushes[brushIndex].firstBrushSideIndex];
+
+        return bsp.planes[side.planeIndex];
+    }
+
+    void Build(const std::vector<int32_t>& leafOrder, TraceBackend backend)
+    {
+        Assemble(leafOrder, backend);
+
+        std::string error;
+        ASSERT_TRUE(ValidateCollisionBsp(bsp, error)) << error;
+    }
+
+    // Build() without the validation, for maps that are meant to fail it.
+    void Assemble(const std::vector<int32_t>& leafOrder, TraceBackend backend)
+    {
+        leafBrushes.clear();
+
+        for (auto brushIndex : leafOrder)
+        {
+            leafBrushes.push_back({brushIndex});
+        }
+
+        leaves.clear();
+        leaves.push_back(
+        {
+            0, 0, {-4096, -4096, -4096}, {4096, 4096, 4096},
+            0, 0, 0, static_cast<int32_t>(leafBrushes.size())
+        });
+        leaves.push_back(
+        {
+            0, 0, {-4096, -4096, -4096}, {4096, 4096, 4096},
+            0, 0, 0, 0
+        });
+
+        bsp = CollisionBsp{};
+        bsp.textures    = textures;
+        bsp.planes      = planes;
+        bsp.nodes       = nodes;
+        bsp.leaves      = leaves;
+        bsp.leafBrushes = leafBrushes;
+        bsp.brushes     = brushes;
+        bsp.brushSides  = brushSides;
+
+        LoadOptions options;
+        options.traceBackend = backend;
+
+        BuildTraceData(bsp, options);
+    }
+
+    // Replaces the one node with depth of them, one behind the other.
+    // Each has the empty leaf in front, so a trace across them all splits
+    // at every depth on its way to leaf 0, behind the last one.
+    void Chain(unsigned depth)
+    {
+        planes.clear();
+        nodes.clear();
+
+        for (unsigned i = 0; i < depth; ++i)
+        {
+            const auto back = (i + 1 < depth) ? static_cast<int32_t>(i + 1) : -1;
+
+            planes.push_back({{1, 0, 0}, 2000.0f - 8.0f * i});
+            nodes.push_back(
+            {
+                static_cast<int32_t>(i),
+                {-2, back},
+                {-4096, -4096, -4096},
+                {4096, 4096, 4096}
+            });
+        }
+    }
+
+    std::vector<Texture>    textures;
+    std::vector<::Plane>    planes;
+    std::vector<Node>       nodes;
+    std::vector<Leaf>       leaves;
+    std::vector<LeafBrush>  leafBrushes;
+    std::vector<Brush>      brushes;
+    std::vector<BrushSide>  brushSides;
+
+    Bsp::CollisionBsp bsp;
+};
+
+const TraceBackend cBackends[] =
+{
+    TraceBackend::NodeTree,
+    TraceBackend::BrushBvh,
+};
+
+TEST_F(TestTrace, HitKeptAfterBrushEntirelyInFront)
+{
+    const Vec3 start    = {0, 0, 0};
+    const Vec3 end      = {100, 100, 0};
+
+    // Hit at x = 40.
+    const auto hit = AddBox({40, 30, -10}, {60, 70, 10});
+
+    // Inside its AABB, but the path is entirely in front of its slanted
+    // side, y <= x - 50.
+    const float s = std::sqrt(0.5f);
+    const auto miss = AddBrush(
+    {
+        {{ 0, -1,  0}, 0},
+        {{ 1,  0,  0}, 100},
+        {{-s,  s,  0}, -50 * s},
+        {{ 0,  0, -1}, 10},
+        {{ 0,  0,  1}, 10},
+    });
+
+    const std::vector<int32_t> orders[] = {{hit, miss}, {miss, hit}};
+
+    for (auto backend : cBackends)
+    {
+        for (const auto& order : orders)
+        {
+            Build(order, backend);
+
+            const TraceResult results[] =
+            {
+                TraceRay(bsp, start, end),
+                TraceSphere(bsp, start, end, 4),
+                TraceBox(bsp, start, end, {-4, -4, -4}, {4, 4, 4}),
+            };
+
+            for (const auto& result : results)
+            {
+                EXPECT_LT(result.pathFraction, 0.4f);
+                EXPECT_GT(result.pathFraction, 0.3f);
+                EXPECT_EQ(result.collisionPlane, &MinXPlane(hit));
+                EXPECT_EQ(result.info, PathInfo::OutsideSolid);
+            }
+        }
+    }
+}
+
+TEST_F(TestTrace, PathInfoIsSticky)
+{
+    // Holds the whole path.
+    const auto around = AddBox({-20, -20, -20}, {20, 20, 20});
+
+    // Only holds the start.
+    const auto start = AddBox({-5, -5, -5}, {5, 5, 5});
+
+    // Hit from outside, after leaving start.
+    const auto ahead = AddBox({50, -5, -5}, {60, 5, 5});
+
+    const std::vector<int32_t> insideOrders[] = {{around, start}, {start, around}};
+    const std::vector<int32_t> aheadOrders[] = {{start, ahead}, {ahead, start}};
+
+    for (auto backend : cBackends)
+    {
+        for (const auto& order : insideOrders)
+        {
+            Build(order, backend);
+
+            EXPECT_EQ(
+                TraceRay(bsp, {0, 0, 0}, {10, 0, 0}).info,
+                PathInfo::InsideSolid);
+        }
+
+        for (const auto& order : aheadOrders)
+        {
+            Build(order, backend);
+
+            const auto result = TraceRay(bsp, {0, 0, 0}, {100, 0, 0});
+
+            EXPECT_EQ(result.info, PathInfo::StartsInsideEndsOutsideSolid);
+            EXPECT_EQ(result.collisionPlane, &MinXPlane(ahead));
+        }
+    }
+}
+
+TEST_F(TestTrace, SliverBrushIsHit)
+{
+    // A long thin wedge. Its two long sides are so nearly parallel that
+    // the corners where they meet need solving in double precision.
+    const float angle = 0.005f;
+    const auto sliver = AddBrush(
+    {
+        {{ 0, -1,  0}, 0},
+        {{-std::sin(angle), std::cos(angle), 0}, 0},
+        {{ 1,  0,  0}, 1000},
+        {{ 0,  0, -1}, 10},
+        {{ 0,  0,  1}, 10},
+    });
+
+    const auto top = brushSides[brushes[sliver].firstBrushSideIndex + 4].planeIndex;
+
+    for (auto backend : cBackends)
+    {
+        Build({sliver}, backend);
+
+        // Down through the thin end, where it's only half a unit wide.
+        const auto result = TraceRay(bsp, {100, 0.25f, 50}, {100, 0.25f, -50});
+
+        EXPECT_NEAR(result.pathFraction, 0.4f, 0.01f);
+        EXPECT_EQ(result.collisionPlane, &bsp.planes[top]);
+    }
+}
+
+TEST_F(TestTrace, TreeAsDeepAsTheTraceStack)
+{
+    Chain(cMaxTraceDepth);
+
+    // Behind all of the nodes' planes.
+    const auto box = AddBox({-80, -10, -10}, {-60, 10, 10});
+
+    Build({box}, TraceBackend::NodeTree);
+
+    const auto result = TraceRay(bsp, {2100, 0, 0}, {-200, 0, 0});
+
+    EXPECT_NEAR(result.pathFraction, 2160.0f / 2300.0f, 0.001f);
+    EXPECT_EQ(result.info, PathInfo::OutsideSolid);
+
+    const auto back = TraceRay(bsp, {-200, 0, 0}, {2100, 0, 0});
+
+    EXPECT_EQ(back.collisionPlane, &MinXPlane(box));
+}
+
+TEST_F(TestTrace, TreeDeeperThanTheTraceStackFails)
+{
+    Chain(cMaxTraceDepth + 1);
+
+    const auto box = AddBox({-80, -10, -10}, {-60, 10, 10});
+
+    Assemble({box}, TraceBackend::NodeTree);
+
+    std::string error;
+    EXPECT_FALSE(ValidateCollisionBsp(bsp, error));
+    EXPECT_NE(error.find("deep"), std::string::npos) << error;
+}
+
+// /////////////////////
+// data/final.bsp
+// /////////////////////
+
+// Every way of tracing has to give exactly what Trace() does, whatever
+// the instruction set. Run from the source directory.
+class TestTraceFinal : public ::testing::Test
+{
+public:
+    virtual void SetUp()
+    {
+        ASSERT_TRUE(GetCollisionBsp("data/final.bsp", bsp));
+
+        // Same range as TraceTest.cpp.
+        auto e = std::default_random_engine{1};
+        auto d = std::uniform_real_distribution<float>{-1000, 1000};
+
+        for (unsigned i = 0; i < cTraceCount; ++i)
+        {
+            Bounds bounds = {{d(e), d(e), d(e)}, {d(e), d(e), d(e)}, {0, 0, 0}, {0, 0, 0}, 0.0f};
+
+            switch (i % 3)
+            {
+                case 1: bounds.sphereRadius = 30.0f; break;
+                case 2: bounds.boxMin = {-20, -90, -20}; bounds.boxMax = {20, 90, 20}; break;
+                default: break;
+            }
+
+            traces.push_back(bounds);
+        }
+
+        // Spreads of 16 nearly parallel rays, for TraceRays().
+        auto spread = std::uniform_real_distribution<float>{-0.05f, 0.05f};
+
+        for (unsigned i = 0; i < cTraceCount / cMaxRayPacket; ++i)
+        {
+            const Vec3 start = {d(e), d(e), d(e)};
+            const Vec3 direction = Normalise(Vec3{d(e), d(e), d(e)});
+
+            for (unsigned j = 0; j < cMaxRayPacket; ++j)
+            {
+                const Vec3 jitter = {spread(e), spread(e), spread(e)};
+
+                starts.push_back(start);
+                ends.push_back(start + (direction + jitter) * 2000.0f);
+            }
+        }
+    }
+
+protected:
+    static const unsigned cTraceCount = 30000;
+
+    static bool Same(const TraceResult& lhs, const TraceResult& rhs)
+    {
+        return
+            (lhs.collisionPlane == rhs.collisionPlane) &&
+            (std::memcmp(&lhs.pathFraction, &rhs.pathFraction, sizeof(float)) == 0) &&
+            (lhs.info == rhs.info);
+    }
+
+    std::vector<TraceResult> TraceAll() const
+    {
+        std::vector<TraceResult> results;
+
+        for (const auto& bounds : traces)
+        {
+            results.push_back(Trace(bsp, bounds));
+        }
+
+        return results;
+    }
+
+    Bsp::CollisionBsp bsp;
+    std::vector<Bounds> traces;
+    std::vector<Vec3> starts;
+    std::vector<Vec3> ends;
+};
+
+TEST_F(TestTraceFinal, SimdMatchesScalar)
+{
+    // The same kernel twice in builds without AVX2 or AVX-512.
+    const auto expected = TraceAll();
+
+    for (unsigned i = 0; i < traces.size(); ++i)
+    {
+        ASSERT_TRUE(Same(TraceScalar(bsp, traces[i]), expected[i])) << "trace " << i;
+    }
+}
+
+TEST_F(TestTraceFinal, RaysMatchTrace)
+{
+    std::vector<TraceResult> results(starts.size());
+
+    for (unsigned i = 0; i < starts.size(); i += cMaxRayPacket)
+    {
+        TraceRays(bsp, &starts[i], &ends[i], cMaxRayPacket, &results[i]);
+    }
+
+    for (unsigned i = 0; i < starts.size(); ++i)
+    {
+        const Bounds bounds = {starts[i], ends[i], {0, 0, 0}, {0, 0, 0}, 0.0f};
+
+        ASSERT_TRUE(Same(results[i], Trace(bsp, bounds))) << "ray " << i;
+        ASSERT_TRUE(Same(results[i], TraceRay(bsp, starts[i], ends[i]))) << "ray " << i;
+    }
+}
+
+TEST_F(TestTraceFinal, BatchMatchesTrace)
+{
+    const auto expected = TraceAll();
+
+    std::vector<TraceResult> results(traces.size());
+
+    TraceBatch(bsp, traces, results);
+
+    for (unsigned i = 0; i < traces.size(); ++i)
+    {
+        ASSERT_TRUE(Same(results[i], expected[i])) << "trace " << i;
+    }
+}
+
+TEST_F(TestTraceFinal, PooledBatchMatchesTrace)
+{
+    const auto expected = TraceAll();
+
+    ThreadPool pool(4);
+
+    std::vector<TraceResult> results(traces.size());
+
+    TraceBatch(bsp, traces, results, cContentsSolid, &pool);
+
+    for (unsigned i = 0; i < traces.size(); ++i)
+    {
+        ASSERT_TRUE(Same(results[i], expected[i])) << "trace " << i;
+    }
+}
+
+TEST_F(TestTraceFinal, BvhNeverMissesATreeHit)
+{
+    const auto tree = TraceAll();
+
+    BuildBrushBvh(bsp);
+
+    const auto bvh = TraceAll();
+
+    // It can find hits the tree misses (brushes poking into leaves that
+    // don't list them), but never the other way round.
+    for (unsigned i = 0; i < traces.size(); ++i)
+    {
+        ASSERT_LE(bvh[i].pathFraction, tree[i].pathFraction) << "trace " << i;
+        ASSERT_GE(bvh[i].info, tree[i].info) << "trace " << i;
+    }
+
+    std::vector<TraceResult> results(traces.size());
+
+    TraceBatch(bsp, traces, results);
+
+    for (unsigned i = 0; i < traces.size(); ++i)
+    {
+        ASSERT_TRUE(Same(results[i], bvh[i])) << "trace " << i;
+    }
+}
+
+} // namespace